@@ -0,0 +1,24 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include <cmath>
+#include "vec3.h"
+
+// The camera orbit from Movie 2, the one the viewer steps through with the 'N' key.
+// Frame f is the view after f + 1 presses.
+struct OrbitPath {
+    double startAngle = 0.05;
+    double step = 0.015;
+    double radius = 5;
+    Vec3 centre = Vec3(3, -1, -1);
+
+    double angleAt(int frame) const {
+        return startAngle + step * (frame + 1);
+    }
+
+    Vec3 cameraAt(double angle) const {
+        return Vec3(centre.x + radius * sin(angle), centre.y, centre.z + radius * cos(angle));
+    }
+};
+
+#endif
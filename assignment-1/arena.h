@@ -0,0 +1,289 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Memory that's used over and over instead of going back to malloc every frame, so once the
+// first frame has warmed things up, rendering doesn't touch the heap while it traces:
+//  - ScratchArena, a bump allocator: allocating is moving a pointer, and everything goes at once
+//    with a rewind or reset. Its blocks are kept, so a reused arena stops allocating.
+//  - threadScratch(), an arena for whichever thread asks. Arenas come from a pool and go back
+//    when the thread ends, so the threads each parallelFor starts reuse the last ones' memory.
+//  - RecyclePool, a few finished objects (frame buffers) kept for the next frame to reuse.
+// Building with -DRT_COUNT_ALLOCATIONS counts every operator new, see the end of the file.
+
+class ScratchArena {
+public:
+    static constexpr size_t alignment = 64;    // a cache line, and enough for any SIMD load
+
+    // where the arena is at, rewind() frees everything allocated after it
+    struct Mark {
+        size_t block = 0;
+        size_t used = 0;
+    };
+
+    explicit ScratchArena(size_t blockBytes = size_t(1) << 20) : blockBytes(blockBytes) {}
+
+    ScratchArena(const ScratchArena&) = delete;
+    ScratchArena& operator=(const ScratchArena&) = delete;
+
+    // count uninitialised Ts, the arena never runs destructors
+    template <typename T>
+    T* allocate(size_t count) {
+        static_assert(std::is_trivially_destructible<T>::value, "the arena doesn't run destructors");
+        static_assert(alignof(T) <= alignment, "over-aligned type");
+        return static_cast<T*>(allocateBytes(count * sizeof(T)));
+    }
+
+    void* allocateBytes(size_t bytes) {
+        bytes = (bytes + alignment - 1) & ~(alignment - 1);
+        while (current < blocks.size()) {
+            Block& block = blocks[current];
+            if (used + bytes <= block.size) {
+                void* p = block.data + used;
+                used += bytes;
+                return p;
+            }
+            // the rest of this block is wasted until the next rewind, the next one may fit
+            current++;
+            used = 0;
+        }
+        // a new block, at least as big as all the others together so a growing arena
+        // needs few of them
+        blocks.push_back(Block(std::max({bytes, blockBytes, capacity()})));
+        used = bytes;
+        return blocks.back().data;
+    }
+
+    Mark mark() const {
+        return {current, used};
+    }
+
+    void rewind(Mark m) {
+        current = m.block;
+        used = m.used;
+    }
+
+    // Frees everything. An arena that needed several blocks gets one of their total size
+    // instead, so from then on it allocates from one block
+    void reset() {
+        if (blocks.size() > 1) {
+            size_t total = capacity();
+            blocks.clear();
+            blocks.push_back(Block(total));
+        }
+        current = 0;
+        used = 0;
+    }
+
+    size_t capacity() const {
+        size_t total = 0;
+        for (const Block& block : blocks) total += block.size;
+        return total;
+    }
+
+private:
+    struct Block {
+        std::unique_ptr<unsigned char[]> memory;
+        unsigned char* data;
+        size_t size;
+
+        explicit Block(size_t bytes) : memory(new unsigned char[bytes + alignment]), size(bytes) {
+            uintptr_t p = reinterpret_cast<uintptr_t>(memory.get());
+            data = memory.get() + ((alignment - p % alignment) % alignment);
+        }
+    };
+
+    size_t blockBytes;
+    std::vector<Block> blocks;
+    size_t current = 0;
+    size_t used = 0;
+};
+
+// Gives back everything allocated in its scope
+class ScratchScope {
+public:
+    ScratchArena& arena;
+    ScratchArena::Mark start;
+
+    explicit ScratchScope(ScratchArena& arena) : arena(arena), start(arena.mark()) {}
+    ~ScratchScope() {
+        arena.rewind(start);
+    }
+
+    ScratchScope(const ScratchScope&) = delete;
+    ScratchScope& operator=(const ScratchScope&) = delete;
+};
+
+// The arenas of threads that have ended, waiting for the next threads
+class ScratchPool {
+public:
+    static ScratchPool& instance() {
+        static ScratchPool pool;
+        return pool;
+    }
+
+    std::unique_ptr<ScratchArena> take() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (free.empty()) return std::unique_ptr<ScratchArena>(new ScratchArena());
+        std::unique_ptr<ScratchArena> arena = std::move(free.back());
+        free.pop_back();
+        return arena;
+    }
+
+    void give(std::unique_ptr<ScratchArena> arena) {
+        arena->reset();
+        std::lock_guard<std::mutex> lock(mutex);
+        free.push_back(std::move(arena));
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ScratchArena>> free;
+};
+
+struct ScratchLease {
+    std::unique_ptr<ScratchArena> arena = ScratchPool::instance().take();
+
+    ~ScratchLease() {
+        ScratchPool::instance().give(std::move(arena));
+    }
+};
+
+// This thread's scratch arena. Use it inside a ScratchScope, things don't outlive the scope
+inline ScratchArena& threadScratch() {
+    thread_local ScratchLease lease;
+    return *lease.arena;
+}
+
+// A few objects kept for reuse, T keeps its memory when it's resized to the same size or
+// smaller (std::vector, FrameBuffer). Threads can take and give back at the same time
+template <typename T>
+class RecyclePool {
+public:
+    static constexpr size_t maxKept = 4;
+
+    static RecyclePool& instance() {
+        static RecyclePool pool;
+        return pool;
+    }
+
+    // a recycled T if there is one, a new one otherwise
+    T take() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (kept.empty()) return T();
+        T object = std::move(kept.back());
+        kept.pop_back();
+        return object;
+    }
+
+    void give(T&& object) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (kept.size() < maxKept) {
+            if (kept.capacity() == 0) kept.reserve(maxKept);
+            kept.push_back(std::move(object));
+        }
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<T> kept;
+};
+
+// Allocation counting. With -DRT_COUNT_ALLOCATIONS the global operator new and delete below
+// count every allocation, in total and per thread, and RT_NO_ALLOCATIONS() marks a scope that
+// must not allocate: any allocation in it is counted in allocationViolations. Without it the
+// counts stay 0 and the macro is empty. The operators are defined right here, so include this
+// with the define from one .cpp only (every program here is one .cpp).
+inline std::atomic<uint64_t> allocationTotal{0};
+inline std::atomic<uint64_t> allocationBytes{0};
+inline std::atomic<uint64_t> allocationViolations{0};
+inline thread_local uint64_t threadAllocations = 0;
+
+class NoAllocationScope {
+public:
+    uint64_t start = threadAllocations;
+
+    NoAllocationScope() = default;
+    ~NoAllocationScope() {
+        if (threadAllocations != start) allocationViolations.fetch_add(threadAllocations - start, std::memory_order_relaxed);
+    }
+
+    NoAllocationScope(const NoAllocationScope&) = delete;
+    NoAllocationScope& operator=(const NoAllocationScope&) = delete;
+};
+
+#if defined(RT_COUNT_ALLOCATIONS)
+
+constexpr bool allocationsCounted = true;
+
+#define RT_NO_ALLOCATIONS() NoAllocationScope rtNoAllocations
+
+inline void* countedAllocation(size_t bytes, size_t align) {
+    allocationTotal.fetch_add(1, std::memory_order_relaxed);
+    allocationBytes.fetch_add(bytes, std::memory_order_relaxed);
+    threadAllocations++;
+    if (bytes == 0) bytes = 1;
+    if (align <= alignof(std::max_align_t)) return std::malloc(bytes);
+    return std::aligned_alloc(align, (bytes + align - 1) / align * align);
+}
+
+void* operator new(size_t bytes) {
+    void* p = countedAllocation(bytes, 0);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+void* operator new[](size_t bytes) {
+    return operator new(bytes);
+}
+void* operator new(size_t bytes, const std::nothrow_t&) noexcept {
+    return countedAllocation(bytes, 0);
+}
+void* operator new[](size_t bytes, const std::nothrow_t&) noexcept {
+    return countedAllocation(bytes, 0);
+}
+void* operator new(size_t bytes, std::align_val_t align) {
+    void* p = countedAllocation(bytes, static_cast<size_t>(align));
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+void* operator new[](size_t bytes, std::align_val_t align) {
+    return operator new(bytes, align);
+}
+// GCC sees these free() what operator new returned and warns that new and free don't match,
+// here they do: the operator new above is malloc underneath
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { std::free(p); }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#else
+
+constexpr bool allocationsCounted = false;
+
+#define RT_NO_ALLOCATIONS() ((void)0)
+
+#endif
+
+#endif
@@ -0,0 +1,255 @@
+#ifndef BACKGROUNDRENDERER_H
+#define BACKGROUNDRENDERER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "camera.h"
+#include "scene.h"
+#include "framecache.h"
+#include "framequeue.h"
+#include "dynamicresolution.h"
+#include "gbuffer.h"
+#include "scenechanges.h"
+
+// One view the viewer wants on screen
+struct ViewRequest {
+    SceneData scene;
+    bool orthogonal = false;
+    int width = 200, height = 112;
+    Vec3 cameraPosition = Vec3(4, -1, 5);
+    Vec3 camera_up = Vec3(0, -1, 0);
+    Vec3 look_at = Vec3(0, 0, -1);
+    RenderSettings settings;
+    DynamicResolutionSettings dynamicResolution;
+    std::string filename;   // the finished frame is saved here, empty = not saved
+};
+
+// A frame the render thread handed over. final is false for the quick previews.
+struct ViewFrame {
+    CachedFrame image;
+    bool final = false;
+};
+
+// Renders on its own thread so the window never waits for the tracer.
+// Every request is rendered progressively: a preview with one ray per pixel at a resolution
+// that fits the frame time budget (see dynamicresolution.h), scaled up to full size, then
+// full resolution with one ray per pixel, then the real thing with adaptive sampling and
+// whatever else the settings ask for. Each step is handed over as soon as it is done, so a
+// moving camera gets quick previews and a camera that stopped converges to the full frame.
+// A new request cancels whatever is in flight, the rows being traced finish and everything
+// else is dropped. Finished frames go through the frame cache, a cached view skips straight
+// to the final frame. The full resolution steps go through a G-buffer, so when only lights
+// or a few primitives changed just the pixels they affect are traced again, and after a
+// camera move the full resolution preview is reprojected from the last frame.
+//
+// Frames are double buffered: the render thread fills its own buffer and swaps it into the
+// ready slot, takeFrame() swaps the ready slot out again, pixels are never copied or shared
+// between the two threads while one of them is still writing.
+class BackgroundRenderer {
+public:
+    BackgroundRenderer(FrameCache& cache, FrameWriterQueue& writer) : cache(cache), writer(writer), cancel(false), hasRequest(false), hasFrame(false), working(false), stopping(false) {
+        thread = std::thread([this]() { run(); });
+    }
+
+    ~BackgroundRenderer() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stopping = true;
+            cancel = true;
+        }
+        requestAvailable.notify_all();
+        thread.join();
+    }
+
+    BackgroundRenderer(const BackgroundRenderer&) = delete;
+    BackgroundRenderer& operator=(const BackgroundRenderer&) = delete;
+
+    // f is called on the render thread whenever a frame is ready, the viewer uses it to wake
+    // up its event loop. Pass nullptr before whatever f talks to goes away.
+    void onFrameReady(std::function<void()> f) {
+        std::unique_lock<std::mutex> lock(mutex);
+        frameReady = std::move(f);
+    }
+
+    // replaces whatever was asked for before, in flight work is cancelled
+    void request(ViewRequest view) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            pending = std::move(view);
+            hasRequest = true;
+            cancel = true;
+        }
+        requestAvailable.notify_one();
+    }
+
+    // the newest frame since the last call, if there is one
+    bool takeFrame(ViewFrame& frame) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!hasFrame) return false;
+        std::swap(frame, ready);
+        hasFrame = false;
+        return true;
+    }
+
+    // true while a request is waiting or being rendered
+    bool busy() {
+        std::unique_lock<std::mutex> lock(mutex);
+        return hasRequest || working;
+    }
+
+private:
+    FrameCache& cache;
+    FrameWriterQueue& writer;
+    ResolutionController resolution;   // only touched by the render thread
+    GBuffer gbuffer;                    // same
+    std::function<void()> frameReady;
+    std::atomic<bool> cancel;
+    ViewRequest pending;
+    ViewFrame ready;
+    bool hasRequest;
+    bool hasFrame;
+    bool working;
+    bool stopping;
+    std::mutex mutex;
+    std::condition_variable requestAvailable;
+    std::thread thread;
+
+    void run() {
+        while (true) {
+            ViewRequest view;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                requestAvailable.wait(lock, [this]() { return stopping || hasRequest; });
+                if (stopping) return;
+                view = std::move(pending);
+                hasRequest = false;
+                working = true;
+                // cleared under the lock, a request() after this point cancels this view
+                cancel = false;
+            }
+
+            render(view);
+
+            std::unique_lock<std::mutex> lock(mutex);
+            working = false;
+        }
+    }
+
+    void render(ViewRequest& view) {
+        view.settings.cancel = &cancel;
+        uint64_t key = frameKey(hashScene(view.scene.view()), view.orthogonal, view.width, view.height, view.cameraPosition, view.camera_up, view.look_at, view.settings);
+
+        ViewFrame frame;
+        frame.final = true;
+        if (cache.find(key, frame.image)) {
+            publish(frame, view);
+            return;
+        }
+
+        Objects world;
+        buildWorld(view.scene.view(), world);
+        trackSceneChanges(gbuffer, view.scene.view(), view.orthogonal, view.width, view.height, view.cameraPosition, view.camera_up, view.look_at, view.settings.lens);
+
+        // preview steps, each one is skipped when it wouldn't look any different from the next
+        RenderSettings quick = view.settings;
+        quick.sampling.maxSamples = 1;
+        quick.denoise.iterations = 0;
+        bool refines = view.settings.sampling.maxSamples > 1 || view.settings.denoise.iterations > 0;
+        resolution.settings = view.dynamicResolution;
+        double scale = resolution.pickScale(view.width, view.height);
+        // with a G-buffer to update, the full size is quick enough to be the preview. After a
+        // camera move that is only true for the quick step, which reprojects the last frame
+        bool quickUpdate = gbuffer.holds(view.width, 0, view.height) && (!gbuffer.cameraMoved || refines);
+        if (scale < 1.0 && !quickUpdate) {
+            publish(preview(world, view, scale, quick), view);
+        }
+        if (refines) {
+            publish(preview(world, view, 1.0, quick), view);
+        }
+
+        gbuffer.temporal.enabled = false;
+        frame = trace(world, view, view.width, view.height, view.settings, &gbuffer);
+        frame.final = true;
+        if (!cancel) {
+            cache.insert(key, frame.image);
+            publish(frame, view);
+        }
+    }
+
+    ViewFrame trace(const Objects& world, const ViewRequest& view, int width, int height, const RenderSettings& settings, GBuffer* hits = nullptr) {
+        ViewFrame frame;
+        if (cancel) return frame;
+        FrameBuffer hdr = renderHDR(world, view.orthogonal, width, height, view.cameraPosition, view.camera_up, view.look_at, settings, 0, -1, hits);
+        // a cancelled frame isn't worth resolving
+        if (cancel) return frame;
+        auto rgb = std::make_shared<std::vector<unsigned char>>(static_cast<size_t>(width) * height * 3);
+        resolve(hdr, rgb->data(), settings.toneMap);
+        frame.image.width = width;
+        frame.image.height = height;
+        frame.image.rgb = rgb;
+        return frame;
+    }
+
+    // traced at scale times the full size and scaled back up, the time it took teaches the controller
+    ViewFrame preview(const Objects& world, const ViewRequest& view, double scale, const RenderSettings& settings) {
+        int width = std::max(1, static_cast<int>(view.width * scale));
+        int height = std::max(1, static_cast<int>(view.height * scale));
+        auto start = std::chrono::steady_clock::now();
+        // only the full size has a G-buffer, and updating it says nothing about the tracing cost
+        bool full = width == view.width && height == view.height;
+        bool updating = full && gbuffer.holds(width, 0, height);
+        gbuffer.temporal.enabled = true;
+        ViewFrame small = trace(world, view, width, height, settings, full ? &gbuffer : nullptr);
+        if (cancel || !small.image.rgb) return ViewFrame();
+        if (!updating) {
+            resolution.record(width, height, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        }
+
+        if (full) return small;
+
+        auto rgb = std::make_shared<std::vector<unsigned char>>(static_cast<size_t>(view.width) * view.height * 3);
+        start = std::chrono::steady_clock::now();
+        upscaleEdgeAware(small.image.rgb->data(), width, height, rgb->data(), view.width, view.height);
+        resolution.recordUpscale(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        ViewFrame frame;
+        frame.image.width = view.width;
+        frame.image.height = view.height;
+        frame.image.rgb = rgb;
+        return frame;
+    }
+
+    void publish(ViewFrame frame, const ViewRequest& view) {
+        // a cancelled frame is half traced, it never reaches the screen
+        if (cancel || !frame.image.rgb) return;
+
+        if (frame.final && !view.filename.empty()) {
+            FrameJob job;
+            job.filename = view.filename;
+            job.width = frame.image.width;
+            job.height = frame.image.height;
+            job.rgb.reset(new unsigned char[frame.image.rgb->size()]);
+            memcpy(job.rgb.get(), frame.image.rgb->data(), frame.image.rgb->size());
+            writer.push(std::move(job));
+        }
+
+        {
+            // request() raises cancel under this lock, so no frame of an old view gets past here
+            std::unique_lock<std::mutex> lock(mutex);
+            if (cancel) return;
+            std::swap(ready, frame);
+            hasFrame = true;
+            if (frameReady) frameReady();
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,504 @@
+// Benchmarks: the intersection tests, the object scan, castRay and whole frames, on scenes made
+// from a fixed seed so every run (and every release) times exactly the same work.
+// Results go out as JSON, one entry per benchmark, so runs can be kept and compared.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "vec3.h"
+#include "camera.h"
+#include "animation.h"
+#include "parallel.h"
+#include "cpudispatch.h"
+#include "kernels.h"
+#include "vec3simd.h"
+#include "perfcounters.h"
+
+struct BenchOptions {
+    std::string out;                // "" = stdout
+    std::string label;              // anything that tells runs apart, a version or a commit
+    std::vector<std::string> only;  // run only the benchmarks with these names, empty = all
+    std::vector<int> sizes = {10, 100, 1000, 10000, 100000, 1000000};
+    std::vector<std::pair<int, int>> resolutions = {{160, 90}, {320, 180}, {640, 360}, {1280, 720}};
+    int frameMaxPrimitives = 100;   // a frame of 1000 already takes seconds, the scan is linear
+    int frameSizeWidth = 160;
+    double minSeconds = 0.2;        // each repeat runs at least this long
+    int repeats = 3;
+    uint32_t seed = 1;
+    PerfCounters* perf = nullptr;   // read around the repeats with --perf
+};
+
+// one line of the output
+struct BenchResult {
+    std::string name;
+    int primitives = 0;
+    int width = 0;
+    int height = 0;
+    uint64_t operations = 0;    // per repeat: calls, rays or frames
+    double nsPerOp = 0;         // median of the repeats
+    double bestNsPerOp = 0;
+    double raysPerSecond = 0;   // primary rays, from the median
+    double checksum = 0;        // sum of what was computed, the same scene and code give the same sum
+    PerfReading counts;         // CPU counters over all repeats, with --perf
+    uint64_t countedOps = 0;
+};
+
+void printUsage() {
+    std::cout <<
+        "usage: bench [options]\n"
+        "  --out FILE            write the JSON results to FILE (default: stdout)\n"
+        "  --label TEXT          stored with the results, e.g. a version or commit\n"
+        "  --only A,B,...        run only these benchmarks (sphere_hit, sphere_hit_x4,\n"
+        "                        sphere_hit_x8, triangle_hit, tetrahedron_hit, hit_anything,\n"
+        "                        cast_ray, frame, frame_scene)\n"
+        "  --sizes A,B,...       scene sizes in primitives (default 10,100,...,1000000)\n"
+        "  --resolutions WxH,... frame sizes of the default scene (default 160x90,...,1280x720)\n"
+        "  --frame-max N         biggest generated scene rendered as a whole frame (default 100)\n"
+        "  --frame-width N       width of those frames (default 160)\n"
+        "  --min-time S          seconds each repeat runs at least (default 0.2)\n"
+        "  --repeats N           repeats per benchmark, the median is reported (default 3)\n"
+        "  --seed N              seed of the generated scenes and rays (default 1)\n"
+        "  --isa scalar|sse4.2|avx2|avx512\n"
+        "                        run the kernels at this instruction set level\n"
+        "  --perf                add the CPU's counters per operation (cycles, instructions, IPC,\n"
+        "                        cache and branch misses, also per ray), Linux only\n";
+}
+
+std::vector<std::string> splitList(const std::string& text) {
+    std::vector<std::string> items;
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t comma = text.find(',', start);
+        if (comma == std::string::npos) comma = text.size();
+        if (comma > start) items.push_back(text.substr(start, comma - start));
+        start = comma + 1;
+    }
+    return items;
+}
+
+const char* const benchmarkNames[] = {"sphere_hit", "sphere_hit_x4", "sphere_hit_x8", "triangle_hit", "tetrahedron_hit", "hit_anything", "cast_ray", "frame", "frame_scene"};
+
+bool parseArguments(int argc, char** argv, BenchOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                std::cerr << "Error: " << arg << " needs a value" << std::endl;
+                exit(1);
+            }
+            return argv[++i];
+        };
+
+        if (arg == "--help" || arg == "-h") { printUsage(); exit(0); }
+        else if (arg == "--out") options.out = value();
+        else if (arg == "--label") options.label = value();
+        else if (arg == "--only") {
+            options.only = splitList(value());
+            for (const std::string& name : options.only) {
+                if (std::find(std::begin(benchmarkNames), std::end(benchmarkNames), name) == std::end(benchmarkNames)) {
+                    std::cerr << "Error: there's no benchmark called " << name << std::endl;
+                    return false;
+                }
+            }
+        }
+        else if (arg == "--sizes") {
+            options.sizes.clear();
+            for (const std::string& s : splitList(value())) options.sizes.push_back(atoi(s.c_str()));
+        }
+        else if (arg == "--resolutions") {
+            options.resolutions.clear();
+            for (const std::string& r : splitList(value())) {
+                size_t x = r.find('x');
+                if (x == std::string::npos) { std::cerr << "Error: resolution " << r << " isn't WxH" << std::endl; return false; }
+                options.resolutions.push_back({atoi(r.substr(0, x).c_str()), atoi(r.substr(x + 1).c_str())});
+            }
+        }
+        else if (arg == "--frame-max") options.frameMaxPrimitives = atoi(value().c_str());
+        else if (arg == "--frame-width") options.frameSizeWidth = atoi(value().c_str());
+        else if (arg == "--min-time") options.minSeconds = atof(value().c_str());
+        else if (arg == "--repeats") options.repeats = atoi(value().c_str());
+        else if (arg == "--seed") options.seed = static_cast<uint32_t>(strtoul(value().c_str(), nullptr, 10));
+        else if (arg == "--isa") {
+            std::string name = value();
+            IsaLevel level;
+            if (!parseIsa(name, level)) { std::cerr << "Error: unknown instruction set level " << name << std::endl; return false; }
+            if (setIsa(level) != level) std::cerr << "Warning: this CPU doesn't do " << name << ", using " << isaName(activeIsa()) << std::endl;
+        }
+        else if (arg == "--perf") {
+            static PerfCounters counters;
+            if (!counters.open()) std::cerr << "Warning: perf_event_open isn't available, no counters" << std::endl;
+            options.perf = &counters;
+        }
+        else { std::cerr << "Error: unknown option " << arg << std::endl; return false; }
+    }
+
+    if (options.repeats <= 0 || options.minSeconds < 0 || options.frameSizeWidth <= 0) {
+        std::cerr << "Error: bad repeats, min time or frame width" << std::endl;
+        return false;
+    }
+    for (int size : options.sizes) {
+        if (size <= 0) { std::cerr << "Error: bad scene size " << size << std::endl; return false; }
+    }
+    for (const auto& r : options.resolutions) {
+        if (r.first <= 0 || r.second <= 0) { std::cerr << "Error: bad resolution" << std::endl; return false; }
+    }
+    return true;
+}
+
+// Runs work(n) (n operations, returning their checksum) for at least minSeconds per repeat,
+// the number of operations is found on the first repeat and kept for the rest
+template <typename Work>
+BenchResult measure(const BenchOptions& options, const std::string& name, Work work) {
+    using Clock = std::chrono::steady_clock;
+    BenchResult result;
+    result.name = name;
+
+    // warm up, and find how many operations fill minSeconds. The result goes to a volatile,
+    // or the compiler may drop the inlined work and n would run away to its cap
+    uint64_t n = 1;
+    while (true) {
+        auto start = Clock::now();
+        volatile double sink = work(n);
+        (void)sink;
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        if (seconds >= options.minSeconds || n >= (uint64_t(1) << 40)) break;
+        double scale = seconds > 0 ? options.minSeconds / seconds * 1.2 : 16;
+        n = std::max(n + 1, static_cast<uint64_t>(n * std::min(scale, 16.0)));
+    }
+
+    std::vector<double> times;
+    PerfReading before;
+    if (options.perf != nullptr) before = options.perf->read();
+    for (int r = 0; r < options.repeats; r++) {
+        auto start = Clock::now();
+        result.checksum = work(n);
+        times.push_back(std::chrono::duration<double, std::nano>(Clock::now() - start).count() / n);
+    }
+    if (options.perf != nullptr) {
+        result.counts = options.perf->read() - before;
+        result.countedOps = n * options.repeats;
+    }
+    std::sort(times.begin(), times.end());
+    result.operations = n;
+    result.nsPerOp = times[times.size() / 2];
+    result.bestNsPerOp = times.front();
+    return result;
+}
+
+// The generated scenes: count primitives (a third each spheres, triangles and tetrahedra) in a
+// box in front of the default camera, over the default scene's floor and with its lights.
+// Primitives shrink as there are more of them, so the box stays about as full
+SceneData generatedScene(int count, uint32_t seed) {
+    SceneData scene;
+    SampleRng rng(seed, static_cast<uint32_t>(count));
+    auto inBox = [&]() {
+        return Vec3(-3 + 6 * rng.next(), -2 + 2.6 * rng.next(), -4 + 5 * rng.next());
+    };
+    auto offset = [&](double size) {
+        return Vec3(rng.next() - 0.5, rng.next() - 0.5, rng.next() - 0.5) * (2 * size);
+    };
+
+    for (int m = 0; m < 8; m++) {
+        scene.addMaterial(Color(0.2 + rng.next(), 0.2 + rng.next(), 0.2 + rng.next()), m % 2 == 0);
+    }
+    double size = 0.8 / std::cbrt(static_cast<double>(count));
+    for (int i = 0; i < count; i++) {
+        uint32_t material = static_cast<uint32_t>(i % 8);
+        Vec3 c = inBox();
+        switch (i % 3) {
+        case 0:
+            scene.addSphere(c, size * (0.5 + rng.next()), material);
+            break;
+        case 1:
+            scene.addTriangle(c + offset(size), c + offset(size), c + offset(size), material);
+            break;
+        default:
+            scene.addTetrahedron(c + offset(size), c + offset(size), c + offset(size), c + offset(size), material);
+            break;
+        }
+    }
+    scene.addPlane(Vec3(0, -1, 0), 0.8, scene.addMaterial(Color(0.8, 0.1, 0.4), true));
+    scene.addLight(Vec3(0, -2, 3), 4);
+    scene.addLight(Vec3(0, -2, -3), 4);
+    scene.addLight(Vec3(-2, -2, 1), 8);
+    return scene;
+}
+
+// rays from the default camera towards random points of the box, about what a frame shoots
+std::vector<Ray> sceneRays(int count, uint32_t seed) {
+    CameraRecord camera;
+    Vec3 eye = toVec3(camera.position);
+    SampleRng rng(seed, 0x5CE9E);
+    std::vector<Ray> rays;
+    rays.reserve(count);
+    for (int i = 0; i < count; i++) {
+        Vec3 target(-3 + 6 * rng.next(), -2 + 2.8 * rng.next(), -4 + 5 * rng.next());
+        Vec3 direction = (target - eye).unit_vector();
+        rays.push_back(Ray(eye, direction));
+    }
+    return rays;
+}
+
+// rays from all around towards a primitive at the origin, about half of them hit
+std::vector<Ray> primitiveRays(int count, uint32_t seed) {
+    SampleRng rng(seed, 0x9121);
+    std::vector<Ray> rays;
+    rays.reserve(count);
+    for (int i = 0; i < count; i++) {
+        Vec3 origin = Vec3(rng.next() - 0.5, rng.next() - 0.5, rng.next() - 0.5).unit_vector() * 5;
+        Vec3 target(2 * rng.next() - 1, 2 * rng.next() - 1, 2 * rng.next() - 1);
+        Vec3 direction = (target - origin).unit_vector();
+        rays.push_back(Ray(origin, direction));
+    }
+    return rays;
+}
+
+bool selected(const BenchOptions& options, const std::string& name) {
+    return options.only.empty() || std::find(options.only.begin(), options.only.end(), name) != options.only.end();
+}
+
+// Sphere, Triangle or Tetrahedron::hit over the same rays again and again
+template <typename Primitive>
+BenchResult hitBenchmark(const BenchOptions& options, const std::string& name, const Primitive& object) {
+    std::vector<Ray> rays = primitiveRays(4096, options.seed);
+    BenchResult r = measure(options, name, [&](uint64_t n) {
+        double sum = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            HitResult hit = object.hit(rays[i & 4095]);
+            if (hit.t > 0) sum += hit.t;
+        }
+        return sum;
+    });
+    r.primitives = 1;
+    r.raysPerSecond = 1e9 / r.nsPerOp;
+    return r;
+}
+
+// sphereNearRoot on packets (vec3simd.h), Vec3x4f or Vec3x8f: the same rays against the
+// same sphere as sphere_hit, V::lanes rays per call in single precision
+template <typename V>
+BenchResult packetSphereBenchmark(const BenchOptions& options, const std::string& name) {
+    using F = decltype(V().x);
+    const int count = 4096;
+    std::vector<Ray> rays = primitiveRays(count, options.seed);
+    std::vector<float> ox(count), oy(count), oz(count), dx(count), dy(count), dz(count);
+    for (int i = 0; i < count; i++) {
+        ox[i] = static_cast<float>(rays[i].origin.x);
+        oy[i] = static_cast<float>(rays[i].origin.y);
+        oz[i] = static_cast<float>(rays[i].origin.z);
+        dx[i] = static_cast<float>(rays[i].direction.x);
+        dy[i] = static_cast<float>(rays[i].direction.y);
+        dz[i] = static_cast<float>(rays[i].direction.z);
+    }
+    V centre(Vec3(0, 0, 0));
+    F radius(0.8f);
+    BenchResult r = measure(options, name, [&](uint64_t n) {
+        F sum(0.0f);
+        for (uint64_t i = 0; i < n; i += V::lanes) {
+            int at = static_cast<int>(i & (count - 1));
+            V origin = V::load(&ox[at], &oy[at], &oz[at]);
+            V direction = V::load(&dx[at], &dy[at], &dz[at]);
+            F discriminant;
+            F t = sphereNearRoot(origin, direction, centre, radius, discriminant);
+            sum = sum + select((discriminant >= F(0.0f)) & (t > F(0.0f)), t, F(0.0f));
+        }
+        double total = 0;
+        for (int lane = 0; lane < V::lanes; lane++) total += sum[lane];
+        return total;
+    });
+    r.primitives = 1;
+    r.raysPerSecond = 1e9 / r.nsPerOp;
+    return r;
+}
+
+void log(const BenchResult& r) {
+    std::cerr << r.name;
+    if (r.primitives > 0) std::cerr << " " << r.primitives << " primitives";
+    if (r.width > 0) std::cerr << " " << r.width << "x" << r.height;
+    fprintf(stderr, ": %.1f ns (best %.1f)", r.nsPerOp, r.bestNsPerOp);
+    if (r.raysPerSecond > 0) fprintf(stderr, ", %.3g rays/s", r.raysPerSecond);
+    std::cerr << std::endl;
+}
+
+std::string jsonString(const std::string& s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+// ", \"perf\": {...}" with the counters per operation and per ray, null where the machine has none
+std::string perfJson(const BenchResult& r) {
+    if (r.countedOps == 0) return "";
+    double raysPerOp = r.raysPerSecond * r.nsPerOp / 1e9;
+    auto number = [](bool valid, double value) -> std::string {
+        if (!valid) return "null";
+        char text[32];
+        snprintf(text, sizeof(text), "%.3f", value);
+        return text;
+    };
+    auto perOp = [&](PerfEvent event) {
+        return number(r.counts.has(event), static_cast<double>(r.counts[event]) / r.countedOps);
+    };
+    auto perRay = [&](PerfEvent event) {
+        return number(r.counts.has(event) && raysPerOp > 0, static_cast<double>(r.counts[event]) / r.countedOps / raysPerOp);
+    };
+    bool ipc = r.counts.has(PerfEvent::Cycles) && r.counts.has(PerfEvent::Instructions);
+    return ", \"perf\": {\"cycles\": " + perOp(PerfEvent::Cycles) + ", \"instructions\": " + perOp(PerfEvent::Instructions) +
+        ", \"ipc\": " + number(ipc, r.counts.ipc()) + ", \"cache_misses\": " + perOp(PerfEvent::CacheMisses) +
+        ", \"branch_misses\": " + perOp(PerfEvent::BranchMisses) + ", \"cpu_ns\": " + perOp(PerfEvent::TaskClock) +
+        ", \"cache_misses_per_ray\": " + perRay(PerfEvent::CacheMisses) + ", \"branch_misses_per_ray\": " + perRay(PerfEvent::BranchMisses) + "}";
+}
+
+bool writeJson(const BenchOptions& options, const std::vector<BenchResult>& results) {
+    FILE* file = options.out.empty() ? stdout : fopen(options.out.c_str(), "w");
+    if (file == nullptr) {
+        std::cerr << "Error: can't write " << options.out << std::endl;
+        return false;
+    }
+    fprintf(file, "{\n  \"label\": %s,\n  \"isa\": \"%s\",\n  \"threads\": %d,\n  \"seed\": %u,\n  \"min_seconds\": %g,\n  \"repeats\": %d,\n  \"results\": [\n",
+        jsonString(options.label).c_str(), isaName(activeIsa()), workerCount(), options.seed, options.minSeconds, options.repeats);
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        fprintf(file, "    {\"name\": %s, \"primitives\": %d, \"width\": %d, \"height\": %d, \"operations\": %llu, \"ns_per_op\": %.3f, \"best_ns_per_op\": %.3f, \"rays_per_second\": %.1f, \"checksum\": %.17g%s}%s\n",
+            jsonString(r.name).c_str(), r.primitives, r.width, r.height, static_cast<unsigned long long>(r.operations),
+            r.nsPerOp, r.bestNsPerOp, r.raysPerSecond, r.checksum, perfJson(r).c_str(), i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    bool ok = !ferror(file);
+    if (file != stdout) ok = fclose(file) == 0 && ok;
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    BenchOptions options;
+    if (!parseArguments(argc, argv, options)) {
+        printUsage();
+        return 1;
+    }
+
+    std::vector<BenchResult> results;
+    auto add = [&](BenchResult r) {
+        log(r);
+        results.push_back(r);
+    };
+    // the primitives on their own, single threaded
+    if (selected(options, "sphere_hit")) {
+        Sphere sphere(Vec3(0, 0, 0), 0.8);
+        add(hitBenchmark(options, "sphere_hit", sphere));
+    }
+    if (selected(options, "sphere_hit_x4")) {
+        add(packetSphereBenchmark<Vec3x4f>(options, "sphere_hit_x4"));
+    }
+    if (selected(options, "sphere_hit_x8")) {
+        add(packetSphereBenchmark<Vec3x8f>(options, "sphere_hit_x8"));
+    }
+    if (selected(options, "triangle_hit")) {
+        Triangle triangle(Vec3(-1, -0.8, 0.3), Vec3(1, -0.6, -0.2), Vec3(0, 1, 0));
+        add(hitBenchmark(options, "triangle_hit", triangle));
+    }
+    if (selected(options, "tetrahedron_hit")) {
+        Tetrahedron tetrahedron(Vec3(-1, 0.6, -0.2), Vec3(0, 0.6, -0.8), Vec3(-2, 0.6, -0.8), Vec3(-1, -0.35, -0.5));
+        add(hitBenchmark(options, "tetrahedron_hit", tetrahedron));
+    }
+
+    // the object scan and a whole ray (shading, shadow rays, reflections) against growing scenes
+    std::vector<Ray> rays = sceneRays(4096, options.seed);
+    for (int size : options.sizes) {
+        bool scan = selected(options, "hit_anything");
+        bool cast = selected(options, "cast_ray");
+        bool frame = selected(options, "frame_scene") && size <= options.frameMaxPrimitives;
+        if (!scan && !cast && !frame) continue;
+
+        SceneData scene = generatedScene(size, options.seed);
+        Objects world;
+        if (!buildWorld(scene.view(), world)) return 1;
+
+        if (scan) {
+            BenchResult r = measure(options, "hit_anything", [&](uint64_t n) {
+                double sum = 0;
+                for (uint64_t i = 0; i < n; i++) {
+                    HitAnythingResult hit = world.hit_anything(rays[i & 4095], 1000);
+                    if (hit.hit_anything) sum += hit.closest_t;
+                }
+                return sum;
+            });
+            r.primitives = size;
+            r.raysPerSecond = 1e9 / r.nsPerOp;
+            add(r);
+        }
+        if (cast) {
+            BenchResult r = measure(options, "cast_ray", [&](uint64_t n) {
+                double sum = 0;
+                for (uint64_t i = 0; i < n; i++) {
+                    Color c = world.castRay(rays[i & 4095], world, world.lightsource.position, false);
+                    sum += c.x + c.y + c.z;
+                }
+                return sum;
+            });
+            r.primitives = size;
+            r.raysPerSecond = 1e9 / r.nsPerOp;
+            add(r);
+        }
+        if (frame) {
+            CameraRecord camera;
+            int width = options.frameSizeWidth;
+            int height = std::max(1, static_cast<int>(width / (16.0 / 9.0)));
+            BenchResult r = measure(options, "frame_scene", [&](uint64_t n) {
+                double sum = 0;
+                for (uint64_t i = 0; i < n; i++) {
+                    std::unique_ptr<unsigned char[]> rgb(CameraAndScene(world, false, width, height, toVec3(camera.position), toVec3(camera.up), toVec3(camera.lookAt)));
+                    for (int p = 0; p < width * height * 3; p++) sum += rgb[p];
+                }
+                return sum;
+            });
+            r.primitives = size;
+            r.width = width;
+            r.height = height;
+            r.raysPerSecond = width * static_cast<double>(height) * 1e9 / r.nsPerOp;
+            add(r);
+        }
+    }
+
+    // full frames of the default scene, the viewer's first orbit step, on every core
+    if (selected(options, "frame")) {
+        SceneData scene = defaultScene(Vec3(1, 0, -2), Vec3(0.8, -0.3, -1), Vec3(4, 0.2, 1.5));
+        Objects world;
+        if (!buildWorld(scene.view(), world)) return 1;
+        OrbitPath orbit;
+        Vec3 cameraPosition = orbit.cameraAt(orbit.angleAt(0));
+        for (const auto& resolution : options.resolutions) {
+            int width = resolution.first;
+            int height = resolution.second;
+            BenchResult r = measure(options, "frame", [&](uint64_t n) {
+                double sum = 0;
+                for (uint64_t i = 0; i < n; i++) {
+                    std::unique_ptr<unsigned char[]> rgb(CameraAndScene(world, false, width, height, cameraPosition, toVec3(scene.camera.up), toVec3(scene.camera.lookAt)));
+                    for (int p = 0; p < width * height * 3; p++) sum += rgb[p];
+                }
+                return sum;
+            });
+            r.primitives = static_cast<int>(scene.view().primitiveCount());
+            r.width = width;
+            r.height = height;
+            r.raysPerSecond = width * static_cast<double>(height) * 1e9 / r.nsPerOp;
+            add(r);
+        }
+    }
+
+    return writeJson(options, results) ? 0 : 1;
+}
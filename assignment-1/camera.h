@@ -2,160 +2,500 @@
 #define CAMERA_H
 
 #include<cmath>
+#include <atomic>
+#include <chrono>
 #include "vec3.h"
 #include "shader.h"
 #include "objects.h"
 #include "ray.h"
+#include "sampler.h"
+#include "framebuffer.h"
+#include "denoiser.h"
+#include "tonemap.h"
+#include "parallel.h"
+#include "scene.h"
+#include "gbuffer.h"
+#include "camerabasis.h"
+#include "instrument.h"
+#include "heatmap.h"
+#include "perfcounters.h"
+#include "arena.h"
 
 // My camera system is heavily influenced by "Ray Tracing in One Weekend E-Book"
 // I really enjoyed the explanation by Dr. Peter Shirley
 // https://raytracing.github.io/
 
-// I've tried to generate ray direction based on pixel coordinates with fisheye effect
-Vec3 fishRayDirection(int x, int y, double width, double height, double fov) {
-    float aspectRatio = float(width) / float(height);
-    float fovRadians = fov * 3.147 / 180.0;
-    float halfWidth = tan(fovRadians / 2.0);
-    float halfHeight = halfWidth / aspectRatio;
-
-    // Map x, y to [-1, 1]
-    float scaleX = (2.0 * x - width) / width;
-    float scaleY = (2.0 * y - height) / height;
-
-    // Apply fisheye effect
-    float r = sqrt(scaleX * scaleX + scaleY * scaleY);
-    float theta = atan2(scaleY, scaleX);
-    float phi = r * halfWidth * 3.147;
-
-    float dirX = cos(phi) * cos(theta);
-    float dirY = cos(phi) * sin(theta);
-    float dirZ = sin(phi);
-
-    return Vec3(dirX, dirY, dirZ).unit_vector();
+// Where a frame's time went, renderHDR adds to it when RenderSettings::stats points here.
+// Times are summed over all threads, so they're cpu time rather than wall clock time
+struct RenderStats {
+	std::atomic<uint64_t> primaryRays{0};           // first pass rays
+	std::atomic<uint64_t> rayGenNanoseconds{0};     // spent making them
+	std::atomic<double> heatmapMaxCost{0};          // what white stood for in the last heatmap
+	PerfPhases* phases = nullptr;                   // hardware counters of tracing and resolving, when set
+};
+
+
+// Everything about how a frame is rendered that isn't the camera or the scene
+struct RenderSettings {
+	SamplerSettings sampling;
+	DenoiseSettings denoise;
+	ToneMapSettings toneMap;
+	LensSettings lens;
+	RayGenSettings rays;
+	// CameraAndScene draws what each pixel cost instead, when on
+	HeatmapSettings heatmap;
+	// each pixel's cost is added here when set, CameraAndScene does that for the heatmap
+	PixelCosts* costs = nullptr;
+	// where the time went, filled in when set. Not part of the image either
+	RenderStats* stats = nullptr;
+	// set from another thread to give up on the frame, the rows done so far come back as they are.
+	// Not part of the image, so the frame cache ignores it
+	const std::atomic<bool>* cancel = nullptr;
+};
+
+inline bool cancelled(const RenderSettings& settings){
+	return settings.cancel != nullptr && settings.cancel->load(std::memory_order_relaxed);
 }
 
+inline PerfPhases* perfPhases(const RenderSettings& settings){
+	return settings.stats != nullptr ? settings.stats->phases : nullptr;
+}
 
 // My camera system is heavily influenced by "Ray Tracing in One Weekend E-Book"
 // I really enjoyed the explanation by Dr. Peter Shirley
 // https://raytracing.github.io/
-unsigned char* CameraAndScene(bool orthogonal, int width, int height, Vec3 cameraPosition, Vec3 camera_up, Vec3 look_at, Vec3 light_pos, Vec3 sphere1_centre, Vec3 sphere2_centre, Vec3 s3_centre){
-
-	// camera parameters
-	// Vec3 cameraPosition = Vec3(0,-1,10);
-	// cameraPosition = Vec3(4, -1, 5);
-	// Vec3 camera_up = Vec3(0, -1, 0);
-	// Vec3 look_at = Vec3(0, 0, -1);
-	// cameraPosition = Vec3(0, -1, 1);
-
-	auto viewplane_height = 6.0; // 4.2
-	auto viewplane_width = viewplane_height * (static_cast<double>(width)/height);
-
-	// basis vectors for camera
-	Vec3 W = (cameraPosition - look_at).unit_vector();
-	Vec3 U = camera_up.cross(look_at);
-	Vec3 V = W.cross(U);
-
-	// The vectors along the axis(es) of the viewplane
-	// Vec3 viewplane_u = Vec3(viewplane_width, 0, 0);
-	// Vec3 viewplane_v = Vec3(0, -viewplane_height, 0);
+// Renders the world into a linear HDR frame, nothing is clamped here.
+// The camera always covers the full width x height image, but only rows [rowBegin, rowEnd)
+// are traced, the returned frame holds just those rows (rowEnd < 0 means down to the bottom).
+// With a gbuffer only what changed since the last frame that went through it is traced again,
+// the caller tells it what changed with trackSceneChanges() (see gbuffer.h and scenechanges.h).
+FrameBuffer renderHDR(const Objects& world, bool orthogonal, int width, int height, Vec3 cameraPosition, Vec3 camera_up, Vec3 look_at, const RenderSettings& settings = RenderSettings(), int rowBegin = 0, int rowEnd = -1, GBuffer* gbuffer = nullptr){
+	RT_SCOPE("render");
+	PhaseScope tracePhase(perfPhases(settings), Phase::Trace);
+	if(rowEnd < 0){
+		rowEnd = height;
+	}
+	int rows = rowEnd - rowBegin;
 
-	Vec3 viewplane_u = U * viewplane_width;
-	Vec3 viewplane_v = V*-1 * viewplane_height;
 
+	// building the direction table (when it isn't cached) counts as ray generation too
+	auto cameraStart = std::chrono::steady_clock::now();
+	CameraBasis camera(orthogonal, width, height, cameraPosition, camera_up, look_at, settings.lens, settings.rays.tables);
+	if(settings.stats != nullptr){
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - cameraStart).count();
+		settings.stats->rayGenNanoseconds.fetch_add(static_cast<uint64_t>(ns), std::memory_order_relaxed);
+	}
 
-	// The horizontal and vertical delta vectors from pixel to pixel.
-	Vec3 pixel_delta_u = viewplane_u / width;
-	Vec3 pixel_delta_v = viewplane_v / height;
+	const SamplerSettings& sampling = settings.sampling;
 
-	double focalLength = (cameraPosition - look_at).length();
-	if(orthogonal){
-		focalLength = 0.0;
+	// normals, albedo and depth of the first hit, only needed as guides for the denoiser
+	bool writeAOVs = settings.denoise.iterations > 0;
+	AOVBuffers aovs = RecyclePool<AOVBuffers>::instance().take();
+	if(writeAOVs){
+		aovs.resize(width, rows);
 	}
-	// Calculate the location of the upper left pixel.
-	// Vec3 viewplane_upper_left = (cameraPosition - Vec3(0, 0, focalLength)) - viewplane_u/2 - viewplane_v/2;
-	Vec3 viewplane_upper_left = (cameraPosition - (W*focalLength)) - viewplane_u/2 - viewplane_v/2;
 
-	Vec3 initial_pixel = viewplane_upper_left + (pixel_delta_u + pixel_delta_v) * 0.5;
+	// the jittered ray of the next refinement sample of pixel (x, y)
+	auto jitteredRay = [&](int x, int y, SampleRng& rng) -> Ray {
+		if(!camera.thinLens()){
+			return camera.primaryRay(x, y, rng.next() - 0.5, rng.next() - 0.5);
+		}
+		double du = rng.next() - 0.5;
+		double dv = rng.next() - 0.5;
+		double lu = rng.next();
+		double lv = rng.next();
+		return camera.lensRay(x, y, du, dv, lu, lv);
+	};
+
+	// the centre rays of count pixels of row y, timed when anyone is asking
+	int batchSize = std::max(1, std::min(settings.rays.batch, RayBatch::capacity));
+	auto centreRays = [&](int x, int y, int count, RayBatch& batch){
+		if(settings.stats == nullptr){
+			camera.centreRays(x, y, count, batch);
+			return;
+		}
+		auto start = std::chrono::steady_clock::now();
+		camera.centreRays(x, y, count, batch);
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+		settings.stats->rayGenNanoseconds.fetch_add(static_cast<uint64_t>(ns), std::memory_order_relaxed);
+		settings.stats->primaryRays.fetch_add(static_cast<uint64_t>(count), std::memory_order_relaxed);
+	};
+
+	// traces one primary ray. aovIndex >= 0 also records the first hit into the AOV buffers
+	auto tracePixel = [&](const Ray& ray, int aovIndex = -1) -> Color {
+		RT_COUNT(CameraRays, 1);
+		// Color color = traceRay(ray, lightsource_pos, false);
+		if(aovIndex < 0){
+			return world.castRay(ray, world, world.lightsource.position, false);
+		}
 
-	// std::cout << "inital_pixel:" << std::endl;
-	// initial_pixel.print();
+		// same as castRay, but we keep the hit around for the AOVs
+		auto hitResult = world.hit_anything(ray, 1000);
+		if(!hitResult.hit_anything){
+			aovs.write(aovIndex, Vec3(0, 0, 0), Color(0, 0, 0), hitResult.closest_t);
+			return Color(0, 0, 0);
+		}
+		aovs.write(aovIndex, hitResult.normal.unit_vector(), world.material(hitResult.closest_index).color, hitResult.closest_t);
+		return world.applyShading(ray, hitResult.closest_t, hitResult.closest_index, hitResult.normal, false);
+	};
 
-	unsigned char* image = new unsigned char[width*height*3]; // to avoid stack overflow
+	auto writeHitAOVs = [&](const GBufferPixel& hits, int aovIndex){
+		if(aovIndex < 0){
+			return;
+		}
+		const SurfaceHit& primary = hits.primary;
+		if(primary.object < 0){
+			aovs.write(aovIndex, Vec3(0, 0, 0), Color(0, 0, 0), 1000);
+		} else {
+			aovs.write(aovIndex, primary.normal.unit_vector(), world.material(primary.object).color, primary.t);
+		}
+	};
 
-	Vec3 lightsource_pos = Vec3(2,-2,0.5);
+	// shades a pixel centre from its G-buffer hits, the same sums castRay would do
+	auto shadeHits = [&](const Ray& ray, const GBufferPixel& hits) -> Color {
+		const SurfaceHit& primary = hits.primary;
+		if(primary.object < 0){
+			return Color(0, 0, 0);
+		}
+		Color sum = Color(0, 0, 0);
+		if(world.material(primary.object).glazed && hits.reflected.object >= 0){
+			Ray reflected = world.reflectedRay(ray, primary.t, primary.normal);
+			sum = sum + world.applyShading(reflected, hits.reflected.t, hits.reflected.object, hits.reflected.normal, true) * 0.4;
+		}
+		return world.addDirectLight(sum, ray, primary.t, primary.object, primary.normal);
+	};
+
+	// finds the hits of a primary ray, glaze reflections included
+	auto recordPrimary = [&](const Ray& ray, GBufferPixel& hits){
+		hits = GBufferPixel();
+		RT_COUNT(CameraRays, 1);
+		auto hitResult = world.hit_anything(ray, 1000);
+		if(hitResult.hit_anything){
+			hits.primary = {hitResult.closest_index, hitResult.closest_t, hitResult.normal};
+		}
+	};
+	auto recordReflection = [&](const Ray& ray, GBufferPixel& hits){
+		hits.reflected = SurfaceHit();
+		const SurfaceHit& primary = hits.primary;
+		if(primary.object < 0 || !world.material(primary.object).glazed){
+			return;
+		}
+		Ray reflected = world.reflectedRay(ray, primary.t, primary.normal);
+		RT_COUNT(GlazeRays, 1);
+		if(world.hit_anything_for_shadows(reflected)){
+			auto reflectedHit = world.hit_anything(reflected, 1000);
+			if(reflectedHit.hit_anything){
+				hits.reflected = {reflectedHit.closest_index, reflectedHit.closest_t, reflectedHit.normal};
+			}
+		}
+	};
+	auto recordHits = [&](const Ray& ray, GBufferPixel& hits){
+		recordPrimary(ray, hits);
+		recordReflection(ray, hits);
+	};
+
+	// true when any ray castRay traces for these hits (primary, glaze reflection, and the
+	// shadow rays from both hit points) comes near something that changed in layer
+	// (rayTouches doesn't need the direction to be a unit vector, so it isn't made one)
+	auto shadowsTouch = [&](const Vec3& point, const GBufferLayer& layer){
+		for (const auto& light : world.lights){
+			Vec3 intersectionPoint = point;
+			Vec3 towardLight = light.position - intersectionPoint;
+			if(layer.touches(Ray(intersectionPoint, towardLight))){
+				return true;
+			}
+		}
+		return false;
+	};
+	auto pathTouches = [&](const Ray& ray, const GBufferPixel& hits, const GBufferLayer& layer){
+		if(layer.touches(ray)){
+			return true;
+		}
+		const SurfaceHit& primary = hits.primary;
+		if(primary.object < 0){
+			return false;
+		}
+		if(shadowsTouch(ray.pointAt(primary.t), layer)){
+			return true;
+		}
+		if(!world.material(primary.object).glazed){
+			return false;
+		}
+		Ray reflected = world.reflectedRay(ray, primary.t, primary.normal);
+		if(layer.touches(reflected)){
+			return true;
+		}
+		return hits.reflected.object >= 0 && shadowsTouch(reflected.pointAt(hits.reflected.t), layer);
+	};
+
+	bool reuseHits = false;
+	bool reprojecting = false;
+	if(gbuffer != nullptr){
+		if(!gbuffer->sameSize(width, rowBegin, rows)){
+			gbuffer->resize(width, rowBegin, rows);
+		}
+		// after a camera move the hits are from somewhere else, only reprojection has a use for them
+		reprojecting = gbuffer->first.valid && gbuffer->cameraMoved && gbuffer->temporal.enabled;
+		reuseHits = gbuffer->first.valid && !gbuffer->cameraMoved;
+	}
 
-	Objects world;
+	// the last frame, when this one is reprojected from it
+	std::vector<GBufferPixel> history;
+	FrameBuffer historyShaded;
+	std::vector<uint8_t> historyAges;
+	if(reprojecting){
+		history.swap(gbuffer->pixels);
+		gbuffer->pixels.resize(history.size());
+		historyShaded = std::move(gbuffer->shaded);
+		historyAges = gbuffer->ages;
+		gbuffer->frame++;
+	}
 
-	// Sphere s1(Vec3(0, 0, -1.1),0.8,Color(1,2,1));
-	// Sphere s2(Vec3(0.9, 0.5, -0.2), 0.3, Color(0.5, 1.68, 1.52));
-	// Plane  p1(Vec3(0, -1, 0), 0.8, Color(1, 2, 1));
-
-	Shader shader;
-	std::shared_ptr<Sphere> sphere_ptr1 = std::make_shared<Sphere>(sphere1_centre, 0.8, Color(0,0,0)*0.75, shader, true); // Vec3(1, 0, -2), Color(2.44,1.94,1.94)*0.75
-	std::shared_ptr<Sphere> sphere_ptr2 = std::make_shared<Sphere>(sphere2_centre, 0.2, Color(0.70, 1.50, 1.84), shader, true);// Color(0.70, 1.50, 1.84)
-	std::shared_ptr<Sphere> sphere_ptr3 = std::make_shared<Sphere>(s3_centre, 0.4, Color(0.3, 0.4, 0.7), shader, true);// Color(0.3, 0.4, 0.7)
-	std::shared_ptr<Plane>  plane_ptr   = std::make_shared<Plane>(Vec3(0, -1, 0), 0.8, Color(0.8,0.1,0.4), shader, true); // 10.32,10.32,10.33 0.8,0.1,0.4 // Color(0.8,0.1,0.4)
-	// std::shared_ptr<Triangle>  triangle1_ptr   = std::make_shared<Triangle>(Vec3(0, -0.4, -0.5), Vec3(-200, -200, -12), Vec3(200, -200, -12), Color(1.33, 2.00, 0.69), shader, false);
-	std::shared_ptr<Tetrahedron>  tetrahedron   = std::make_shared<Tetrahedron>(Vec3(-1, 0.6, -0.2), Vec3(0, 0.6, -0.8), Vec3(-2, 0.6, -0.8), Vec3(-1, -0.35, -0.5), Color(0.70, 1.84, 1.61), shader, true); // Color(1.33, 2.00, 0.69) // Color(0.70, 1.84, 1.61)
-
-
-	// Sunlight sunlight1(light_pos, 12); // Vec3(-3, -2, 1) // 8 with 3
-	// Sunlight sunlight2(Vec3(3, -2, 0), 8);
-	Sunlight sunlight3(Vec3(0, -2, 3), 4);
-	Sunlight sunlight4(Vec3(0, -2, -3), 4);
-	Sunlight sunlight5(Vec3(-2, -2, 1), 8);
-
-	world.addObject(sphere_ptr1);
-	world.addObject(sphere_ptr2);
-	world.addObject(sphere_ptr3);
-	world.addObject(plane_ptr);
-	// world.addObject(triangle1_ptr);
-	world.addObject(tetrahedron);
-	// world.lightsource = sunlight1;
-	// world.addLight(sunlight1);
-	// world.addLight(sunlight2);
-	world.addLight(sunlight3);
-	world.addLight(sunlight4);
-	world.addLight(sunlight5);
-
-	double fisheye_radius = std::min(width, height) / 2.0;
-
-	for (int y = 0; y < height; y++){
-		for (int x = 0; x < width; x++){
-			
-			Vec3 rayOrigin = cameraPosition;
-			auto viewplane_pixel_loc = initial_pixel + (pixel_delta_u * x) + (pixel_delta_v * y);
-			Vec3 rayDirection = (viewplane_pixel_loc - cameraPosition).unit_vector();
-			// rayDirection = fishRayDirection(x, y, width, height, 2);
-
-			if(orthogonal){
-				rayOrigin = initial_pixel + (pixel_delta_u * x) + (pixel_delta_v * y);
-				rayDirection = W*-1;
+	// where the primary hit of a pixel was in the last frame, -1 when it wasn't on screen there,
+	// something else was in front of it, or its colour is due to be shaded again
+	auto reprojectFrom = [&](int x, int y, const Ray& ray, const GBufferPixel& hits) -> int {
+		const TemporalSettings& temporal = gbuffer->temporal;
+		const SurfaceHit& primary = hits.primary;
+		if(primary.object < 0){
+			return -1;	// the background, nothing to shade anyway
+		}
+		double px, py, distance;
+		if(!gbuffer->previousCamera.project(ray.pointAt(primary.t), px, py, distance)){
+			return -1;
+		}
+		int ix = static_cast<int>(std::floor(px + 0.5));
+		int iy = static_cast<int>(std::floor(py + 0.5)) - rowBegin;
+		if(ix < 0 || iy < 0 || ix >= width || iy >= rows){
+			return -1;
+		}
+		int from = iy * width + ix;
+		const SurfaceHit& before = history[from].primary;
+		if(before.object != primary.object || std::abs(before.t - distance) > temporal.depthTolerance * distance){
+			return -1;
+		}
+		if(historyAges[from] >= temporal.maxAge || SampleRng(x, y, gbuffer->frame).next() < temporal.refreshFraction){
+			return -1;
+		}
+		return from;
+	};
+
+	// first pass: one ray through every pixel centre, rows are spread across all cores and
+	// their rays are made a batch at a time. With a G-buffer only pixels whose rays come near
+	// a change are traced, the rest keep their colour, or are shaded again from their hits
+	// when the lights moved
+	// the frame buffers are the last frames' ones again, once there have been a few
+	FrameBuffer pixels = RecyclePool<FrameBuffer>::instance().take();
+	pixels.resize(width, rows);
+	parallelFor(0, rows, [&](int row){
+		if(cancelled(settings)){
+			return;
+		}
+		RT_TILE_SCOPE("row");
+		RT_NO_ALLOCATIONS();
+		int y = rowBegin + row;
+		RayBatch batch;
+		for (int batchStart = 0; batchStart < width; batchStart += batchSize){
+			centreRays(batchStart, y, std::min(batchSize, width - batchStart), batch);
+			for (int i = 0; i < batch.count; i++){
+				int x = batchStart + i;
+				int index = row * width + x;
+				int aovIndex = writeAOVs ? index : -1;
+				PixelCostScope cost(settings.costs, index);
+				if(gbuffer == nullptr){
+					pixels.set(index, tracePixel(batch.ray(i), aovIndex));
+					continue;
+				}
+				Ray ray = batch.ray(i);
+				GBufferPixel& hits = gbuffer->pixels[index];
+				uint8_t& age = gbuffer->ages[index];
+				if(reprojecting){
+					// a reused colour doesn't need the reflection, it's found when the pixel is shaded
+					recordPrimary(ray, hits);
+					int from = reprojectFrom(x, y, ray, hits);
+					if(from >= 0){
+						pixels.set(index, historyShaded.get(from));
+						age = historyAges[from] + 1;
+					} else {
+						recordReflection(ray, hits);
+						pixels.set(index, shadeHits(ray, hits));
+						age = 0;
+					}
+				} else if(!reuseHits || pathTouches(ray, hits, gbuffer->first)){
+					recordHits(ray, hits);
+					pixels.set(index, shadeHits(ray, hits));
+					age = 0;
+				} else if(gbuffer->first.relight || age > 0){
+					// reprojected colours are only close, a frame without reprojection gets them right
+					if(age > 0){
+						recordReflection(ray, hits);
+					}
+					pixels.set(index, shadeHits(ray, hits));
+					age = 0;
+				} else {
+					pixels.set(index, gbuffer->shaded.get(index));
+				}
+				writeHitAOVs(hits, aovIndex);
 			}
+		}
+	});
+	// rows skipped by a cancel are out of date, the layer only counts when the pass finished
+	if(gbuffer != nullptr){
+		if(cancelled(settings)){
+			gbuffer->invalidate();
+		} else {
+			gbuffer->shaded = pixels;
+			gbuffer->first.settle();
+			gbuffer->cameraMoved = false;
+		}
+	}
 
-			// rayDirection = Vec3(0.2, 0, -1);
-
-			Ray ray(rayOrigin, rayDirection);
-			int idx = (y * width + x) * 3;
-			// I've tried to add a little fish eye effect
+	// second pass: only pixels that stand out from their neighbours get more rays,
+	// and they stop as soon as their estimate has converged
+	FrameBuffer refined = RecyclePool<FrameBuffer>::instance().take();
+	if(sampling.maxSamples > 1 && !cancelled(settings)){
+		// a refined pixel is kept when its centre is the same and none of the rays it took
+		// come near a change. Their hits are in the G-buffer, so checking them traces nothing
+		bool reuseRefined = gbuffer != nullptr && gbuffer->refine.valid && !gbuffer->refine.relight &&
+			gbuffer->sampling.minSamples == sampling.minSamples && gbuffer->sampling.maxSamples == sampling.maxSamples &&
+			gbuffer->sampling.contrastThreshold == sampling.contrastThreshold && gbuffer->sampling.errorThreshold == sampling.errorThreshold;
+		// refinements of reprojected colours aren't kept (below), nor are their hits
+		bool recordSamples = gbuffer != nullptr && !reprojecting;
+		auto keepRefined = [&](int x, int y, int row, int index){
+			if(!reuseRefined || gbuffer->samples[index] == 0){
+				return false;
+			}
+			if(pathTouches(camera.primaryRay(x, y, 0.0, 0.0), gbuffer->pixels[index], gbuffer->refine)){
+				return false;
+			}
+			const GBufferPixel* hits = gbuffer->sampleHits[row].data() + gbuffer->sampleStart[index];
+			SampleRng rng(x, y);
+			for (int i = 1; i < gbuffer->samples[index]; i++){
+				if(pathTouches(jitteredRay(x, y, rng), hits[i - 1], gbuffer->refine)){
+					return false;
+				}
+			}
+			return true;
+		};
+
+		refined = pixels;
+		RT_SCOPE("refine");
+		parallelFor(0, rows, [&](int row){
+			if(cancelled(settings)){
+				return;
+			}
+			RT_TILE_SCOPE("refine row");
+			// the hits of this row's rays, room for the most a row can take so it never grows
+			// while the row is traced
+			static thread_local std::vector<GBufferPixel> rowHits;
+			if(recordSamples){
+				rowHits.reserve(static_cast<size_t>(width) * (sampling.maxSamples - 1));
+				rowHits.clear();
+			}
+			{
+				RT_NO_ALLOCATIONS();
+				int y = rowBegin + row;
+				for (int x = 0; x < width; x++){
+					int index = row * width + x;
+					PixelCostScope cost(settings.costs, index);
+					if(neighbourContrast(pixels, x, row) < sampling.contrastThreshold){
+						if(gbuffer != nullptr){
+							gbuffer->samples[index] = 0;
+						}
+						continue;
+					}
+					if(keepRefined(x, y, row, index)){
+						refined.set(index, gbuffer->refined.get(index));
+						const GBufferPixel* kept = gbuffer->sampleHits[row].data() + gbuffer->sampleStart[index];
+						gbuffer->sampleStart[index] = static_cast<uint32_t>(rowHits.size());
+						rowHits.insert(rowHits.end(), kept, kept + gbuffer->samples[index] - 1);
+						continue;
+					}
+					PixelEstimator estimator;
+					estimator.add(pixels.get(index));
+					SampleRng rng(x, y);
+					uint32_t start = static_cast<uint32_t>(rowHits.size());
+					while(!estimator.converged(sampling)){
+						Ray ray = jitteredRay(x, y, rng);
+						if(!recordSamples){
+							estimator.add(tracePixel(ray));
+							continue;
+						}
+						// the same sums as tracePixel, with the hits kept
+						GBufferPixel hits;
+						recordHits(ray, hits);
+						estimator.add(shadeHits(ray, hits));
+						rowHits.push_back(hits);
+					}
+					refined.set(index, estimator.mean);
+					if(gbuffer != nullptr){
+						gbuffer->samples[index] = static_cast<uint16_t>(estimator.count);
+						gbuffer->sampleStart[index] = start;
+					}
+				}
+			}
+			// grows only when the row takes more rays than it ever did before
+			if(recordSamples){
+				gbuffer->sampleHits[row].assign(rowHits.begin(), rowHits.end());
+			}
+		});
+
+		if(gbuffer != nullptr){
+			// refinements of reprojected colours are only close too, they aren't kept
+			if(cancelled(settings) || reprojecting){
+				gbuffer->refine.invalidate();
+			} else {
+				gbuffer->refined = refined;
+				gbuffer->sampling = sampling;
+				gbuffer->refine.settle();
+			}
+		}
+	} else {
+		std::swap(refined, pixels);
+	}
 
-			// double distance_to_center = std::sqrt((x - width / 2.0) * (x - width / 2.0) + (y - height / 2.0) * (y - height / 2.0));
-			// if(distance_to_center > fisheye_radius) {
-			// 	// Ray falls outside the fisheye circle, color it black
-			// 	image[idx] = 0;
-			// 	image[idx+1] = 0;
-			// 	image[idx+2] = 0;
-			// }else{
+	// a heatmap doesn't show the colours
+	if(!cancelled(settings) && settings.costs == nullptr){
+		RT_SCOPE("denoise");
+		PhaseScope resolvePhase(perfPhases(settings), Phase::Resolve);
+		denoise(refined, aovs, settings.denoise);
+	}
+	RecyclePool<FrameBuffer>::instance().give(std::move(pixels));
+	RecyclePool<AOVBuffers>::instance().give(std::move(aovs));
+	return refined;
+}
 
-			// Color color = traceRay(ray, lightsource_pos, false);
-			Color color = world.castRay(ray, world, lightsource_pos, false);
+// The viewer's scene, built from the default scene description with the spheres where they are now
+FrameBuffer renderHDR(bool orthogonal, int width, int height, Vec3 cameraPosition, Vec3 camera_up, Vec3 look_at, Vec3 light_pos, Vec3 sphere1_centre, Vec3 sphere2_centre, Vec3 s3_centre, const RenderSettings& settings = RenderSettings(), int rowBegin = 0, int rowEnd = -1){
+	SceneData scene = defaultScene(sphere1_centre, sphere2_centre, s3_centre, light_pos);
+	Objects world;
+	buildWorld(scene.view(), world);
+	return renderHDR(world, orthogonal, width, height, cameraPosition, camera_up, look_at, settings, rowBegin, rowEnd);
+}
 
-			// int idx = (y * width + x) * 3;
-			image[idx] = color.x;
-			image[idx+1] = color.y;
-			image[idx+2] = color.z;
+// Renders the frame and resolves it to 8-bit RGB for the texture and the TGA/PPM writers
+unsigned char* CameraAndScene(const Objects& world, bool orthogonal, int width, int height, Vec3 cameraPosition, Vec3 camera_up, Vec3 look_at, const RenderSettings& settings = RenderSettings(), GBuffer* gbuffer = nullptr){
+	RT_SCOPE("frame");
+	unsigned char* image = new unsigned char[static_cast<size_t>(width)*height*3]; // to avoid stack overflow
+	if(settings.heatmap.metric != HeatmapMetric::Off){
+		PixelCosts costs(settings.heatmap.metric, static_cast<size_t>(width)*height);
+		RenderSettings costed = settings;
+		costed.costs = &costs;
+		renderHDR(world, orthogonal, width, height, cameraPosition, camera_up, look_at, costed, 0, -1, gbuffer);
+		double top = heatmapImage(costs, image, settings.heatmap);
+		if(settings.stats != nullptr){
+			settings.stats->heatmapMaxCost.store(top);
 		}
+		return image;
+	}
+
+	FrameBuffer frame = renderHDR(world, orthogonal, width, height, cameraPosition, camera_up, look_at, settings, 0, -1, gbuffer);
+	{
+		RT_SCOPE("resolve");
+		PhaseScope resolvePhase(perfPhases(settings), Phase::Resolve);
+		resolve(frame, image, settings.toneMap);
 	}
+	RecyclePool<FrameBuffer>::instance().give(std::move(frame));
+
 	// // unsigned char *data = &image[0];
 	// std::vector<unsigned char> image_copy(image, image + width * height * 3); // Using copy constructor
 
@@ -163,4 +503,11 @@ unsigned char* CameraAndScene(bool orthogonal, int width, int height, Vec3 camer
 	return image;
 }
 
+unsigned char* CameraAndScene(bool orthogonal, int width, int height, Vec3 cameraPosition, Vec3 camera_up, Vec3 look_at, Vec3 light_pos, Vec3 sphere1_centre, Vec3 sphere2_centre, Vec3 s3_centre, const RenderSettings& settings = RenderSettings()){
+	SceneData scene = defaultScene(sphere1_centre, sphere2_centre, s3_centre, light_pos);
+	Objects world;
+	buildWorld(scene.view(), world);
+	return CameraAndScene(world, orthogonal, width, height, cameraPosition, camera_up, look_at, settings);
+}
+
 #endif
@@ -0,0 +1,449 @@
+#ifndef CAMERABASIS_H
+#define CAMERABASIS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "vec3.h"
+#include "ray.h"
+
+// What the camera's lens does to the rays. The orthogonal flag of the camera still wins over
+// this, an orthographic camera has parallel rays whatever the lens.
+enum class Lens {
+	Pinhole,    // the perspective camera, the view plane sits at the look at point
+	Fisheye,    // equidistant fisheye, fov degrees across the image diagonal
+	Panorama,   // equirectangular, 360 degrees across and 180 degrees up and down
+	ThinLens    // the pinhole with an aperture, depth of field
+};
+
+struct LensSettings {
+	Lens lens = Lens::Pinhole;
+	double fov = 180.0;
+	double aperture = 0.1;      // thin lens radius
+	double focusDistance = 0;   // thin lens, 0 = in focus at the look at point
+};
+
+// How the primary rays are made. Neither setting changes the image, only how fast it's done
+struct RayGenSettings {
+	int batch = 64;         // rays per batch, up to RayBatch::capacity
+	bool tables = true;     // look the directions through the pixel centres up in a table
+};
+
+// Rays of consecutive pixels of one row, one array per component (SoA) so the loops that
+// fill it are vectorised by the compiler
+struct RayBatch {
+	static constexpr int capacity = 64;
+	int count = 0;
+	double ox[capacity], oy[capacity], oz[capacity];
+	double dx[capacity], dy[capacity], dz[capacity];
+
+	Ray ray(int i) const {
+		Vec3 origin(ox[i], oy[i], oz[i]);
+		Vec3 direction(dx[i], dy[i], dz[i]);
+		return Ray(origin, direction);
+	}
+};
+
+// Directions through the pixel centres of a whole frame, one plane per component (SoA)
+struct DirectionTable {
+	int width = 0, height = 0;
+	std::vector<double> x, y, z;
+
+	void resize(int w, int h) {
+		width = w;
+		height = h;
+		size_t n = static_cast<size_t>(w) * h;
+		x.resize(n);
+		y.resize(n);
+		z.resize(n);
+	}
+};
+
+// The image side of the camera, all the camera space directions depend on
+struct LensIntrinsics {
+	LensSettings lens;
+	int width, height;
+	double viewplane_width, viewplane_height, focalLength;
+
+	bool operator==(const LensIntrinsics& o) const {
+		return lens.lens == o.lens.lens && lens.fov == o.lens.fov && width == o.width && height == o.height &&
+			viewplane_width == o.viewplane_width && viewplane_height == o.viewplane_height && focalLength == o.focalLength;
+	}
+};
+
+// The lens models. Each one maps a point (px, py) on the image, in pixels from the top left
+// corner, to a camera space direction: x along U, y down the image, z straight ahead. They're
+// template arguments of the ray loops, so those don't decide on the lens for every ray.
+struct PinholeModel {
+	static void direction(const LensIntrinsics& k, double px, double py, double& x, double& y, double& z) {
+		x = (px / k.width - 0.5) * k.viewplane_width;
+		y = (py / k.height - 0.5) * k.viewplane_height;
+		z = k.focalLength;
+	}
+};
+
+struct FisheyeModel {
+	// equidistant: the angle off the axis grows linearly with the distance from the centre
+	static void direction(const LensIntrinsics& k, double px, double py, double& x, double& y, double& z) {
+		const double pi = 3.14159265358979323846;
+		double cx = px - k.width * 0.5;
+		double cy = py - k.height * 0.5;
+		double r = std::sqrt(cx * cx + cy * cy);
+		double halfDiagonal = 0.5 * std::sqrt(static_cast<double>(k.width) * k.width + static_cast<double>(k.height) * k.height);
+		double theta = r / halfDiagonal * (k.lens.fov * 0.5 * pi / 180.0);
+		double s = r > 0 ? std::sin(theta) / r : 0.0;
+		x = cx * s;
+		y = cy * s;
+		z = std::cos(theta);
+	}
+};
+
+struct PanoramaModel {
+	static void direction(const LensIntrinsics& k, double px, double py, double& x, double& y, double& z) {
+		const double pi = 3.14159265358979323846;
+		double longitude = (px / k.width - 0.5) * 2.0 * pi;
+		double latitude = (py / k.height - 0.5) * pi;
+		x = std::sin(longitude) * std::cos(latitude);
+		y = std::sin(latitude);
+		z = std::cos(longitude) * std::cos(latitude);
+	}
+};
+
+// calls f with the model of lens, the thin lens aims its rays like the pinhole
+template<class F>
+inline void withLensModel(Lens lens, F&& f) {
+	switch (lens) {
+		case Lens::Fisheye: f(FisheyeModel()); break;
+		case Lens::Panorama: f(PanoramaModel()); break;
+		default: f(PinholeModel()); break;
+	}
+}
+
+// the camera space direction (x, y, z) in the world is U * x - V * y - W * z, V points up the
+// image and W backwards. U isn't always unit length, so the result is normalised
+inline void cameraToWorld(const Vec3& U, const Vec3& V, const Vec3& W, double x, double y, double z, double& wx, double& wy, double& wz) {
+	double dx = U.x * x - V.x * y - W.x * z;
+	double dy = U.y * x - V.y * y - W.y * z;
+	double dz = U.z * x - V.z * y - W.z * z;
+	double inv = 1.0 / std::sqrt(dx * dx + dy * dy + dz * dz);
+	wx = dx * inv;
+	wy = dy * inv;
+	wz = dz * inv;
+}
+
+// The few tables the frames in flight use. A camera that doesn't move finds its table here,
+// turning it costs one pass over the lens table. Building a table costs several times what
+// working the directions of one frame out in batches does, so a camera only gets one the
+// second time it's asked for: a camera that turns every frame never does, one that renders
+// the same view again (previews, refinement, objects or lights moving) gets it from then on.
+class DirectionTableCache {
+public:
+	static DirectionTableCache& instance() {
+		static DirectionTableCache cache;
+		return cache;
+	}
+
+	// unit world space directions for the camera with basis U, V, W, null the first time
+	std::shared_ptr<const DirectionTable> directions(const LensIntrinsics& key, const Vec3& U, const Vec3& V, const Vec3& W) {
+		std::unique_lock<std::mutex> lock(mutex);
+		auto it = find(key, U, V, W);
+		if (it == rotated.end()) {
+			rotated.push_front({key, U, V, W, nullptr});
+			trim();
+			return nullptr;
+		}
+		rotated.splice(rotated.begin(), rotated, it);
+		if (it->table) return it->table;
+		std::shared_ptr<const DirectionTable> local = lensTable(key);
+		std::shared_ptr<DirectionTable> table = std::move(spare);
+		lock.unlock();
+
+		// a fresh table spends about as long page faulting as it does being filled in
+		if (!table) table = std::make_shared<DirectionTable>();
+		table->resize(key.width, key.height);
+		size_t n = table->x.size();
+		const double* lx = local->x.data();
+		const double* ly = local->y.data();
+		const double* lz = local->z.data();
+		double* wx = table->x.data();
+		double* wy = table->y.data();
+		double* wz = table->z.data();
+		for (size_t i = 0; i < n; i++) {
+			cameraToWorld(U, V, W, lx[i], ly[i], lz[i], wx[i], wy[i], wz[i]);
+		}
+
+		// the entry may have been pushed out meanwhile, then the table is just for this frame
+		lock.lock();
+		it = find(key, U, V, W);
+		if (it != rotated.end()) it->table = table;
+		return table;
+	}
+
+private:
+	struct LensEntry {
+		LensIntrinsics key;
+		std::shared_ptr<const DirectionTable> table;
+	};
+	struct RotatedEntry {
+		LensIntrinsics key;
+		Vec3 U, V, W;
+		std::shared_ptr<const DirectionTable> table;    // null = seen once
+	};
+
+	// enough for the viewer's preview and full sizes and a few frames of a batch in flight,
+	// a camera space table is only needed to make new world space ones
+	static const size_t capacity = 6;
+	static const size_t lensCapacity = 2;
+	std::mutex mutex;
+	std::list<LensEntry> lenses;
+	std::list<RotatedEntry> rotated;
+	std::shared_ptr<DirectionTable> spare;
+
+	static bool same(const Vec3& a, const Vec3& b) {
+		return a.x == b.x && a.y == b.y && a.z == b.z;
+	}
+
+	// drops the oldest entries, the memory of a table nobody uses any more is kept for the next one
+	void trim() {
+		while (rotated.size() > capacity) {
+			std::shared_ptr<const DirectionTable>& table = rotated.back().table;
+			if (table && table.use_count() == 1) spare = std::const_pointer_cast<DirectionTable>(table);
+			rotated.pop_back();
+		}
+	}
+
+	std::list<RotatedEntry>::iterator find(const LensIntrinsics& key, const Vec3& U, const Vec3& V, const Vec3& W) {
+		return std::find_if(rotated.begin(), rotated.end(), [&](const RotatedEntry& e) {
+			return e.key == key && same(e.U, U) && same(e.V, V) && same(e.W, W);
+		});
+	}
+
+	// called with the lock held, the trig of a new lens is a one off
+	std::shared_ptr<const DirectionTable> lensTable(const LensIntrinsics& key) {
+		for (auto it = lenses.begin(); it != lenses.end(); ++it) {
+			if (it->key == key) {
+				lenses.splice(lenses.begin(), lenses, it);
+				return it->table;
+			}
+		}
+		auto table = std::make_shared<DirectionTable>();
+		table->resize(key.width, key.height);
+		withLensModel(key.lens.lens, [&](auto model) {
+			using Model = decltype(model);
+			for (int y = 0; y < key.height; y++) {
+				for (int x = 0; x < key.width; x++) {
+					size_t i = static_cast<size_t>(y) * key.width + x;
+					Model::direction(key, x + 0.5, y + 0.5, table->x[i], table->y[i], table->z[i]);
+				}
+			}
+		});
+		lenses.push_front({key, table});
+		if (lenses.size() > lensCapacity) lenses.pop_back();
+		return table;
+	}
+};
+
+// The camera of one frame: its basis and the view plane the primary rays go through.
+// renderHDR generates its rays from it a batch at a time, and reprojection (gbuffer.h) runs
+// it backwards to find where a point was on the screen of an earlier frame. Directions
+// through the pixel centres come from a table once the same camera was used before, jittered
+// rays work theirs out one at a time.
+struct CameraBasis {
+	bool orthogonal = false;
+	LensSettings lens;
+	int width = 0, height = 0;
+	double viewplane_width = 0, viewplane_height = 0, focalLength = 0;
+	Vec3 cameraPosition = Vec3(0, 0, 0);
+	Vec3 W = Vec3(0, 0, 1);
+	Vec3 U = Vec3(1, 0, 0);
+	Vec3 V = Vec3(0, 1, 0);
+	Vec3 pixel_delta_u = Vec3(0, 0, 0);
+	Vec3 pixel_delta_v = Vec3(0, 0, 0);
+	Vec3 initial_pixel = Vec3(0, 0, 0);
+	std::shared_ptr<const DirectionTable> directions;   // null for orthographic cameras and huge images
+
+	// 1920x1080 and a bit, a table is 24 bytes a pixel
+	static const size_t maxTablePixels = size_t(1) << 21;
+
+	CameraBasis() {}
+
+	CameraBasis(bool orthogonal, int width, int height, Vec3 cameraPosition, Vec3 camera_up, Vec3 look_at, const LensSettings& lens = LensSettings(), bool tables = true) : orthogonal(orthogonal), lens(lens), width(width), height(height), cameraPosition(cameraPosition) {
+		// camera parameters
+		// Vec3 cameraPosition = Vec3(0,-1,10);
+		// cameraPosition = Vec3(4, -1, 5);
+		// Vec3 camera_up = Vec3(0, -1, 0);
+		// Vec3 look_at = Vec3(0, 0, -1);
+		// cameraPosition = Vec3(0, -1, 1);
+
+		viewplane_height = 6.0; // 4.2
+		viewplane_width = viewplane_height * (static_cast<double>(width)/height);
+
+		// basis vectors for camera
+		W = (cameraPosition - look_at).unit_vector();
+		U = camera_up.cross(look_at);
+		V = W.cross(U);
+
+		// The vectors along the axis(es) of the viewplane
+		// Vec3 viewplane_u = Vec3(viewplane_width, 0, 0);
+		// Vec3 viewplane_v = Vec3(0, -viewplane_height, 0);
+
+		Vec3 viewplane_u = U * viewplane_width;
+		Vec3 viewplane_v = V*-1 * viewplane_height;
+
+
+		// The horizontal and vertical delta vectors from pixel to pixel.
+		pixel_delta_u = viewplane_u / width;
+		pixel_delta_v = viewplane_v / height;
+
+		focalLength = (cameraPosition - look_at).length();
+		if(orthogonal){
+			focalLength = 0.0;
+		}
+		// Calculate the location of the upper left pixel.
+		// Vec3 viewplane_upper_left = (cameraPosition - Vec3(0, 0, focalLength)) - viewplane_u/2 - viewplane_v/2;
+		Vec3 viewplane_upper_left = (cameraPosition - (W*focalLength)) - viewplane_u/2 - viewplane_v/2;
+
+		initial_pixel = viewplane_upper_left + (pixel_delta_u + pixel_delta_v) * 0.5;
+
+		// std::cout << "inital_pixel:" << std::endl;
+		// initial_pixel.print();
+
+		// huge images rendered in strips work every direction out on the fly instead
+		if(tables && !orthogonal && static_cast<size_t>(width) * height <= maxTablePixels){
+			directions = DirectionTableCache::instance().directions(intrinsics(), U, V, W);
+		}
+	}
+
+	LensIntrinsics intrinsics() const {
+		LensIntrinsics k = {lens, width, height, viewplane_width, viewplane_height, focalLength};
+		// the view plane only matters to the pinhole, and the thin lens aims like it
+		if(lens.lens == Lens::ThinLens){
+			k.lens = LensSettings();
+		} else if(lens.lens != Lens::Pinhole){
+			k.viewplane_width = k.viewplane_height = k.focalLength = 0;
+		}
+		return k;
+	}
+
+	bool thinLens() const {
+		return !orthogonal && lens.lens == Lens::ThinLens && lens.aperture > 0;
+	}
+
+	// the rays through the centres of the count pixels from (x, y) on to the right
+	void centreRays(int x, int y, int count, RayBatch& batch) const {
+		batch.count = count;
+		if(orthogonal){
+			for (int i = 0; i < count; i++) {
+				Ray ray = primaryRay(x + i, y, 0.0, 0.0);
+				batch.ox[i] = ray.origin.x; batch.oy[i] = ray.origin.y; batch.oz[i] = ray.origin.z;
+				batch.dx[i] = ray.direction.x; batch.dy[i] = ray.direction.y; batch.dz[i] = ray.direction.z;
+			}
+			return;
+		}
+		std::fill(batch.ox, batch.ox + count, cameraPosition.x);
+		std::fill(batch.oy, batch.oy + count, cameraPosition.y);
+		std::fill(batch.oz, batch.oz + count, cameraPosition.z);
+		if(directions){
+			size_t i = static_cast<size_t>(y) * width + x;
+			std::memcpy(batch.dx, directions->x.data() + i, count * sizeof(double));
+			std::memcpy(batch.dy, directions->y.data() + i, count * sizeof(double));
+			std::memcpy(batch.dz, directions->z.data() + i, count * sizeof(double));
+			return;
+		}
+		// the same sums the table is made of, with or without it the rays are the same
+		LensIntrinsics k = intrinsics();
+		withLensModel(lens.lens, [&](auto model) {
+			using Model = decltype(model);
+			double lx[RayBatch::capacity], ly[RayBatch::capacity], lz[RayBatch::capacity];
+			for (int i = 0; i < count; i++) {
+				Model::direction(k, (x + i) + 0.5, y + 0.5, lx[i], ly[i], lz[i]);
+			}
+			for (int i = 0; i < count; i++) {
+				cameraToWorld(U, V, W, lx[i], ly[i], lz[i], batch.dx[i], batch.dy[i], batch.dz[i]);
+			}
+		});
+	}
+
+	// the ray through the pixel (x, y), offset by (du, dv) pixels from its centre
+	Ray primaryRay(int x, int y, double du, double dv) const {
+		Vec3 rayOrigin = cameraPosition;
+		if(orthogonal){
+			Vec3 viewplane_pixel_loc = initial_pixel + (pixel_delta_u * (x + du)) + (pixel_delta_v * (y + dv));
+			Vec3 rayDirection = W*-1;
+			return Ray(viewplane_pixel_loc, rayDirection);
+		}
+		if(du == 0.0 && dv == 0.0 && directions){
+			size_t i = static_cast<size_t>(y) * width + x;
+			Vec3 rayDirection(directions->x[i], directions->y[i], directions->z[i]);
+			return Ray(rayOrigin, rayDirection);
+		}
+		LensIntrinsics k = intrinsics();
+		double lx, ly, lz;
+		withLensModel(lens.lens, [&](auto model) {
+			decltype(model)::direction(k, x + 0.5 + du, y + 0.5 + dv, lx, ly, lz);
+		});
+		Vec3 rayDirection(0, 0, 0);
+		cameraToWorld(U, V, W, lx, ly, lz, rayDirection.x, rayDirection.y, rayDirection.z);
+		return Ray(rayOrigin, rayDirection);
+	}
+
+	// primaryRay seen through the thin lens: the ray starts at the point (lu, lv) of the
+	// aperture, both in [0, 1), and meets the pinhole ray on the plane in focus
+	Ray lensRay(int x, int y, double du, double dv, double lu, double lv) const {
+		Ray pinhole = primaryRay(x, y, du, dv);
+		if(!thinLens()){
+			return pinhole;
+		}
+		const double pi = 3.14159265358979323846;
+		double focus = lens.focusDistance > 0 ? lens.focusDistance : focalLength;
+		Vec3 forward = W*-1;
+		Vec3 focusPoint = pinhole.pointAt(focus / pinhole.direction.dot(forward));
+		double r = lens.aperture * std::sqrt(lu);
+		double phi = 2.0 * pi * lv;
+		Vec3 rayOrigin = cameraPosition + U.unit_vector() * (r * std::cos(phi)) + V.unit_vector() * (r * std::sin(phi));
+		Vec3 rayDirection = (focusPoint - rayOrigin).unit_vector();
+		return Ray(rayOrigin, rayDirection);
+	}
+
+	// The other way round: the pixel coordinates (x, y) whose ray goes through point, and how
+	// far along that ray the point is. Pixel centres are at whole numbers. False when the
+	// point is behind the camera, and for the fisheye and panorama lenses.
+	bool project(const Vec3& point, double& x, double& y, double& distance) const {
+		// det of the matrix with columns a, b, c
+		auto det = [](const Vec3& a, const Vec3& b, const Vec3& c) {
+			return a.x * (b.y * c.z - b.z * c.y) - a.y * (b.x * c.z - b.z * c.x) + a.z * (b.x * c.y - b.y * c.x);
+		};
+		if(orthogonal){
+			// point = initial_pixel + pixel_delta_u * x + pixel_delta_v * y - W * distance
+			Vec3 r = point - initial_pixel;
+			Vec3 D = W*-1;
+			double d = det(pixel_delta_u, pixel_delta_v, D);
+			if(d == 0) return false;
+			x = det(r, pixel_delta_v, D) / d;
+			y = det(pixel_delta_u, r, D) / d;
+			distance = det(pixel_delta_u, pixel_delta_v, r) / d;
+			return distance > 0;
+		}
+		if(lens.lens != Lens::Pinhole && lens.lens != Lens::ThinLens){
+			return false;
+		}
+		// point - cameraPosition = s * (initial_pixel + pixel_delta_u * x + pixel_delta_v * y - cameraPosition),
+		// which is linear in s, s * x and s * y
+		Vec3 r = point - cameraPosition;
+		Vec3 A = initial_pixel - cameraPosition;
+		double d = det(A, pixel_delta_u, pixel_delta_v);
+		if(d == 0) return false;
+		double s = det(r, pixel_delta_u, pixel_delta_v) / d;
+		if(s <= 0) return false;
+		x = det(A, r, pixel_delta_v) / d / s;
+		y = det(A, pixel_delta_u, r) / d / s;
+		distance = r.length();
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef CPUDISPATCH_H
+#define CPUDISPATCH_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+// One binary, the best code for the CPU it runs on. The hot loops (sphere tests, the
+// denoiser taps, tone mapping and quantisation) are compiled once per instruction set level
+// below with RT_DISPATCH_KERNEL, and every call goes to the best one the CPU has. The level
+// is found with CPUID on start up, and can be turned down for testing: RT_ISA=scalar|sse4.2|
+// avx2|avx512 in the environment, or setIsa() (render --isa). It can't be turned up past
+// what the CPU has. All levels give the same bits: the clones are built without FMA
+// contraction (AVX-512 would use it otherwise), so they only differ in how many lanes
+// they do at once.
+
+enum class IsaLevel {
+    Scalar,     // whatever the compiler was told, plain x86-64 is SSE2
+    SSE42,
+    AVX2,
+    AVX512      // F, BW, VL and DQ
+};
+
+inline const char* isaName(IsaLevel level) {
+    switch (level) {
+    case IsaLevel::SSE42: return "sse4.2";
+    case IsaLevel::AVX2: return "avx2";
+    case IsaLevel::AVX512: return "avx512";
+    default: return "scalar";
+    }
+}
+
+inline bool parseIsa(const std::string& name, IsaLevel& level) {
+    for (IsaLevel l : {IsaLevel::Scalar, IsaLevel::SSE42, IsaLevel::AVX2, IsaLevel::AVX512}) {
+        if (name == isaName(l)) {
+            level = l;
+            return true;
+        }
+    }
+    return false;
+}
+
+// GCC only: clang ignores the optimize attribute below, its AVX-512 clone would contract
+// to FMA and give other bits, and it'd lose no-math-errno too
+#if defined(__GNUC__) && !defined(__clang__) && (defined(__x86_64__) || defined(__i386__))
+#define RT_MULTI_ISA 1
+#endif
+
+// the best level this CPU (and OS, for the AVX registers) runs
+inline IsaLevel detectIsa() {
+#if defined(RT_MULTI_ISA)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512dq")) return IsaLevel::AVX512;
+    if (__builtin_cpu_supports("avx2")) return IsaLevel::AVX2;
+    if (__builtin_cpu_supports("sse4.2")) return IsaLevel::SSE42;
+#endif
+    return IsaLevel::Scalar;
+}
+
+inline std::atomic<int>& isaSetting() {
+    static std::atomic<int> level([] {
+        IsaLevel detected = detectIsa();
+        IsaLevel wanted = detected;
+        const char* env = std::getenv("RT_ISA");
+        if (env != nullptr && !parseIsa(env, wanted)) wanted = detected;
+        return static_cast<int>(std::min(wanted, detected));
+    }());
+    return level;
+}
+
+// the level the kernels run at
+inline IsaLevel activeIsa() {
+    return static_cast<IsaLevel>(isaSetting().load(std::memory_order_relaxed));
+}
+
+// Turns the level down (or back up, as far as the CPU goes), returns the level now in use.
+// Meant for start up and tests, frames being rendered may use either level meanwhile
+inline IsaLevel setIsa(IsaLevel level) {
+    IsaLevel used = std::min(level, detectIsa());
+    isaSetting().store(static_cast<int>(used), std::memory_order_relaxed);
+    return used;
+}
+
+// RT_DISPATCH_KERNEL(name, (parameters), (arguments), body) defines void name(parameters)
+// calling body(arguments), a plain inline function. The body is inlined (flatten) into one
+// clone per level and vectorised for it, build with -O3 so the vectoriser runs.
+#if defined(RT_MULTI_ISA)
+#define RT_KERNEL_CLONE(isa) __attribute__((target(isa), optimize("fp-contract=off", "no-math-errno", "no-trapping-math"), flatten))
+#define RT_KERNEL_BASE __attribute__((optimize("fp-contract=off", "no-math-errno", "no-trapping-math"), flatten))
+#define RT_DISPATCH_KERNEL(name, params, args, body) \
+    RT_KERNEL_BASE inline void name##Scalar params { body args; } \
+    RT_KERNEL_CLONE("sse4.2") inline void name##Sse42 params { body args; } \
+    RT_KERNEL_CLONE("avx2") inline void name##Avx2 params { body args; } \
+    RT_KERNEL_CLONE("avx512f,avx512bw,avx512vl,avx512dq") inline void name##Avx512 params { body args; } \
+    inline void name params { \
+        switch (activeIsa()) { \
+        case IsaLevel::AVX512: name##Avx512 args; return; \
+        case IsaLevel::AVX2: name##Avx2 args; return; \
+        case IsaLevel::SSE42: name##Sse42 args; return; \
+        default: name##Scalar args; return; \
+        } \
+    }
+#else
+// other compilers (clang too) and CPUs get the one build they were given
+#define RT_DISPATCH_KERNEL(name, params, args, body) \
+    inline void name params { body args; }
+#endif
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include <algorithm>
+#include <cmath>
+#include "vec3.h"
+#include "framebuffer.h"
+#include "parallel.h"
+#include "cpudispatch.h"
+#include "arena.h"
+
+// Edge-avoiding à-trous wavelet filter (Dammertz et al. 2010) for low-sample renders.
+// Every pass is a 5x5 B3-spline blur whose taps are spread 1, 2, 4, ... pixels apart,
+// and each tap is weighted down when its colour, normal, albedo or depth differ from the
+// centre pixel, so the blur stays inside surfaces and doesn't smear silhouettes.
+struct DenoiseSettings {
+    int iterations = 0;          // number of à-trous passes, 0 turns the denoiser off
+    float sigmaColor = 40.0f;    // colour difference (0-255 scale) the filter tolerates across a tap
+    float sigmaNormal = 0.1f;    // 1 - dot(n_p, n_q)
+    float sigmaAlbedo = 0.1f;
+    float sigmaDepth = 0.2f;     // per pixel of tap distance, so wider passes tolerate more depth change
+};
+
+// Cheap stand-in for exp(-x) with x >= 0. It only has to fall off smoothly, and unlike
+// std::exp the compiler can vectorize it inside the tap loop.
+inline float edgeFalloff(float x) {
+    return 1.0f / (1.0f + x + 0.5f * x * x);
+}
+
+// Pointers to one row of the colour planes and the AOV planes
+struct GuideRow {
+    const float *r, *g, *b;
+    const float *nx, *ny, *nz;
+    const float *ar, *ag, *ab;
+    const float *depth;
+
+    GuideRow(const FrameBuffer& color, const AOVBuffers& aovs, int y) {
+        size_t row = static_cast<size_t>(y) * aovs.width;
+        r = color.r.data() + row;
+        g = color.g.data() + row;
+        b = color.b.data() + row;
+        nx = aovs.normalX.data() + row;
+        ny = aovs.normalY.data() + row;
+        nz = aovs.normalZ.data() + row;
+        ar = aovs.albedoR.data() + row;
+        ag = aovs.albedoG.data() + row;
+        ab = aovs.albedoB.data() + row;
+        depth = aovs.depth.data() + row;
+    }
+};
+
+// Inverse sigmas of the edge-stopping terms for one pass
+struct EdgeStops {
+    float color, normal, albedo, depth;
+};
+
+// Accumulates one tap, at horizontal offset ox from row q, into the sums of row p for x in [xlo, xhi).
+// The loop is branch-free over contiguous planes and the sums don't alias the inputs, so it compiles to SIMD.
+inline void atrousTapBody(const GuideRow& p, const GuideRow& q, int xlo, int xhi, int ox, float h, const EdgeStops& inv,
+                      float* __restrict sumR, float* __restrict sumG, float* __restrict sumB, float* __restrict sumW) {
+    const float *pr = p.r, *pg = p.g, *pb = p.b;
+    const float *pnx = p.nx, *pny = p.ny, *pnz = p.nz;
+    const float *par = p.ar, *pag = p.ag, *pab = p.ab, *pdz = p.depth;
+    const float *qr = q.r, *qg = q.g, *qb = q.b;
+    const float *qnx = q.nx, *qny = q.ny, *qnz = q.nz;
+    const float *qar = q.ar, *qag = q.ag, *qab = q.ab, *qdz = q.depth;
+
+    for (int x = xlo; x < xhi; x++) {
+        int t = x + ox;
+
+        float dr = pr[x] - qr[t];
+        float dg = pg[x] - qg[t];
+        float db = pb[x] - qb[t];
+        float colorDist = (dr * dr + dg * dg + db * db) * inv.color;
+
+        float ndot = pnx[x] * qnx[t] + pny[x] * qny[t] + pnz[x] * qnz[t];
+        float normalDist = std::max(0.0f, 1.0f - ndot) * inv.normal;
+
+        float dar = par[x] - qar[t];
+        float dag = pag[x] - qag[t];
+        float dab = pab[x] - qab[t];
+        float albedoDist = (dar * dar + dag * dag + dab * dab) * inv.albedo;
+
+        float depthDist = std::abs(pdz[x] - qdz[t]) * inv.depth;
+
+        float w = h * edgeFalloff(colorDist + normalDist + albedoDist + depthDist);
+        sumR[x] += w * qr[t];
+        sumG[x] += w * qg[t];
+        sumB[x] += w * qb[t];
+        sumW[x] += w;
+    }
+}
+
+RT_DISPATCH_KERNEL(atrousTap,
+    (const GuideRow& p, const GuideRow& q, int xlo, int xhi, int ox, float h, const EdgeStops& inv,
+     float* __restrict sumR, float* __restrict sumG, float* __restrict sumB, float* __restrict sumW),
+    (p, q, xlo, xhi, ox, h, inv, sumR, sumG, sumB, sumW),
+    atrousTapBody)
+
+// One à-trous pass over row y. Taps that fall outside the image are skipped.
+inline void atrousRow(const FrameBuffer& in, FrameBuffer& out, const AOVBuffers& aovs, int y, int step, const DenoiseSettings& settings) {
+    static const float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+
+    int width = aovs.width;
+    int height = aovs.height;
+
+    ScratchArena& scratch = threadScratch();
+    ScratchScope scope(scratch);
+    float* sumR = scratch.allocate<float>(static_cast<size_t>(width) * 4);
+    std::fill(sumR, sumR + static_cast<size_t>(width) * 4, 0.0f);
+    float* sumG = sumR + width;
+    float* sumB = sumG + width;
+    float* sumW = sumB + width;
+
+    EdgeStops inv;
+    inv.color = 1.0f / (settings.sigmaColor * settings.sigmaColor);
+    inv.normal = 1.0f / settings.sigmaNormal;
+    inv.albedo = 1.0f / (settings.sigmaAlbedo * settings.sigmaAlbedo);
+    inv.depth = 1.0f / (settings.sigmaDepth * step);
+
+    GuideRow p(in, aovs, y);
+    for (int j = -2; j <= 2; j++) {
+        int qy = y + j * step;
+        if (qy < 0 || qy >= height) continue;
+
+        GuideRow q(in, aovs, qy);
+        for (int i = -2; i <= 2; i++) {
+            int ox = i * step;
+            int xlo = std::max(0, -ox);
+            int xhi = std::min(width, width - ox);
+            atrousTap(p, q, xlo, xhi, ox, kernel[j + 2] * kernel[i + 2], inv, sumR, sumG, sumB, sumW);
+        }
+    }
+
+    // the centre tap always contributes, so sumW is never zero
+    size_t row = static_cast<size_t>(y) * width;
+    float* outR = out.r.data() + row;
+    float* outG = out.g.data() + row;
+    float* outB = out.b.data() + row;
+    for (int x = 0; x < width; x++) {
+        float norm = 1.0f / sumW[x];
+        outR[x] = sumR[x] * norm;
+        outG[x] = sumG[x] * norm;
+        outB[x] = sumB[x] * norm;
+    }
+}
+
+// Runs settings.iterations passes over the frame in place, rows are spread across all cores.
+inline void denoise(FrameBuffer& color, const AOVBuffers& aovs, const DenoiseSettings& settings) {
+    if (settings.iterations <= 0) return;
+
+    // every row is written, the recycled buffer's old contents don't matter
+    FrameBuffer scratch = RecyclePool<FrameBuffer>::instance().take();
+    scratch.resize(color.width, color.height);
+
+    int step = 1;
+    for (int pass = 0; pass < settings.iterations; pass++) {
+        parallelFor(0, aovs.height, [&](int y) {
+            RT_NO_ALLOCATIONS();
+            atrousRow(color, scratch, aovs, y, step, settings);
+        });
+        std::swap(color, scratch);
+        step *= 2;
+    }
+    RecyclePool<FrameBuffer>::instance().give(std::move(scratch));
+}
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef DYNAMICRESOLUTION_H
+#define DYNAMICRESOLUTION_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "parallel.h"
+
+// Dynamic resolution for the interactive viewer. While the camera moves, the first frame of
+// every view is traced at whatever resolution fits the frame time budget, then scaled up to
+// the full size. The full resolution frame follows as soon as the camera holds still.
+struct DynamicResolutionSettings {
+    double targetMs = 33.0;      // budget for the first frame of a view, 16 for 60 fps
+    double minScale = 0.1;       // never below this fraction of the full width and height
+    double startScale = 0.25;    // used until the first frame has been timed
+};
+
+// Learns how long a pixel takes and picks the resolution scale for the next frame.
+// The cost per pixel is a moving average, so a heavier part of the scene pulls the
+// resolution down over a few frames instead of in one jump. Scaling the preview back up
+// costs the same at any scale, that part comes off the budget first.
+class ResolutionController {
+public:
+    DynamicResolutionSettings settings;
+    double msPerPixel = 0;       // 0 until the first frame has been timed
+    double upscaleMs = 0;
+
+    // scale (0, 1] for a full size image of width x height
+    double pickScale(int width, int height) const {
+        if (msPerPixel <= 0) return settings.startScale;
+        double budget = std::max(settings.targetMs * 0.25, settings.targetMs - upscaleMs);
+        double pixels = budget / msPerPixel;
+        double scale = std::sqrt(pixels / (static_cast<double>(width) * height));
+        return std::min(1.0, std::max(settings.minScale, scale));
+    }
+
+    void record(int width, int height, double ms) {
+        double cost = ms / (static_cast<double>(width) * height);
+        msPerPixel = msPerPixel <= 0 ? cost : 0.7 * msPerPixel + 0.3 * cost;
+    }
+
+    void recordUpscale(double ms) {
+        upscaleMs = upscaleMs <= 0 ? ms : 0.7 * upscaleMs + 0.3 * ms;
+    }
+};
+
+// Scales 8-bit RGB up with bilinear weights that are cut down across edges.
+// Every output pixel looks at its four nearest source pixels, and each of them counts less
+// the more its colour differs from the closest one. Flat areas come out as smooth as
+// bilinear, but silhouettes and shadow edges stay sharp instead of smearing into a halo.
+// sigma is the colour difference (0-255) where a neighbour's weight has halved.
+inline void upscaleEdgeAware(const uint8_t* src, int srcWidth, int srcHeight, uint8_t* dst, int dstWidth, int dstHeight, float sigma = 24.0f) {
+    struct Tap {
+        int i0, i1;
+        float f;
+    };
+    // where each output column and row falls in the source, pixel centres line up
+    auto taps = [](int srcSize, int dstSize) {
+        std::vector<Tap> result(dstSize);
+        float ratio = static_cast<float>(srcSize) / dstSize;
+        for (int i = 0; i < dstSize; i++) {
+            float s = std::max(0.0f, (i + 0.5f) * ratio - 0.5f);
+            int i0 = std::min(static_cast<int>(s), srcSize - 1);
+            result[i] = {i0, std::min(i0 + 1, srcSize - 1), std::min(1.0f, s - i0)};
+        }
+        return result;
+    };
+    std::vector<Tap> columns = taps(srcWidth, dstWidth);
+    std::vector<Tap> rows = taps(srcHeight, dstHeight);
+
+    // range weight by squared colour distance, in steps of 16 so it fits a small table
+    const int distanceShift = 4;
+    std::vector<float> rangeWeight((3 * 255 * 255 >> distanceShift) + 1);
+    for (size_t i = 0; i < rangeWeight.size(); i++) {
+        rangeWeight[i] = 1.0f / (1.0f + static_cast<float>(i << distanceShift) / (sigma * sigma));
+    }
+
+    parallelFor(0, dstHeight, [&](int y) {
+        const Tap& row = rows[y];
+        const uint8_t* r0 = src + static_cast<size_t>(row.i0) * srcWidth * 3;
+        const uint8_t* r1 = src + static_cast<size_t>(row.i1) * srcWidth * 3;
+        uint8_t* out = dst + static_cast<size_t>(y) * dstWidth * 3;
+
+        for (int x = 0; x < dstWidth; x++) {
+            const Tap& column = columns[x];
+            const uint8_t* p[4] = { r0 + column.i0 * 3, r0 + column.i1 * 3, r1 + column.i0 * 3, r1 + column.i1 * 3 };
+            float w[4] = {
+                (1 - column.f) * (1 - row.f), column.f * (1 - row.f),
+                (1 - column.f) * row.f, column.f * row.f
+            };
+            const uint8_t* nearest = p[(column.f > 0.5f ? 1 : 0) + (row.f > 0.5f ? 2 : 0)];
+
+            float sum[3] = {0, 0, 0};
+            float weightSum = 0;
+            for (int i = 0; i < 4; i++) {
+                int dr = p[i][0] - nearest[0];
+                int dg = p[i][1] - nearest[1];
+                int db = p[i][2] - nearest[2];
+                float weight = w[i] * rangeWeight[(dr * dr + dg * dg + db * db) >> distanceShift];
+                sum[0] += weight * p[i][0];
+                sum[1] += weight * p[i][1];
+                sum[2] += weight * p[i][2];
+                weightSum += weight;
+            }
+            // the nearest pixel always has a bilinear weight of at least 1/4, so weightSum > 0
+            float inv = 1.0f / weightSum;
+            out[x * 3 + 0] = static_cast<uint8_t>(sum[0] * inv + 0.5f);
+            out[x * 3 + 1] = static_cast<uint8_t>(sum[1] * inv + 0.5f);
+            out[x * 3 + 2] = static_cast<uint8_t>(sum[2] * inv + 0.5f);
+        }
+    });
+}
+
+#endif
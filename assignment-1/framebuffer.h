@@ -0,0 +1,73 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <vector>
+#include "vec3.h"
+
+// Linear HDR render target. Radiance stays unclamped on the renderer's 0-255 scale with
+// one float plane per channel, it only becomes 8-bit colour in the tone-mapping resolve.
+class FrameBuffer {
+public:
+    int width, height;
+    std::vector<float> r, g, b;
+
+    FrameBuffer() : width(0), height(0) {}
+    FrameBuffer(int w, int h) { resize(w, h); }
+
+    void resize(int w, int h) {
+        width = w;
+        height = h;
+        size_t n = static_cast<size_t>(w) * h;
+        r.assign(n, 0.0f);
+        g.assign(n, 0.0f);
+        b.assign(n, 0.0f);
+    }
+
+    size_t size() const {
+        return r.size();
+    }
+
+    void set(int index, const Color& c) {
+        r[index] = c.x;
+        g[index] = c.y;
+        b[index] = c.z;
+    }
+
+    Color get(int index) const {
+        return Color(r[index], g[index], b[index]);
+    }
+};
+
+// Auxiliary buffers (AOVs) written for the first hit of every pixel while tracing.
+// The denoiser uses them as edge-stopping guides. Each channel is its own plane (SoA)
+// so the filter loops run over contiguous floats.
+class AOVBuffers {
+public:
+    int width, height;
+    std::vector<float> normalX, normalY, normalZ;
+    std::vector<float> albedoR, albedoG, albedoB;
+    std::vector<float> depth;
+
+    AOVBuffers() : width(0), height(0) {}
+
+    void resize(int w, int h) {
+        width = w;
+        height = h;
+        size_t n = static_cast<size_t>(w) * h;
+        for (auto* plane : {&normalX, &normalY, &normalZ, &albedoR, &albedoG, &albedoB, &depth}) {
+            plane->assign(n, 0.0f);
+        }
+    }
+
+    void write(int index, const Vec3& normal, const Color& albedo, double t) {
+        normalX[index] = normal.x;
+        normalY[index] = normal.y;
+        normalZ[index] = normal.z;
+        albedoR[index] = albedo.x;
+        albedoG[index] = albedo.y;
+        albedoB[index] = albedo.z;
+        depth[index] = t;
+    }
+};
+
+#endif
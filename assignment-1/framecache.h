@@ -0,0 +1,320 @@
+#ifndef FRAMECACHE_H
+#define FRAMECACHE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include "camera.h"
+#include "scene.h"
+#include "imagewriter.h"
+
+// Content addressed cache of finished 8-bit frames. A frame is identified by a hash of
+// everything that goes into it (scene records, camera, resolution and render settings), so
+// an unchanged viewpoint or a revisited animation frame is looked up instead of traced.
+// Recently used frames are kept in memory, and optionally in a directory on disk that
+// survives restarts. Both levels drop their least recently used frames when over budget.
+
+// 64-bit hash over a stream of bytes, eight at a time (the xxHash64 round and final mix)
+class FrameHasher {
+public:
+    uint64_t state = 0x27D4EB2F165667C5ull;
+
+    void add(const void* data, size_t bytes) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        for (; bytes >= 8; bytes -= 8, p += 8) {
+            uint64_t word;
+            memcpy(&word, p, 8);
+            mix(word);
+        }
+        if (bytes > 0) {
+            uint64_t word = 0;
+            memcpy(&word, p, bytes);
+            mix(word ^ (static_cast<uint64_t>(bytes) << 56));
+        }
+    }
+
+    template<typename T>
+    void add(const T& value) {
+        static_assert(std::is_trivially_copyable<T>::value, "hash plain values only");
+        add(&value, sizeof(T));
+    }
+
+    void add(const Vec3& v) {
+        add(v.x);
+        add(v.y);
+        add(v.z);
+    }
+
+    template<typename T>
+    void add(const SceneSpan<T>& span) {
+        add(static_cast<uint64_t>(span.count));
+        add(span.data, span.count * sizeof(T));
+    }
+
+    uint64_t value() const {
+        uint64_t h = state;
+        h ^= h >> 33; h *= 0xC2B2AE3D27D4EB4Full;
+        h ^= h >> 29; h *= 0x165667B19E3779F9ull;
+        h ^= h >> 32;
+        return h;
+    }
+
+private:
+    void mix(uint64_t word) {
+        word *= 0xC2B2AE3D27D4EB4Full;
+        word = (word << 31) | (word >> 33);
+        word *= 0x9E3779B185EBCA87ull;
+        state ^= word;
+        state = ((state << 27) | (state >> 37)) * 0x9E3779B185EBCA87ull + 0x85EBCA77C2B2AE63ull;
+    }
+};
+
+// Every record of the scene. Records have explicit padding that is always zeroed, so hashing
+// their bytes is safe. Worth computing once per scene, not per frame, for big scenes.
+inline uint64_t hashScene(const SceneView& scene) {
+    FrameHasher h;
+    h.add(scene.materials);
+    h.add(scene.spheres);
+    h.add(scene.planes);
+    h.add(scene.triangles);
+    h.add(scene.tetrahedra);
+    h.add(scene.lights);
+    return h.value();
+}
+
+// Goes into every key. The disk cache outlives the binary that filled it, so bump this with
+// any change to what a frame comes out as (shading, sampling, denoising, tone mapping...)
+// or the old frames keep being served
+static const uint32_t frameCacheVersion = 1;
+
+// The key of one frame. Settings are hashed field by field because structs can have
+// padding with garbage in it, anything new in RenderSettings has to be added here too.
+inline uint64_t frameKey(uint64_t sceneHash, bool orthogonal, int width, int height, Vec3 cameraPosition, Vec3 camera_up, Vec3 look_at, const RenderSettings& settings) {
+    FrameHasher h;
+    h.add(frameCacheVersion);
+    h.add(sceneHash);
+    h.add(orthogonal);
+    h.add(width);
+    h.add(height);
+    h.add(cameraPosition);
+    h.add(camera_up);
+    h.add(look_at);
+
+    const SamplerSettings& s = settings.sampling;
+    h.add(s.minSamples);
+    h.add(s.maxSamples);
+    h.add(s.contrastThreshold);
+    h.add(s.errorThreshold);
+
+    const DenoiseSettings& d = settings.denoise;
+    h.add(d.iterations);
+    h.add(d.sigmaColor);
+    h.add(d.sigmaNormal);
+    h.add(d.sigmaAlbedo);
+    h.add(d.sigmaDepth);
+
+    const ToneMapSettings& t = settings.toneMap;
+    h.add(t.op);
+    h.add(t.exposure);
+    h.add(t.gamma);
+    h.add(t.whitePoint);
+
+    h.add(settings.lens.lens);
+    h.add(settings.lens.fov);
+    h.add(settings.lens.aperture);
+    h.add(settings.lens.focusDistance);
+
+    h.add(settings.heatmap.metric);
+    h.add(settings.heatmap.maxCost);
+    return h.value();
+}
+
+struct CachedFrame {
+    int width = 0, height = 0;
+    std::shared_ptr<const std::vector<unsigned char>> rgb;
+};
+
+struct FrameCacheSettings {
+    size_t memoryBytes = size_t(64) << 20;     // 0 turns the memory level off
+    std::string directory;                     // empty turns the disk level off
+    uint64_t diskBytes = uint64_t(1) << 30;
+};
+
+class FrameCache {
+public:
+    explicit FrameCache(const FrameCacheSettings& settings = FrameCacheSettings()) : settings(settings), memoryUsed(0), diskUsed(0) {
+        if (!settings.directory.empty()) scanDirectory();
+    }
+
+    FrameCache(const FrameCache&) = delete;
+    FrameCache& operator=(const FrameCache&) = delete;
+
+    // memory first, then disk. A frame found on disk is moved back into memory.
+    bool find(uint64_t key, CachedFrame& frame) {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto it = memoryIndex.find(key);
+        if (it != memoryIndex.end()) {
+            memory.splice(memory.begin(), memory, it->second);
+            frame = it->second->frame;
+            return true;
+        }
+
+        auto diskIt = diskIndex.find(key);
+        if (diskIt == diskIndex.end()) return false;
+        if (!readFrame(pathFor(key), frame)) {
+            // damaged or deleted behind our back, forget it
+            removeFromDisk(diskIt->second);
+            return false;
+        }
+        disk.splice(disk.begin(), disk, diskIt->second);
+        std::error_code error;
+        std::filesystem::last_write_time(pathFor(key), std::filesystem::file_time_type::clock::now(), error);
+        addToMemory(key, frame);
+        return true;
+    }
+
+    void insert(uint64_t key, const CachedFrame& frame) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (memoryIndex.count(key) == 0) addToMemory(key, frame);
+        if (settings.directory.empty() || diskIndex.count(key) != 0) return;
+
+        // written under a temporary name first, a crash never leaves a half frame behind the key
+        std::string path = pathFor(key);
+        std::string temporary = path + ".tmp";
+        if (!saveImageToPPM(temporary, frame.rgb->data(), frame.width, frame.height)) return;
+        std::error_code error;
+        std::filesystem::rename(temporary, path, error);
+        if (error) {
+            std::filesystem::remove(temporary, error);
+            return;
+        }
+        addToDisk(key, std::filesystem::file_size(path, error));
+    }
+
+    // renders through the cache: returns the cached frame, or calls render() and keeps the result
+    template<typename Render>
+    CachedFrame get(uint64_t key, int width, int height, Render render) {
+        CachedFrame frame;
+        if (find(key, frame)) return frame;
+        frame.width = width;
+        frame.height = height;
+        frame.rgb = render();
+        insert(key, frame);
+        return frame;
+    }
+
+    size_t memoryBytes() {
+        std::unique_lock<std::mutex> lock(mutex);
+        return memoryUsed;
+    }
+
+    uint64_t diskBytes() {
+        std::unique_lock<std::mutex> lock(mutex);
+        return diskUsed;
+    }
+
+private:
+    struct MemoryEntry {
+        uint64_t key;
+        CachedFrame frame;
+    };
+    struct DiskEntry {
+        uint64_t key;
+        uint64_t bytes;
+    };
+
+    FrameCacheSettings settings;
+    std::mutex mutex;
+    // most recently used at the front
+    std::list<MemoryEntry> memory;
+    std::unordered_map<uint64_t, std::list<MemoryEntry>::iterator> memoryIndex;
+    size_t memoryUsed;
+    std::list<DiskEntry> disk;
+    std::unordered_map<uint64_t, std::list<DiskEntry>::iterator> diskIndex;
+    uint64_t diskUsed;
+
+    std::string pathFor(uint64_t key) const {
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.ppm", static_cast<unsigned long long>(key));
+        return (std::filesystem::path(settings.directory) / name).string();
+    }
+
+    void addToMemory(uint64_t key, const CachedFrame& frame) {
+        size_t bytes = frame.rgb ? frame.rgb->size() : 0;
+        if (bytes > settings.memoryBytes) return;
+        memory.push_front({key, frame});
+        memoryIndex[key] = memory.begin();
+        memoryUsed += bytes;
+        while (memoryUsed > settings.memoryBytes) {
+            MemoryEntry& oldest = memory.back();
+            memoryUsed -= oldest.frame.rgb->size();
+            memoryIndex.erase(oldest.key);
+            memory.pop_back();
+        }
+    }
+
+    void addToDisk(uint64_t key, uint64_t bytes) {
+        disk.push_front({key, bytes});
+        diskIndex[key] = disk.begin();
+        diskUsed += bytes;
+        while (diskUsed > settings.diskBytes && disk.size() > 1) {
+            removeFromDisk(std::prev(disk.end()));
+        }
+    }
+
+    void removeFromDisk(std::list<DiskEntry>::iterator entry) {
+        std::error_code error;
+        std::filesystem::remove(pathFor(entry->key), error);
+        diskUsed -= entry->bytes;
+        diskIndex.erase(entry->key);
+        disk.erase(entry);
+    }
+
+    // picks up the frames earlier runs left behind, oldest modification time = least recently used
+    void scanDirectory() {
+        std::error_code error;
+        std::filesystem::create_directories(settings.directory, error);
+        std::vector<std::pair<std::filesystem::file_time_type, DiskEntry>> found;
+        for (const auto& file : std::filesystem::directory_iterator(settings.directory, error)) {
+            std::string name = file.path().filename().string();
+            if (name.size() != 20 || file.path().extension() != ".ppm") continue;
+            char* end = nullptr;
+            uint64_t key = strtoull(name.c_str(), &end, 16);
+            if (end != name.c_str() + 16) continue;
+            std::error_code fileError;
+            uint64_t bytes = file.file_size(fileError);
+            auto time = file.last_write_time(fileError);
+            if (!fileError) found.push_back({time, {key, bytes}});
+        }
+        std::sort(found.begin(), found.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+        for (const auto& f : found) addToDisk(f.second.key, f.second.bytes);
+    }
+
+    static bool readFrame(const std::string& path, CachedFrame& frame) {
+        FILE* fp = fopen(path.c_str(), "rb");
+        if (fp == NULL) return false;
+        int width = 0, height = 0, maxValue = 0;
+        bool ok = fscanf(fp, "P6 %d %d %d", &width, &height, &maxValue) == 3 && maxValue == 255 && width > 0 && height > 0 && fgetc(fp) != EOF;
+        if (ok) {
+            auto rgb = std::make_shared<std::vector<unsigned char>>(static_cast<size_t>(width) * height * 3);
+            ok = fread(rgb->data(), 1, rgb->size(), fp) == rgb->size();
+            frame.width = width;
+            frame.height = height;
+            frame.rgb = rgb;
+        }
+        fclose(fp);
+        return ok;
+    }
+};
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef FRAMEQUEUE_H
+#define FRAMEQUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "imagewriter.h"
+
+// A finished 8-bit RGB frame waiting to be encoded and written
+struct FrameJob {
+    std::string filename;
+    int width = 0, height = 0;
+    std::unique_ptr<unsigned char[]> rgb;
+};
+
+// Encodes and writes frames on dedicated I/O threads so the renderer can start on the next
+// frame right away. At most maxPending frames are queued or being written at any time,
+// push() blocks when that limit is hit, which keeps memory bounded when the disk is slower
+// than the renderer.
+class FrameWriterQueue {
+public:
+    FrameWriterQueue(int ioThreads = 1, size_t maxPending = 3) : maxPending(maxPending), pending(0), failed(0), stopping(false) {
+        for (int i = 0; i < ioThreads; i++) {
+            workers.emplace_back([this]() { run(); });
+        }
+    }
+
+    ~FrameWriterQueue() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        workAvailable.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    FrameWriterQueue(const FrameWriterQueue&) = delete;
+    FrameWriterQueue& operator=(const FrameWriterQueue&) = delete;
+
+    void push(FrameJob job) {
+        std::unique_lock<std::mutex> lock(mutex);
+        slotFree.wait(lock, [this]() { return pending < maxPending; });
+        pending++;
+        jobs.push_back(std::move(job));
+        workAvailable.notify_one();
+    }
+
+    // blocks until every frame pushed so far is on disk
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        slotFree.wait(lock, [this]() { return pending == 0; });
+    }
+
+    // frames that could not be written so far
+    int failures() {
+        std::unique_lock<std::mutex> lock(mutex);
+        return failed;
+    }
+
+private:
+    size_t maxPending;
+    size_t pending;     // queued plus currently being written
+    int failed;
+    bool stopping;
+    std::deque<FrameJob> jobs;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable workAvailable;
+    std::condition_variable slotFree;
+
+    void run() {
+        while (true) {
+            FrameJob job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                workAvailable.wait(lock, [this]() { return stopping || !jobs.empty(); });
+                if (jobs.empty()) return;   // stopping, and everything has been handed out
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+
+            bool ok = writeImageFile(job.filename, job.rgb.get(), job.width, job.height);
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                pending--;
+                if (!ok) failed++;
+            }
+            slotFree.notify_all();
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,188 @@
+#ifndef GBUFFER_H
+#define GBUFFER_H
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "vec3.h"
+#include "ray.h"
+#include "framebuffer.h"
+#include "sampler.h"
+#include "camerabasis.h"
+
+// Where the rays of one frame hit the scene and what came out of it, kept so the next frame
+// only redoes what actually changed. The first pass of renderHDR records, for every pixel
+// centre, the primary hit and the hit of the glaze reflection, plus the colour it shaded. The
+// refine pass keeps its colours, how many rays every pixel took and the hits of those rays.
+//
+// trackSceneChanges() (scenechanges.h) compares every new version of the scene with the last
+// one. When only the lights changed the hits are shaded again. When primitives changed, their
+// bounds before and after are kept, and only pixels with a ray (primary, reflection or shadow)
+// that comes near one of them are traced again. A ray that stays clear of all of them sees
+// exactly the same scene as before, so the frame is the same as a full render.
+//
+// When only the camera moved, the hits are of no use any more, but with temporal reprojection
+// turned on the colours still are: every pixel finds its new primary hit, looks up where that
+// point was on the screen of the last frame, and takes the old colour when the same object was
+// there at the same depth. Only pixels that just came into view, and a few picked at random to
+// keep old colours from lingering, are shaded. Highlights and reflections depend on where the
+// camera is, so a reused colour is close but not exact, frames like that are for animations
+// and previews, never for the frame cache.
+
+// one hit, object is the ID of the primitive hit (objects.h)
+struct SurfaceHit {
+    int object = -1;    // -1 = the ray missed everything
+    double t = 0;
+    Vec3 normal = Vec3(0, 0, 0);
+};
+
+struct GBufferPixel {
+    SurfaceHit primary;
+    SurfaceHit reflected;   // only for glazed primary hits whose reflection hits something
+};
+
+// bounding sphere of a primitive, planes have an infinite radius
+struct Bounds {
+    Vec3 centre = Vec3(0, 0, 0);
+    double radius = 0;
+};
+
+// true when the half line ray.origin + t * ray.direction, t >= 0, comes within the bounds.
+// The radius gets a little slack, the intersection tests have rounding errors of their own
+inline bool rayTouches(const Ray& ray, const Bounds& bounds) {
+    if (std::isinf(bounds.radius)) return true;
+    Vec3 oc = bounds.centre - ray.origin;
+    double along = std::max(0.0, oc.dot(ray.direction) / ray.direction.dot(ray.direction));
+    Vec3 closest = oc - ray.direction * along;
+    double radius = bounds.radius * (1 + 1e-6) + 1e-6;
+    return closest.dot(closest) <= radius * radius;
+}
+
+struct TemporalSettings {
+    bool enabled = false;           // reuse colours across camera moves
+    double depthTolerance = 0.02;   // relative depth difference that still counts as the same point
+    double refreshFraction = 0.1;   // share of the reusable pixels that are shaded anyway, every frame
+    int maxAge = 8;                 // frames a colour is reused at most before it is shaded again
+};
+
+// What one layer of cached results has missed since it was made
+struct GBufferLayer {
+    bool valid = false;         // false = nothing in it is worth keeping
+    bool relight = false;       // the lights changed since
+    std::vector<Bounds> moved;  // bounds before and after of every primitive that changed since
+
+    // past this many changed primitives testing every ray against them stops paying off
+    static const size_t maxMoved = 64;
+
+    void invalidate() {
+        valid = false;
+        relight = false;
+        moved.clear();
+    }
+
+    // the layer is up to date again
+    void settle() {
+        valid = true;
+        relight = false;
+        moved.clear();
+    }
+
+    void addMoved(const Bounds& bounds) {
+        if (!valid) return;
+        moved.push_back(bounds);
+        if (moved.size() > maxMoved) invalidate();
+    }
+
+    // true when any of the moved bounds is in the way of ray
+    bool touches(const Ray& ray) const {
+        for (const Bounds& b : moved) {
+            if (rayTouches(ray, b)) return true;
+        }
+        return false;
+    }
+};
+
+class GBuffer {
+public:
+    // the scene the layers were made for, trackSceneChanges() keeps these
+    uint64_t sizeKey = 0;
+    uint64_t poseKey = 0;
+    uint64_t lightsKey = 0;
+    std::vector<uint64_t> objectKeys;   // one per primitive, by ID
+    std::vector<Bounds> objectBounds;
+
+    int width = 0, rowBegin = 0, rows = 0;
+
+    // first pass: hits and colours of the pixel centres. ages counts the frames since a
+    // colour was last shaded, anything above 0 was reprojected
+    std::vector<GBufferPixel> pixels;
+    FrameBuffer shaded;
+    std::vector<uint8_t> ages;
+    GBufferLayer first;
+
+    // the camera the first pass was made with, and whether it has moved since
+    CameraBasis camera;
+    CameraBasis previousCamera;
+    bool cameraMoved = false;
+    TemporalSettings temporal;
+    uint32_t frame = 0;     // seeds the random refresh
+
+    // refine pass: colours before denoising, rays per pixel (0 = not refined)
+    FrameBuffer refined;
+    std::vector<uint16_t> samples;
+    // and the hits of every refinement ray but the centre one, so a refined pixel is checked
+    // against the changes without tracing its rays again. One list per row, the rays of a
+    // pixel start at sampleStart in its row's list
+    std::vector<std::vector<GBufferPixel>> sampleHits;
+    std::vector<uint32_t> sampleStart;
+    SamplerSettings sampling;
+    GBufferLayer refine;
+
+    bool sameSize(int w, int begin, int count) const {
+        return width == w && rowBegin == begin && rows == count;
+    }
+
+    bool holds(int w, int begin, int count) const {
+        return first.valid && sameSize(w, begin, count);
+    }
+
+    void resize(int w, int begin, int count) {
+        width = w;
+        rowBegin = begin;
+        rows = count;
+        pixels.assign(static_cast<size_t>(w) * count, GBufferPixel());
+        samples.assign(pixels.size(), 0);
+        sampleHits.assign(count, std::vector<GBufferPixel>());
+        sampleStart.assign(pixels.size(), 0);
+        ages.assign(pixels.size(), 0);
+        invalidate();
+    }
+
+    void invalidate() {
+        first.invalidate();
+        refine.invalidate();
+        cameraMoved = false;
+    }
+
+    // only the first pass colours are worth keeping across a camera move
+    void moveCamera(const CameraBasis& newCamera) {
+        refine.invalidate();
+        if (!cameraMoved) previousCamera = camera;
+        cameraMoved = first.valid;
+        camera = newCamera;
+    }
+
+    void relight() {
+        first.relight = true;
+        refine.relight = true;
+    }
+
+    void addMoved(const Bounds& before, const Bounds& after) {
+        first.addMoved(before);
+        first.addMoved(after);
+        refine.addMoved(before);
+        refine.addMoved(after);
+    }
+};
+
+#endif
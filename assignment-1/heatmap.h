@@ -0,0 +1,114 @@
+#ifndef HEATMAP_H
+#define HEATMAP_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "instrument.h"
+
+// A false colour picture of what each pixel cost instead of its shaded colour, black for
+// nothing through blue, red and yellow to white for the most expensive pixels. The cost is
+// summed over every ray the pixel took (refinement samples too) and can be the time spent on
+// it, or one of the counters of instrument.h, which need a build with -DRT_INSTRUMENT.
+enum class HeatmapMetric {
+    Off,
+    Nodes,          // traversal steps
+    Tests,          // primitive intersection tests
+    ShadowRays,
+    Nanoseconds
+};
+
+struct HeatmapSettings {
+    HeatmapMetric metric = HeatmapMetric::Off;
+    // the cost that maps to white, 0 picks it from the frame (the 99th percentile, so a few
+    // outliers don't turn everything else black)
+    double maxCost = 0;
+};
+
+inline const char* heatmapUnit(HeatmapMetric metric) {
+    switch (metric) {
+    case HeatmapMetric::Nodes: return "nodes";
+    case HeatmapMetric::Tests: return "tests";
+    case HeatmapMetric::ShadowRays: return "shadow rays";
+    case HeatmapMetric::Nanoseconds: return "ns";
+    default: return "";
+    }
+}
+
+// the metric's counter needs the instrumented build, time is always there
+inline bool heatmapAvailable(HeatmapMetric metric) {
+    return metric == HeatmapMetric::Nanoseconds || metric == HeatmapMetric::Off || instrumentationBuilt;
+}
+
+// What every pixel of the rows being rendered cost so far
+class PixelCosts {
+public:
+    HeatmapMetric metric;
+    std::vector<float> values;
+
+    PixelCosts(HeatmapMetric metric, size_t pixels) : metric(metric), values(pixels, 0.0f) {}
+
+    // a running count on this thread, the cost of some work is the difference across it
+    uint64_t now() const {
+        switch (metric) {
+        case HeatmapMetric::Nodes: return threadCount(Counter::NodesVisited);
+        case HeatmapMetric::Tests: return threadCount(Counter::PrimitiveTests);
+        case HeatmapMetric::ShadowRays: return threadCount(Counter::ShadowRays);
+        case HeatmapMetric::Nanoseconds:
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+        default: return 0;
+        }
+    }
+};
+
+// Adds the cost of the rest of the scope to a pixel, does nothing without costs. A pixel is
+// only ever worked on by one thread at a time
+class PixelCostScope {
+public:
+    PixelCosts* costs;
+    int index;
+    uint64_t start = 0;
+
+    PixelCostScope(PixelCosts* costs, int index) : costs(costs), index(index) {
+        if (costs != nullptr) start = costs->now();
+    }
+
+    ~PixelCostScope() {
+        if (costs != nullptr) costs->values[index] += static_cast<float>(costs->now() - start);
+    }
+
+    PixelCostScope(const PixelCostScope&) = delete;
+    PixelCostScope& operator=(const PixelCostScope&) = delete;
+};
+
+// black, blue, red, yellow, white
+inline void heatColour(float v, unsigned char* rgb) {
+    static const float stops[5][3] = {{0, 0, 0}, {0.1f, 0.1f, 0.8f}, {0.9f, 0.1f, 0.1f}, {1, 0.9f, 0}, {1, 1, 1}};
+    v = std::min(std::max(v, 0.0f), 1.0f) * 4;
+    int i = std::min(static_cast<int>(v), 3);
+    float f = v - i;
+    for (int c = 0; c < 3; c++) {
+        float value = stops[i][c] + (stops[i + 1][c] - stops[i][c]) * f;
+        rgb[c] = static_cast<unsigned char>(value * 255 + 0.5f);
+    }
+}
+
+// Turns the costs into 8-bit RGB, returns the cost white stands for
+inline double heatmapImage(const PixelCosts& costs, unsigned char* rgb, const HeatmapSettings& settings) {
+    double top = settings.maxCost;
+    if (top <= 0 && !costs.values.empty()) {
+        std::vector<float> sorted = costs.values;
+        size_t at = (sorted.size() - 1) * 99 / 100;
+        std::nth_element(sorted.begin(), sorted.begin() + at, sorted.end());
+        top = sorted[at];
+    }
+    top = std::max(top, 1.0);
+    for (size_t i = 0; i < costs.values.size(); i++) {
+        heatColour(static_cast<float>(costs.values[i] / top), rgb + i * 3);
+    }
+    return top;
+}
+
+#endif
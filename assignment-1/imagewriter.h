@@ -0,0 +1,270 @@
+#ifndef IMAGEWRITER_H
+#define IMAGEWRITER_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "tga.h"
+
+// Streaming image writers. open() writes the header, writeRows() takes the next rows of
+// 8-bit RGB in top to bottom order, and close() finishes the file. The whole frame never
+// has to be in memory at once, so a renderer can push rows as soon as they are done.
+class ImageWriter {
+public:
+    virtual ~ImageWriter() {}
+
+    virtual bool open(const std::string& filename, uint32_t width, uint32_t height) = 0;
+    virtual bool writeRows(const uint8_t* rgb, uint32_t rowCount) = 0;
+    virtual bool close() = 0;
+};
+
+// Shared plumbing: an output buffer that goes to disk in large fwrite calls
+class BufferedFileWriter : public ImageWriter {
+public:
+    static const size_t flushSize = 1 << 20;
+
+    FILE* fp;
+    std::string filename;
+    uint32_t width, height;
+    uint32_t rowsWritten;
+    std::vector<uint8_t> buffer;
+    size_t used;
+    bool ok;
+
+    BufferedFileWriter() : fp(NULL), width(0), height(0), rowsWritten(0), used(0), ok(false) {}
+
+    ~BufferedFileWriter() override {
+        if (fp) fclose(fp);
+    }
+
+    bool open(const std::string& name, uint32_t w, uint32_t h) override {
+        filename = name;
+        width = w;
+        height = h;
+        rowsWritten = 0;
+        used = 0;
+        fp = openForWriting(filename.c_str());
+        if (fp == NULL) {
+            std::cerr << "Error: Unable to open file for writing: " << filename << std::endl;
+            return ok = false;
+        }
+        // a full chunk plus a worst case encoded row always fits
+        buffer.resize(flushSize + 2 * (size_t)width * 4 + 64);
+        ok = true;
+        return writeHeader();
+    }
+
+    bool writeRows(const uint8_t* rgb, uint32_t rowCount) override {
+        if (!ok) return false;
+        if (rowsWritten + rowCount > height) {
+            std::cerr << "Error: more rows than the image has: " << filename << std::endl;
+            return ok = false;
+        }
+        for (uint32_t r = 0; r < rowCount; r++) {
+            used += encodeRow(rgb + (size_t)r * width * 3, buffer.data() + used);
+            if (used >= flushSize) flush();
+        }
+        rowsWritten += rowCount;
+        return ok;
+    }
+
+    bool close() override {
+        if (fp == NULL) return false;
+        if (ok && rowsWritten != height) {
+            std::cerr << "Error: closed after " << rowsWritten << " of " << height << " rows: " << filename << std::endl;
+            ok = false;
+        }
+        if (ok) {
+            used += writeTrailer(buffer.data() + used);
+            flush();
+        }
+        ok = (fclose(fp) == 0) && ok;
+        fp = NULL;
+        if (!ok) std::cerr << "Error: Failed writing " << filename << std::endl;
+        return ok;
+    }
+
+protected:
+    // the format specific parts, each returns the number of bytes it put into out
+    virtual bool writeHeader() = 0;
+    virtual size_t encodeRow(const uint8_t* rgb, uint8_t* out) = 0;
+    virtual size_t writeTrailer(uint8_t* /*out*/) { return 0; }
+
+    void append(const void* data, size_t n) {
+        memcpy(buffer.data() + used, data, n);
+        used += n;
+    }
+
+    void flush() {
+        if (used > 0) {
+            ok = ok && fwrite(buffer.data(), 1, used, fp) == used;
+        }
+        used = 0;
+    }
+};
+
+// Binary PPM (P6), the rows go out as they are
+class PpmWriter : public BufferedFileWriter {
+protected:
+    bool writeHeader() override {
+        std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+        append(header.data(), header.size());
+        return ok;
+    }
+
+    size_t encodeRow(const uint8_t* rgb, uint8_t* out) override {
+        size_t n = (size_t)width * 3;
+        memcpy(out, rgb, n);
+        return n;
+    }
+};
+
+// Streaming TGA. Rows arrive top first and are stored in that order with a bottom-left origin,
+// which shows up the same way as the frames tga_write has always produced.
+class TgaWriter : public BufferedFileWriter {
+public:
+    bool rle;
+
+    explicit TgaWriter(bool rle = false) : rle(rle) {}
+
+protected:
+    std::vector<uint8_t> row;
+
+    bool writeHeader() override {
+        if (width > 0xFFFF || height > 0xFFFF) {
+            std::cerr << "Error: TGA stores dimensions in 16 bits, " << width << "x" << height << " is too large: " << filename << std::endl;
+            return ok = false;
+        }
+        uint8_t header[18];
+        tgaHeader(header, width, height, 3, rle, false);
+        append(header, 18);
+        row.resize((size_t)width * 3);
+        return ok;
+    }
+
+    size_t encodeRow(const uint8_t* rgb, uint8_t* out) override {
+        if (!rle) {
+            swizzleRow(rgb, out, width, 3, 3);
+            return (size_t)width * 3;
+        }
+        swizzleRow(rgb, row.data(), width, 3, 3);
+        return rleEncodeRow(row.data(), width, 3, out);
+    }
+};
+
+// QOI, "The Quite OK Image Format" (https://qoiformat.org/qoi-specification.pdf).
+// The encoder state carries over from row to row, the pixel stream doesn't care about rows.
+class QoiWriter : public BufferedFileWriter {
+protected:
+    uint8_t index[64][4];   // rgba, alpha tells real entries from the zeroed start state
+    uint8_t prev[3];
+    int run;
+
+    static int hashIndex(const uint8_t* p) {
+        return (p[0] * 3 + p[1] * 5 + p[2] * 7 + 255 * 11) % 64;
+    }
+
+    bool writeHeader() override {
+        memset(index, 0, sizeof(index));
+        prev[0] = prev[1] = prev[2] = 0;
+        run = 0;
+
+        uint8_t header[14] = { 'q', 'o', 'i', 'f',
+            (uint8_t)(width >> 24), (uint8_t)(width >> 16), (uint8_t)(width >> 8), (uint8_t)width,
+            (uint8_t)(height >> 24), (uint8_t)(height >> 16), (uint8_t)(height >> 8), (uint8_t)height,
+            3, 0 };
+        append(header, 14);
+        return ok;
+    }
+
+    size_t encodeRow(const uint8_t* rgb, uint8_t* out) override {
+        uint8_t* start = out;
+        for (uint32_t x = 0; x < width; x++) {
+            const uint8_t* px = rgb + x * 3;
+
+            if (px[0] == prev[0] && px[1] == prev[1] && px[2] == prev[2]) {
+                run++;
+                if (run == 62) {
+                    *out++ = 0xc0 | (run - 1);   // QOI_OP_RUN
+                    run = 0;
+                }
+                continue;
+            }
+            if (run > 0) {
+                *out++ = 0xc0 | (run - 1);
+                run = 0;
+            }
+
+            int h = hashIndex(px);
+            if (index[h][0] == px[0] && index[h][1] == px[1] && index[h][2] == px[2] && index[h][3] == 255) {
+                *out++ = h;                       // QOI_OP_INDEX
+            } else {
+                memcpy(index[h], px, 3);
+                index[h][3] = 255;
+
+                int8_t dr = px[0] - prev[0];
+                int8_t dg = px[1] - prev[1];
+                int8_t db = px[2] - prev[2];
+                int8_t drg = dr - dg;
+                int8_t dbg = db - dg;
+
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                    *out++ = 0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);   // QOI_OP_DIFF
+                } else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7) {
+                    *out++ = 0x80 | (dg + 32);                                  // QOI_OP_LUMA
+                    *out++ = (drg + 8) << 4 | (dbg + 8);
+                } else {
+                    *out++ = 0xfe;                                              // QOI_OP_RGB
+                    *out++ = px[0];
+                    *out++ = px[1];
+                    *out++ = px[2];
+                }
+            }
+            memcpy(prev, px, 3);
+        }
+        return out - start;
+    }
+
+    size_t writeTrailer(uint8_t* out) override {
+        uint8_t* start = out;
+        if (run > 0) *out++ = 0xc0 | (run - 1);
+        static const uint8_t padding[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+        memcpy(out, padding, 8);
+        out += 8;
+        return out - start;
+    }
+};
+
+// Whole frame helpers on top of the streaming writers
+inline bool saveImage(ImageWriter& writer, const std::string& filename, const unsigned char* imageData, int width, int height) {
+    if (!writer.open(filename, width, height)) return false;
+    writer.writeRows(imageData, height);
+    return writer.close();
+}
+
+inline bool saveImageToPPM(const std::string& filename, const unsigned char* imageData, int width, int height) {
+    PpmWriter writer;
+    return saveImage(writer, filename, imageData, width, height);
+}
+
+inline bool saveImageToQOI(const std::string& filename, const unsigned char* imageData, int width, int height) {
+    QoiWriter writer;
+    return saveImage(writer, filename, imageData, width, height);
+}
+
+// Picks the format from the file extension: .ppm, .qoi, anything else is written as TGA
+// the same way the viewer always has
+inline bool writeImageFile(const std::string& filename, const unsigned char* imageData, int width, int height) {
+    auto endsWith = [&](const char* ext) {
+        size_t n = strlen(ext);
+        return filename.size() >= n && filename.compare(filename.size() - n, n, ext) == 0;
+    };
+    if (endsWith(".ppm")) return saveImageToPPM(filename, imageData, width, height);
+    if (endsWith(".qoi")) return saveImageToQOI(filename, imageData, width, height);
+    return tga_write(filename, width, height, imageData, 3, 3);
+}
+
+#endif
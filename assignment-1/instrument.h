@@ -0,0 +1,269 @@
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+// Where a frame's time goes: counters for the rays, the primitive tests and the shading the
+// renderer does, and timers around the passes and rows that can be saved as a Chrome trace
+// (chrome://tracing or ui.perfetto.dev). All of it is only built with -DRT_INSTRUMENT, without
+// it the macros below are empty and the functions report nothing, so normal builds pay nothing.
+//
+// Every thread counts into its own record, which is added to the totals when the thread ends,
+// so counting is a plain increment with no shared cache line. counterTotals() adds up the
+// finished threads and the running ones.
+
+enum class Counter {
+    CameraRays,         // primary rays, refinement samples included
+    ShadowRays,
+    GlazeRays,          // reflections off glazed surfaces
+    NodesVisited,       // the scan has no tree yet, each chunk of spheres the sphere kernel takes counts as one node
+    PrimitiveTests,
+    ShadingCalls,       // Shader::calculateShading, once per light per hit shaded
+    Tiles,              // rows of a pass, the unit threads take work in
+    TileNanoseconds,
+    Count
+};
+
+inline const char* counterName(Counter counter) {
+    switch (counter) {
+    case Counter::CameraRays: return "camera rays";
+    case Counter::ShadowRays: return "shadow rays";
+    case Counter::GlazeRays: return "glaze rays";
+    case Counter::NodesVisited: return "nodes visited";
+    case Counter::PrimitiveTests: return "primitive tests";
+    case Counter::ShadingCalls: return "shading calls";
+    case Counter::Tiles: return "tiles";
+    case Counter::TileNanoseconds: return "tile ns";
+    default: return "?";
+    }
+}
+
+struct CounterTotals {
+    uint64_t values[static_cast<int>(Counter::Count)] = {};
+
+    uint64_t operator[](Counter counter) const {
+        return values[static_cast<int>(counter)];
+    }
+
+    // what happened between two snapshots
+    CounterTotals operator-(const CounterTotals& before) const {
+        CounterTotals d;
+        for (int i = 0; i < static_cast<int>(Counter::Count); i++) d.values[i] = values[i] - before.values[i];
+        return d;
+    }
+};
+
+// One frame's (or run's) counters as a few lines of text
+inline void printCounterSummary(const CounterTotals& c, double milliseconds) {
+    uint64_t rays = c[Counter::CameraRays] + c[Counter::ShadowRays] + c[Counter::GlazeRays];
+    printf("  rays: %llu camera, %llu shadow, %llu glaze (%.2f M rays/s)\n",
+        static_cast<unsigned long long>(c[Counter::CameraRays]), static_cast<unsigned long long>(c[Counter::ShadowRays]),
+        static_cast<unsigned long long>(c[Counter::GlazeRays]), milliseconds > 0 ? rays / milliseconds / 1000 : 0.0);
+    printf("  traversal: %llu nodes, %llu primitive tests (%.1f a ray), %llu shading calls\n",
+        static_cast<unsigned long long>(c[Counter::NodesVisited]), static_cast<unsigned long long>(c[Counter::PrimitiveTests]),
+        rays > 0 ? static_cast<double>(c[Counter::PrimitiveTests]) / rays : 0.0, static_cast<unsigned long long>(c[Counter::ShadingCalls]));
+    uint64_t tiles = c[Counter::Tiles];
+    printf("  tiles: %llu, %.3f ms each on average\n", static_cast<unsigned long long>(tiles),
+        tiles > 0 ? c[Counter::TileNanoseconds] / 1e6 / tiles : 0.0);
+}
+
+#if defined(RT_INSTRUMENT)
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+struct TraceEvent {
+    const char* name;       // a literal, scopes are named in the code
+    uint64_t start;         // ns since the instrumentation started
+    uint64_t duration;
+    uint32_t thread;
+};
+
+struct ThreadRecord;
+
+class Instrumentation {
+public:
+    // more than this many events per thread are dropped, a trace is for a few frames
+    static constexpr size_t maxEventsPerThread = 1 << 20;
+
+    std::mutex mutex;
+    std::vector<ThreadRecord*> live;
+    CounterTotals retired;
+    std::vector<TraceEvent> retiredEvents;
+    std::atomic<bool> tracing{false};
+    uint32_t nextThread = 0;
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+    static Instrumentation& instance() {
+        static Instrumentation instrumentation;
+        return instrumentation;
+    }
+
+    uint64_t now() const {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count());
+    }
+};
+
+struct ThreadRecord {
+    // only this thread writes them, relaxed atomics just let counterTotals() read them meanwhile
+    std::atomic<uint64_t> counters[static_cast<int>(Counter::Count)];
+    std::mutex eventMutex;  // never contended while rendering, taken once per scope
+    std::vector<TraceEvent> events;
+    uint32_t thread;
+
+    ThreadRecord() {
+        for (auto& c : counters) c.store(0, std::memory_order_relaxed);
+        Instrumentation& in = Instrumentation::instance();
+        std::lock_guard<std::mutex> lock(in.mutex);
+        thread = in.nextThread++;
+        in.live.push_back(this);
+    }
+
+    ~ThreadRecord() {
+        Instrumentation& in = Instrumentation::instance();
+        std::lock_guard<std::mutex> lock(in.mutex);
+        for (int i = 0; i < static_cast<int>(Counter::Count); i++) in.retired.values[i] += counters[i].load(std::memory_order_relaxed);
+        in.retiredEvents.insert(in.retiredEvents.end(), events.begin(), events.end());
+        in.live.erase(std::find(in.live.begin(), in.live.end(), this));
+    }
+
+    void add(Counter counter, uint64_t n) {
+        std::atomic<uint64_t>& c = counters[static_cast<int>(counter)];
+        c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    void record(const char* name, uint64_t start, uint64_t duration) {
+        std::lock_guard<std::mutex> lock(eventMutex);
+        if (events.size() < Instrumentation::maxEventsPerThread) events.push_back({name, start, duration, thread});
+    }
+};
+
+inline ThreadRecord& threadRecord() {
+    thread_local ThreadRecord record;
+    return record;
+}
+
+// Times a scope. A tile scope always adds to the tile counters, any scope becomes a trace
+// event while tracing is on
+class ScopedTimer {
+public:
+    const char* name;
+    bool tile;
+    bool timed;
+    uint64_t start = 0;
+
+    ScopedTimer(const char* name, bool tile) : name(name), tile(tile) {
+        timed = tile || Instrumentation::instance().tracing.load(std::memory_order_relaxed);
+        // the thread's record is made here rather than somewhere in the tile, where nothing should allocate
+        if (tile) threadRecord();
+        if (timed) start = Instrumentation::instance().now();
+    }
+
+    ~ScopedTimer() {
+        if (!timed) return;
+        Instrumentation& in = Instrumentation::instance();
+        uint64_t duration = in.now() - start;
+        ThreadRecord& record = threadRecord();
+        if (tile) {
+            record.add(Counter::Tiles, 1);
+            record.add(Counter::TileNanoseconds, duration);
+        }
+        if (in.tracing.load(std::memory_order_relaxed)) record.record(name, start, duration);
+    }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+};
+
+constexpr bool instrumentationBuilt = true;
+
+inline CounterTotals counterTotals() {
+    Instrumentation& in = Instrumentation::instance();
+    std::lock_guard<std::mutex> lock(in.mutex);
+    CounterTotals totals = in.retired;
+    for (ThreadRecord* record : in.live) {
+        for (int i = 0; i < static_cast<int>(Counter::Count); i++) totals.values[i] += record->counters[i].load(std::memory_order_relaxed);
+    }
+    return totals;
+}
+
+// this thread's own count so far, differences of it give the cost of a piece of work
+inline uint64_t threadCount(Counter counter) {
+    return threadRecord().counters[static_cast<int>(counter)].load(std::memory_order_relaxed);
+}
+
+// scopes are recorded from now on, until it's turned off again
+inline void setTracing(bool on) {
+    Instrumentation::instance().tracing.store(on, std::memory_order_relaxed);
+}
+
+// Writes everything recorded so far as Chrome trace_event JSON, complete ("X") events in
+// microseconds with one track per thread
+inline bool writeChromeTrace(const std::string& filename) {
+    Instrumentation& in = Instrumentation::instance();
+    std::vector<TraceEvent> events;
+    {
+        std::lock_guard<std::mutex> lock(in.mutex);
+        events = in.retiredEvents;
+        for (ThreadRecord* record : in.live) {
+            std::lock_guard<std::mutex> eventLock(record->eventMutex);
+            events.insert(events.end(), record->events.begin(), record->events.end());
+        }
+    }
+    std::sort(events.begin(), events.end(), [](const TraceEvent& a, const TraceEvent& b) { return a.start < b.start; });
+
+    FILE* file = fopen(filename.c_str(), "w");
+    if (file == nullptr) {
+        std::cerr << "Error: can't write " << filename << std::endl;
+        return false;
+    }
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (size_t i = 0; i < events.size(); i++) {
+        const TraceEvent& e = events[i];
+        fprintf(file, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f}%s\n",
+            e.name, e.thread, e.start / 1000.0, e.duration / 1000.0, i + 1 < events.size() ? "," : "");
+    }
+    fprintf(file, "]}\n");
+    return fclose(file) == 0;
+}
+
+#define RT_CONCAT_(a, b) a##b
+#define RT_CONCAT(a, b) RT_CONCAT_(a, b)
+// RT_COUNT(ShadowRays, 1) adds to a counter of this thread
+#define RT_COUNT(counter, n) threadRecord().add(Counter::counter, static_cast<uint64_t>(n))
+// times the rest of the enclosing scope
+#define RT_SCOPE(name) ScopedTimer RT_CONCAT(rtScope, __LINE__)(name, false)
+#define RT_TILE_SCOPE(name) ScopedTimer RT_CONCAT(rtScope, __LINE__)(name, true)
+
+#else
+
+constexpr bool instrumentationBuilt = false;
+
+inline CounterTotals counterTotals() {
+    return CounterTotals();
+}
+
+inline uint64_t threadCount(Counter) {
+    return 0;
+}
+
+inline void setTracing(bool) {}
+
+inline bool writeChromeTrace(const std::string&) {
+    std::cerr << "Error: no trace, this build doesn't have -DRT_INSTRUMENT" << std::endl;
+    return false;
+}
+
+#define RT_COUNT(counter, n) ((void)0)
+#define RT_SCOPE(name) ((void)0)
+#define RT_TILE_SCOPE(name) ((void)0)
+
+#endif
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "vec3.h"
+#include "cpudispatch.h"
+
+// Intersection maths written once, as templates over the vector type V and its scalar S.
+// The objects call them with Vec3 and double, the same code runs on Vec3f and float, or on
+// the SIMD packets of vec3simd.h (Vec3x8f and Floatx8) for eight rays or primitives at once.
+// The loops over many primitives are compiled per CPU level (cpudispatch.h).
+
+// The nearer root t of |origin + t * direction - centre| = radius. The ray misses the sphere
+// where discriminant comes out negative, t is NaN there.
+template<typename V, typename S>
+inline S sphereNearRoot(const V& origin, const V& direction, const V& centre, S radius, S& discriminant) {
+    using std::sqrt;
+    V oc = origin - centre;
+    S a = direction.dot(direction);
+    S b = (direction * S(2)).dot(oc);
+    S c = oc.dot(oc) - (radius * radius);
+    discriminant = (b * b) - (S(4) * a * c);
+    return (-b - sqrt(discriminant)) / (S(2) * a);
+}
+
+// The spheres of a world once more, as arrays, so one ray is tested against several of them
+// at once. object is each sphere's primitive ID
+struct SphereArrays {
+    std::vector<double> cx, cy, cz, radius;
+    std::vector<int> object;
+
+    // spheres go through sphereRoots this many at a time
+    static constexpr int chunk = 64;
+
+    size_t size() const { return object.size(); }
+
+    void reserve(size_t n) {
+        for (auto* v : {&cx, &cy, &cz, &radius}) v->reserve(n);
+        object.reserve(n);
+    }
+
+    void add(const Vec3& centre, double r, int objectIndex) {
+        cx.push_back(centre.x);
+        cy.push_back(centre.y);
+        cz.push_back(centre.z);
+        radius.push_back(r);
+        object.push_back(objectIndex);
+    }
+};
+
+// cond ? a : b done with bit masks, GCC turns a ?: into a branch and moves whatever only
+// feeds one side of it in there, which stops the vectoriser short of AVX-512's masked stores
+inline double selectBits(bool cond, double a, double b) {
+    uint64_t x, y;
+    memcpy(&x, &a, 8);
+    memcpy(&y, &b, 8);
+    uint64_t mask = 0 - (uint64_t)cond;
+    x = (x & mask) | (y & ~mask);
+    memcpy(&a, &x, 8);
+    return a;
+}
+
+// t of spheres [first, first + n) along the ray, -1 for the ones it misses. Lane for lane the
+// sums of Sphere::hit, so the result is the same to the bit. The loop has no branch, so every
+// level packs it: the root is taken of |discriminant| (the discriminant itself wherever the
+// root is kept) and the misses are masked out afterwards
+inline void sphereRootsBody(const Vec3& origin, const Vec3& direction, const double* cx, const double* cy, const double* cz, const double* radius, int n, double* __restrict t) {
+    double a = direction.dot(direction);
+    Vec3 twoDirection = direction * 2.0;
+    for (int i = 0; i < n; i++) {
+        Vec3 oc = origin - Vec3(cx[i], cy[i], cz[i]);
+        double b = twoDirection.dot(oc);
+        double c = oc.dot(oc) - (radius[i] * radius[i]);
+        double discriminant = (b * b) - (4.0 * a * c);
+        double root = (-b - std::sqrt(std::fabs(discriminant))) / (2.0 * a);
+        t[i] = selectBits(discriminant >= 0, root, -1.0);
+    }
+}
+
+RT_DISPATCH_KERNEL(sphereRootsKernel,
+    (const Vec3& origin, const Vec3& direction, const double* cx, const double* cy, const double* cz, const double* radius, int n, double* __restrict t),
+    (origin, direction, cx, cy, cz, radius, n, t),
+    sphereRootsBody)
+
+inline void sphereRoots(const Vec3& origin, const Vec3& direction, const SphereArrays& spheres, size_t first, int n, double* t) {
+    sphereRootsKernel(origin, direction, spheres.cx.data() + first, spheres.cy.data() + first, spheres.cz.data() + first, spheres.radius.data() + first, n, t);
+}
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef LARGEIMAGE_H
+#define LARGEIMAGE_H
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include "camera.h"
+#include "mappedfile.h"
+
+// Large image mode for print and poster sized renders.
+// The output is a binary PPM (P6): the header has no 16 bit size limit like TGA, and the
+// pixels are plain rows, so every strip of rows lands at a known offset in the file.
+// The image is rendered strip by strip straight into a memory mapped window of the file,
+// so resident memory depends on the width and the strip height, never on the full height.
+struct LargeImageSettings {
+    int stripRows = 64;
+};
+
+// Rows of extra context a strip needs above and below so that the adaptive sampler's
+// neighbour test and the denoiser's widest taps see the same pixels as in a full frame
+inline int stripApron(const RenderSettings& settings) {
+    int apron = 1;
+    if (settings.denoise.iterations > 0) {
+        apron += 2 * ((1 << settings.denoise.iterations) - 1);
+    }
+    return apron;
+}
+
+inline bool renderLargeImage(const std::string& filename, const Objects& world, bool orthogonal, int width, int height, Vec3 cameraPosition, Vec3 camera_up, Vec3 look_at, const RenderSettings& settings = RenderSettings(), const LargeImageSettings& large = LargeImageSettings()) {
+    std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+    uint64_t rowBytes = static_cast<uint64_t>(width) * 3;
+    uint64_t fileSize = header.size() + rowBytes * height;
+
+    MappedFile file;
+    if (!file.create(filename, fileSize)) return false;
+
+    uint8_t* out = file.map(0, header.size());
+    if (out == NULL) {
+        std::cerr << "Error: Unable to map " << filename << std::endl;
+        return false;
+    }
+    memcpy(out, header.data(), header.size());
+
+    int apron = stripApron(settings);
+    for (int y0 = 0; y0 < height; y0 += large.stripRows) {
+        int y1 = std::min(height, y0 + large.stripRows);
+        int r0 = std::max(0, y0 - apron);
+        int r1 = std::min(height, y1 + apron);
+
+        FrameBuffer strip = renderHDR(world, orthogonal, width, height, cameraPosition, camera_up, look_at, settings, r0, r1);
+
+        out = file.map(header.size() + rowBytes * y0, static_cast<size_t>(rowBytes * (y1 - y0)));
+        if (out == NULL) {
+            std::cerr << "Error: Unable to map rows " << y0 << "-" << y1 << " of " << filename << std::endl;
+            return false;
+        }
+        resolveRows(strip, y0 - r0, y1 - r0, out, settings.toneMap);
+    }
+
+    file.close();
+    return true;
+}
+
+#endif
@@ -10,15 +10,26 @@
 #include "shader.h"
 #include "objects.h"
 #include "camera.h"
+#include "tga.h"
+#include "imagewriter.h"
+#include "framequeue.h"
+#include "animation.h"
+#include "framecache.h"
+#include "backgroundrenderer.h"
 #include <string>
 
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
-void processInput(GLFWwindow *window);
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods);
+void requestView();
 
 // settings
 const unsigned int SCR_WIDTH = 1200;
 const unsigned int SCR_HEIGHT = 1200;
+// full resolution of the traced image, while the camera moves the previews drop below this
+// as far as they need to to stay within the frame time budget
+const int RENDER_WIDTH = SCR_WIDTH;
+const double FRAME_TIME_MS = 33.0;
 
 std::string renderName = "fisheye";
 
@@ -45,74 +56,72 @@ const char *fragmentShaderSource = "#version 330 core\n"
     "   FragColor = texture(texture1, TexCoord);\n"
     "}\n\0";
 
-void saveImageToPPM(const char* filename, unsigned char* imageData, const int width, const int height) {
-    std::ofstream file(filename);
-    if (!file.is_open()) {
-        std::cerr << "Error: Unable to open file for writing: " << filename << std::endl;
-        return;
-    }
-
-    // Write PPM header
-    file << "P3\n" << width << " " << height << "\n255\n";
-
-    // Write pixel values
-    for (int i = 0; i < width * height * 3; i += 3) {
-        file << static_cast<int>(imageData[i]) << " " << static_cast<int>(imageData[i + 1]) << " " << static_cast<int>(imageData[i + 2]) << "\n";
+// Frames are encoded and written to disk here in the background, so the next frame
+// can be rendered while the last one is still being saved
+FrameWriterQueue frameWriter;
+
+// Finished frames by content, a view that was rendered before comes straight back from
+// memory or frame_cache/ (kept across runs)
+FrameCache frameCache([]() {
+    FrameCacheSettings settings;
+    settings.directory = "frame_cache";
+    settings.diskBytes = uint64_t(256) << 20;
+    return settings;
+}());
+
+// Traces on its own thread, the window keeps drawing while a frame is in the works
+BackgroundRenderer renderer(frameCache, frameWriter);
+
+// Two pixel unpack buffers: a new frame is copied into one while the driver may still be
+// moving the previous one into the texture from the other
+unsigned int pixelBuffers[2];
+int pixelBufferIndex = 0;
+int textureWidth = 0, textureHeight = 0;
+
+void uploadFrame(const CachedFrame& frame){
+    size_t bytes = frame.rgb->size();
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffers[pixelBufferIndex]);
+    // orphaning the old storage means we never wait for the GPU to be done with it
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+    void* mapped = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+    if (mapped)
+    {
+        memcpy(mapped, frame.rgb->data(), bytes);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+        // rows are tightly packed RGB, any width
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        if(frame.width == textureWidth && frame.height == textureHeight){
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, frame.width, frame.height, GL_RGB, GL_UNSIGNED_BYTE, 0);
+        } else {
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, frame.width, frame.height, 0, GL_RGB, GL_UNSIGNED_BYTE, 0);
+            textureWidth = frame.width;
+            textureHeight = frame.height;
+        }
+        glGenerateMipmap(GL_TEXTURE_2D);
     }
-
-    file.close();
-}
-
-void tga_write(std::string filename, uint32_t width, uint32_t height, uint8_t *dataBGRA, uint8_t dataChannels=4, uint8_t fileChannels=3)
-{
-    char * string_filename = filename.data();
-	FILE *fp = NULL;
-	fopen_s(&fp, string_filename, "wb");
-	if (fp == NULL) return;
-
-	uint8_t header[18] = { 0,0,2,0,0,0,0,0,0,0,0,0, (uint8_t)(width%256), (uint8_t)(width/256), (uint8_t)(height%256), (uint8_t)(height/256), (uint8_t)(fileChannels*8), 0x20 };
-	fwrite(&header, 18, 1, fp);
-
-	// Write image data row by row, but start from the bottom row and move upward
-	for (int32_t y = height - 1; y >= 0; --y)
-	{
-		for (uint32_t x = 0; x < width; ++x)
-		{
-			// Calculate the index of the pixel in the dataBGRA array
-			uint32_t pixelIndex = (y * width + x) * dataChannels;
-
-			// Loop through each channel of the pixel and write it to the file
-			for (uint8_t channel = 0; channel < fileChannels; ++channel)
-			{
-				// Adjust the channel index if reading from BGRA to RGBA
-				uint8_t adjustedChannel = (channel == 0) ? 2 : (channel == 2) ? 0 : channel;
-
-				// Write the pixel channel to the file
-				fputc(dataBGRA[pixelIndex + adjustedChannel], fp);
-			}
-		}
-	}
-
-	fclose(fp);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    pixelBufferIndex = 1 - pixelBufferIndex;
 }
 
+// asks the render thread for a new view, the finished frame is also saved to tga_files/
 void setupCameraAndTexture(std::string filename, bool orthogonal, int width, Vec3 cameraPosition, Vec3 camera_up, Vec3 look_at, Vec3 light_pos, Vec3 sphere1_centre, Vec3 sphere2_centre, Vec3 sphere3_centre){
     auto aspect_ratio = 16.0 / 9.0;
 
 	int height = static_cast<int>( width / aspect_ratio);
 	if(height < 1){ height = 1; }
-    auto image = CameraAndScene(orthogonal, width, height, cameraPosition, camera_up, look_at, light_pos, sphere1_centre, sphere2_centre, sphere3_centre);
-    unsigned char *data = &image[0];
-    if (data)
-    {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
-        GLint maxTextureSize;
-        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
-        std::string fullFilename = "tga_files/" + std::string(filename) + ".tga";
-        // std::cout << "Texture dimensions maximum supported size: " << maxTextureSize << std::endl;
-        tga_write(fullFilename.c_str(), width, height, data, 3, 3); // Assuming 3 data channels and 3 file channels for RGB
-    }
+
+    ViewRequest view;
+    view.scene = defaultScene(sphere1_centre, sphere2_centre, sphere3_centre, light_pos);
+    view.orthogonal = orthogonal;
+    view.width = width;
+    view.height = height;
+    view.cameraPosition = cameraPosition;
+    view.camera_up = camera_up;
+    view.look_at = look_at;
+    view.dynamicResolution.targetMs = FRAME_TIME_MS;
+    view.filename = "tga_files/" + std::string(filename) + ".tga";
+    renderer.request(view);
 } 
 
 int main()
@@ -139,6 +148,7 @@ int main()
     }
     glfwMakeContextCurrent(window);
     glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+    glfwSetKeyCallback(window, key_callback);
 
     // // GLEW: load all OpenGL function pointers
     glewInit();
@@ -240,17 +250,26 @@ int main()
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
+    glGenBuffers(2, pixelBuffers);
+
+    // the render thread pokes the event loop whenever it has something to show
+    renderer.onFrameReady([]() { glfwPostEmptyEvent(); });
+    requestView();
+
     // setupCameraAndTexture(renderNameOrthogonal, true, 2560, Vec3(4, -1, 5), Vec3(0, -1, 0), Vec3(0, 0, -1), Vec3(-3, -2, 1), Vec3(1, 0, -2), Vec3(0.8, -0.3, -1), Vec3(2, 0.2, -0.5));
 
     // render loop
     // -----------
     while (!glfwWindowShouldClose(window))
     {
-        // input
-        // -----
-        bool orthogonal = false;
-
-        processInput(window);
+        // new frames from the render thread, the previews first and then the finished one
+        // -------------------------------------------------------------------------------
+        ViewFrame frame;
+        if (renderer.takeFrame(frame))
+        {
+            glBindTexture(GL_TEXTURE_2D, texture);
+            uploadFrame(frame.image);
+        }
 
         // render
         // ------
@@ -265,10 +284,10 @@ int main()
         glBindVertexArray(VAO);
         glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
 
-        // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
-        // -------------------------------------------------------------------------------
+        // glfw: swap buffers and sleep until something happens (a key, the window, or a new frame)
+        // -----------------------------------------------------------------------------------------
         glfwSwapBuffers(window);
-        glfwPollEvents();
+        glfwWaitEvents();
     }
 
     // optional: de-allocate all resources once they've outlived their purpose:
@@ -276,6 +295,8 @@ int main()
     glDeleteVertexArrays(1, &VAO);
     glDeleteBuffers(1, &VBO);
     glDeleteBuffers(1, &EBO);
+    glDeleteBuffers(2, pixelBuffers);
+    renderer.onFrameReady(nullptr);
 
     // glfw: terminate, clearing all previously allocated GLFW resources.
     // ------------------------------------------------------------------
@@ -285,7 +306,8 @@ int main()
 double x = 4;
 double y = -1;
 double z = 5;
-double angle = 0.05;
+OrbitPath orbit;
+double angle = orbit.startAngle;
 double sphere_motion_radius = 3;
 
 double initx = 2 + 5 * sin(angle) + 1;
@@ -295,99 +317,144 @@ double inity = y;
 double sphere_x = 2;
 double sphere_z = -0.5;
 
+// the key light, U/J, Y/H and I/K move it like in assignment 3
+double light_x = -2;
+double light_y = -2;
+double light_z = 1;
+
 int frame = 0;
 bool orthogonal = false;
-// process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
-// ---------------------------------------------------------------------------------------------------------
-void processInput(GLFWwindow *window)
+// sends the view as the keys left it to the render thread
+// ---------------------------------------------------------
+void requestView()
 {
-    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
-        glfwSetWindowShouldClose(window, true);
-
-    
     std::string persp = "_perspective";
     std::string renderNamePerspective = renderName + persp;
     std::string orth = "_orthogonal";
     std::string renderNameOrthogonal = renderName + orth;
     std::string finalRenderName = renderNameOrthogonal;
 
+    if(!orthogonal){
+        finalRenderName = renderNamePerspective;
+    }
+
+    Vec3 look_at = (Vec3(x,y,z) + Vec3(0,0,-1));
+    look_at = Vec3(0, 0, -1);
+    setupCameraAndTexture(finalRenderName, orthogonal, RENDER_WIDTH, Vec3(x, y, z), Vec3(0, -1, 0), look_at, Vec3(light_x, light_y, light_z), Vec3(1, 0, -2), Vec3(0.8, -0.3, -1), Vec3(sphere_x+2, 0.2, sphere_z+2));
+}
+
+// process all input: GLFW calls this for every key press, and again for every auto-repeat
+// while a key is held, so holding a key keeps moving the camera
+// ---------------------------------------------------------------------------------------------------------
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+    if (action == GLFW_RELEASE)
+        return;
+
+    if (key == GLFW_KEY_ESCAPE)
+    {
+        glfwSetWindowShouldClose(window, true);
+        return;
+    }
+
     // Checking if the 'O' key is pressed
-    if (glfwGetKey(window, GLFW_KEY_O) == GLFW_PRESS)
+    if (key == GLFW_KEY_O)
     {
         orthogonal = true;
         std::cout << "Running with orthogonal set to true!" << std::endl;
     }
-
     // Checking if the 'P' key is pressed
-    if (glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS)
+    else if (key == GLFW_KEY_P)
     {
         orthogonal = false;
         std::cout << "Running with orthogonal set to false!" << std::endl;
     }
-
-    if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
+    else if (key == GLFW_KEY_W)
     {
         z = z - 1;
     }
-    if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
+    else if (key == GLFW_KEY_A)
     {
         x = x - 1;
     }
-    if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
+    else if (key == GLFW_KEY_S)
     {
         z = z + 1;
     }
-    if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
+    else if (key == GLFW_KEY_D)
     {
         x = x + 1;
     }
-    if (glfwGetKey(window, GLFW_KEY_UP) == GLFW_PRESS)
+    else if (key == GLFW_KEY_UP)
     {
         y = y - 1;
     }
-    if (glfwGetKey(window, GLFW_KEY_DOWN) == GLFW_PRESS)
+    else if (key == GLFW_KEY_DOWN)
     {
         y = y + 1;
     }
-
-    if(!orthogonal){
-        finalRenderName = renderNamePerspective;
+    // only sphere 3 moves, the render thread traces just the pixels around it again
+    else if (key == GLFW_KEY_LEFT)
+    {
+        sphere_x = sphere_x - 0.1;
+    }
+    else if (key == GLFW_KEY_RIGHT)
+    {
+        sphere_x = sphere_x + 0.1;
+    }
+    else if (key == GLFW_KEY_Z)
+    {
+        sphere_z = sphere_z - 0.1;
+    }
+    else if (key == GLFW_KEY_X)
+    {
+        sphere_z = sphere_z + 0.1;
+    }
+    // only the light moves, the render thread reshades the hits it already has
+    else if (key == GLFW_KEY_U)
+    {
+        light_x = light_x + 0.1;
+    }
+    else if (key == GLFW_KEY_J)
+    {
+        light_x = light_x - 0.1;
+    }
+    else if (key == GLFW_KEY_Y)
+    {
+        light_y = light_y + 0.1;
+    }
+    else if (key == GLFW_KEY_H)
+    {
+        light_y = light_y - 0.1;
+    }
+    else if (key == GLFW_KEY_I)
+    {
+        light_z = light_z + 0.1;
+    }
+    else if (key == GLFW_KEY_K)
+    {
+        light_z = light_z - 0.1;
     }
-
-
     // animation loop
-    if(glfwGetKey(window, GLFW_KEY_N) == GLFW_PRESS)
+    else if (key == GLFW_KEY_N)
     {
         // Incrementing the angle for the circular motion
-        angle += 0.015;
-
-        // if(angle != 0.015+0.05 && x == initx && y == inity && z == initz){
-        //     glfwSetWindowShouldClose(window, true);
-        // }
-
-        Vec3 spherebro(2, 0.2, -0.5);
+        angle += orbit.step;
 
         // Calculate the new x and z coordinates based on the angle
-        x = 2 + 5 * sin(angle);
-        z = -0.5 + 5 * cos(angle);
+        Vec3 eye = orbit.cameraAt(angle);
+        x = eye.x;
+        z = eye.z;
 
-        double sphere_x = sphere_motion_radius * cos(angle);
-        double sphere_z = sphere_motion_radius * sin(angle);
-
-        const char* frame_str = std::to_string(frame).c_str();
-
-        // std::cout << "next frame!" << std::endl;
-        // cam Vec3(5, -1, 5)
-
-        x = x + 1;
-        z = z - 0.5;
-        // y = y - 0.003;
         frame += 1;
     }
+    else
+    {
+        return;
+    }
 
-    Vec3 look_at = (Vec3(x,y,z) + Vec3(0,0,-1));
-    look_at = Vec3(0, 0, -1);
-    setupCameraAndTexture(finalRenderName, orthogonal, 200, Vec3(x, y, z), Vec3(0, -1, 0), look_at, Vec3(-3, -2, 1), Vec3(1, 0, -2), Vec3(0.8, -0.3, -1), Vec3(sphere_x+2, 0.2, sphere_z+2));
+    // whatever was being traced for the old view is cancelled
+    requestView();
 }
 
 // glfw: whenever the window size changed (by OS or user resize) this callback function executes
@@ -0,0 +1,167 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A file of fixed size that is written through memory mapped windows.
+// Only the window that is currently mapped takes up memory, so a file far bigger than RAM
+// can be filled piece by piece. Windows may start at any offset, alignment is handled here.
+// openForReading() maps an existing file read-only instead, for loading data in place.
+class MappedFile {
+public:
+    uint64_t size;
+
+    MappedFile() : size(0), readOnly(false), view(NULL), viewBase(NULL), viewLength(0) {
+#ifdef _WIN32
+        file = INVALID_HANDLE_VALUE;
+        mapping = NULL;
+#else
+        fd = -1;
+#endif
+    }
+
+    ~MappedFile() {
+        close();
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // creates (or truncates) the file and sizes it to fileSize bytes
+    bool create(const std::string& filename, uint64_t fileSize) {
+        size = fileSize;
+        readOnly = false;
+#ifdef _WIN32
+        file = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) return fail("Unable to open file for writing", filename);
+        LARGE_INTEGER end;
+        end.QuadPart = static_cast<LONGLONG>(fileSize);
+        if (!SetFilePointerEx(file, end, NULL, FILE_BEGIN) || !SetEndOfFile(file)) return fail("Unable to resize", filename);
+        mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, static_cast<DWORD>(fileSize >> 32), static_cast<DWORD>(fileSize), NULL);
+        if (mapping == NULL) return fail("Unable to map", filename);
+#else
+        fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return fail("Unable to open file for writing", filename);
+        if (ftruncate(fd, static_cast<off_t>(fileSize)) != 0) return fail("Unable to resize", filename);
+#endif
+        return true;
+    }
+
+    // opens an existing file, windows mapped afterwards can only be read
+    bool openForReading(const std::string& filename) {
+        readOnly = true;
+#ifdef _WIN32
+        file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) return fail("Unable to open file for reading", filename);
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize)) return fail("Unable to get the size of", filename);
+        size = static_cast<uint64_t>(fileSize.QuadPart);
+        // a mapping of an empty file fails, there is nothing to map anyway
+        if (size > 0) {
+            mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (mapping == NULL) return fail("Unable to map", filename);
+        }
+#else
+        fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return fail("Unable to open file for reading", filename);
+        struct stat info;
+        if (fstat(fd, &info) != 0) return fail("Unable to get the size of", filename);
+        size = static_cast<uint64_t>(info.st_size);
+#endif
+        return true;
+    }
+
+    // maps [offset, offset + length) and returns a pointer to offset, writable unless the
+    // file was opened for reading. Any previous window is unmapped first.
+    uint8_t* map(uint64_t offset, size_t length) {
+        unmap();
+        uint64_t granularity = allocationGranularity();
+        uint64_t alignedOffset = offset - offset % granularity;
+        size_t padding = static_cast<size_t>(offset - alignedOffset);
+        viewLength = length + padding;
+#ifdef _WIN32
+        viewBase = MapViewOfFile(mapping, readOnly ? FILE_MAP_READ : FILE_MAP_WRITE, static_cast<DWORD>(alignedOffset >> 32), static_cast<DWORD>(alignedOffset), viewLength);
+        if (viewBase == NULL) return NULL;
+#else
+        viewBase = mmap(NULL, viewLength, readOnly ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, static_cast<off_t>(alignedOffset));
+        if (viewBase == MAP_FAILED) {
+            viewBase = NULL;
+            return NULL;
+        }
+#endif
+        view = static_cast<uint8_t*>(viewBase) + padding;
+        return view;
+    }
+
+    // hands the current window back to the OS, its pages get written out in the background
+    void unmap() {
+        if (viewBase == NULL) return;
+#ifdef _WIN32
+        if (!readOnly) FlushViewOfFile(viewBase, 0);
+        UnmapViewOfFile(viewBase);
+#else
+        if (!readOnly) msync(viewBase, viewLength, MS_ASYNC);
+        munmap(viewBase, viewLength);
+#endif
+        viewBase = NULL;
+        view = NULL;
+        viewLength = 0;
+    }
+
+    void close() {
+        unmap();
+#ifdef _WIN32
+        if (mapping != NULL) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = NULL;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+#endif
+    }
+
+private:
+    bool readOnly;
+    uint8_t* view;
+    void* viewBase;
+    size_t viewLength;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+
+    static uint64_t allocationGranularity() {
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return info.dwAllocationGranularity;
+#else
+        return static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+#endif
+    }
+
+    bool fail(const char* what, const std::string& filename) {
+        std::cerr << "Error: " << what << ": " << filename << std::endl;
+        close();
+        return false;
+    }
+};
+
+#endif
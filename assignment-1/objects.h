@@ -1,11 +1,17 @@
 #ifndef OBJECTS_H
 #define OBJECTS_H
 
-#include "Vec3.h"
+#include "vec3.h"
 #include "shader.h"
+#include "kernels.h"
+#include "instrument.h"
 
 #include "ray.h"
+#include <algorithm>
+#include <cstdint>
 #include <iostream>
+#include <limits>
+#include <vector>
 
 
 
@@ -24,46 +30,38 @@ struct HitResult {
     Vec3 normal;
 };
 
-class Obj {
-public:
+// What a surface looks like. Primitives only carry the index of theirs, so a million spheres
+// in eight colours share eight of these
+struct Material {
     Color color;
+    bool glazed;
 
-    Obj() : color(Vec3(0,0,0)) {}
-    virtual HitResult hit(const Ray& ray) = 0;
-
-    virtual Color objColor() const = 0;
-    virtual Vec3 getCenter() const = 0;
-    virtual Vec3 getNormal(const Ray& ray, Vec3 intersectionPoint) const = 0;
-    virtual bool isGlazed() const = 0;
-
-    virtual double shade(const Ray& ray, Sunlight lightsource, Vec3 intersectionPoint, Vec3 normal, Vec3 VL) const = 0;
+    Material(const Color& color, bool glazed) : color(color), glazed(glazed) {}
 };
 
+// Every primitive has an ID, the order it was added to Objects in (buildWorld() adds spheres,
+// planes, triangles, tetrahedra). Hits, the G-buffer and the scene change tracking refer to
+// primitives by it. The records below are only the geometry and the ID, the material is
+// looked up by ID
 struct HitAnythingResult {
     bool hit_anything;
     double closest_t;
-    std::shared_ptr<Obj> closest_object;
     Vec3 normal;
+    int closest_index;  // ID of the primitive hit, -1 when nothing was hit
 };
 
 
 
-class Triangle : public Obj{
+class Triangle {
 public:
     Vec3 a, b, c;
-    Color color;
-    Shader shader;
-    bool glazed;
+    int id;
 
     // Constructor
-    Triangle(const Vec3 &a, const Vec3 &b, const Vec3 &c, const Color &color, const Shader& shader, const bool& glazed)
-        : a(a), b(b), c(c), color(color), shader(shader), glazed(glazed) {};
+    Triangle(const Vec3 &a, const Vec3 &b, const Vec3 &c, int id = -1)
+        : a(a), b(b), c(c), id(id) {};
 
-    Color objColor() const override {
-        return color;
-    }
-
-    HitResult hit(const Ray& ray) override {
+    HitResult hit(const Ray& ray) const {
 
         float epsilon = std::numeric_limits<float>::epsilon();
         // epsilon is almost 0.0;
@@ -104,45 +102,18 @@ public:
         else // This means that there is a line intersection but not a ray intersection.
             return {-1.0, Vec3(0,0,0)};
     }
-
-    double shade(const Ray& ray, Sunlight lightsource, Vec3 intersectionPoint, Vec3 normal, Vec3 VL)const override{
-        Vec3 VE = (ray.origin - intersectionPoint).unit_vector();
-        double postShadingColor = shader.calculateShading(lightsource.intensity, color, intersectionPoint, normal, VL, VE);
-        return postShadingColor;
-    }
-
-    Vec3 getCenter() const override {
-        return Vec3((a.x + a.x, a.x)/ 3, (a.y + b.y + c.y)/3, (a.z + b.z + c.z)/3);
-    };
-
-    Vec3 getNormal(const Ray& ray, Vec3 intersectionPoint) const override {
-        double Nx = a.y * b.z - a.z * b.y;
-        double Ny = a.z * b.x - a.x * b.z;
-        double Nz = a.x * b.y - a.y * b.x;
-        return Vec3(Nx, Ny, Nz);
-    }
-
-    bool isGlazed() const override {
-        return glazed;
-    };
 };
 
-class Tetrahedron : public Obj {
+class Tetrahedron {
 public:
     Vec3 a, b, c, d;
-    Color color;
-    Shader shader;
-    bool glazed;
+    int id;
 
     // Constructor
-    Tetrahedron(const Vec3 &a, const Vec3 &b, const Vec3 &c, const Vec3 &d, const Color &color, const Shader& shader, const bool& glazed)
-        : a(a), b(b), c(c), d(d), color(color), shader(shader), glazed(glazed) {};
-
-    Color objColor() const override {
-        return color;
-    }
+    Tetrahedron(const Vec3 &a, const Vec3 &b, const Vec3 &c, const Vec3 &d, int id = -1)
+        : a(a), b(b), c(c), d(d), id(id) {};
 
-    HitResult hit(const Ray& ray) override {
+    HitResult hit(const Ray& ray) const {
         double t1 = hit_triangle(ray, a, b, c);
         if(t1 > 0.01){
             double Nx = a.y * b.z - a.z * b.y;
@@ -178,7 +149,7 @@ public:
         return {-1.0, Vec3(0,0,0)};
     }
 
-    double hit_triangle(const Ray& ray, const Vec3& a, const Vec3& b, const Vec3& c) {
+    double hit_triangle(const Ray& ray, const Vec3& a, const Vec3& b, const Vec3& c) const {
 
         float epsilon = std::numeric_limits<float>::epsilon();
         // epsilon is almost 0.0;
@@ -218,60 +189,23 @@ public:
 
         return -1.0;
     }
-
-    double shade(const Ray& ray, Sunlight lightsource, Vec3 intersectionPoint, Vec3 normal, Vec3 VL)const override{
-        Vec3 VE = (ray.origin - intersectionPoint).unit_vector();
-        double postShadingColor = shader.calculateShading(lightsource.intensity, color, intersectionPoint, normal, VL, VE);
-        return postShadingColor;
-        // return 1;
-    }
-
-    Vec3 getCenter() const override {
-        return Vec3((a.x + b.x + c.x + d.x)/ 4, (a.y + b.y + c.y + d.y)/4, (a.z + b.z + c.z + d.z)/4);
-    };
-
-    // we're not using this function anyway cuz we're calculating the normal always in the hit function itself
-    Vec3 getNormal(const Ray& ray, Vec3 intersectionPoint) const override {
-        return Vec3(0, 0, 0);
-    // // Determine which face the intersection point belongs to
-    // if (isPointInTriangle(intersectionPoint, a, b, c)) {
-    //     return (b - a).cross(c - a).unit_vector();;
-    // } else if (isPointInTriangle(intersectionPoint, a, c, d)) {
-    //     return (c - a).cross(d - a).unit_vector();;
-    // } else if (isPointInTriangle(intersectionPoint, a, d, b)) {
-    //     return (d - a).cross(b - a).unit_vector();;
-    // } else {
-    //     return (b - a).cross(d - b).unit_vector();;
-    // }
-    // }
-    
-    }
-
-    bool isGlazed() const override {
-        return glazed;
-    }
 };
 
-class Sphere : public Obj {
+// Objects keeps spheres as SphereArrays (kernels.h), this is one on its own
+class Sphere {
 public:
     Vec3 center;
     double radius;
-    Color color;
-    Shader shader;
-    bool glazed;
+    int id;
 
     // Constructor with arguments
-    Sphere(const Vec3& center, double radius, const Color& color, const Shader& shader, const bool& glazed)
-        : center(center), radius(radius), color(color), shader(shader), glazed(glazed) {}
-
-    HitResult hit(const Ray& ray) override {
-        // quadratic equation
-        double a = ray.direction.dot(ray.direction);
-        double b = (ray.direction * 2).dot(ray.origin - center);
-        double c = (ray.origin - center).dot((ray.origin - center)) - (radius * radius);
-        double discriminant = (b * b) - (4 * a * c);
+    Sphere(const Vec3& center, double radius, int id = -1)
+        : center(center), radius(radius), id(id) {}
 
-        double t1 = (-b - (sqrt(discriminant))) / (2 * a);
+    HitResult hit(const Ray& ray) const {
+        // quadratic equation, see kernels.h
+        double discriminant;
+        double t1 = sphereNearRoot(ray.origin, ray.direction, center, radius, discriminant);
 
         // we don't care about negative roots because they are not visible through the viewing plane
         if(discriminant >= 0){
@@ -281,46 +215,19 @@ public:
         }
         return {-1.0, Vec3(0,0,0)};
     }
-
-    Color objColor() const override {
-        return color;
-    }
-
-    double shade(const Ray& ray, Sunlight lightsource, Vec3 intersectionPoint, Vec3 normal, Vec3 VL)const override{
-        Vec3 VE = (ray.origin - intersectionPoint).unit_vector();
-        // Shader shader;
-        double postShadingColor = shader.calculateShading(lightsource.intensity, color, intersectionPoint, normal, VL, VE);
-        // std::cout << postShadingColor << std::endl;
-        return postShadingColor;
-    }
-
-    Vec3 getCenter() const override {
-        return center;
-    };
-
-    Vec3 getNormal(const Ray& ray, Vec3 intersectionPoint) const override {
-        return (intersectionPoint - center).unit_vector();
-    }
-
-    bool isGlazed() const override {
-        return glazed;
-    };
-
 };
 
-class Plane : public Obj {
+class Plane {
 public:
     Vec3 normal;
     double height;
-    Color color;
-    Shader shader;
-    bool glazed;
+    int id;
 
     // Constructor with arguments
-    Plane(const Vec3& normal, double height, const Color& color, const Shader& shader,  const bool& glazed)
-        : normal(normal), height(height), color(color), shader(shader), glazed(glazed) {}
+    Plane(const Vec3& normal, double height, int id = -1)
+        : normal(normal), height(height), id(id) {}
 
-    HitResult hit(const Ray& ray) override  {
+    HitResult hit(const Ray& ray) const {
         double t = (height - ray.origin.y) / ray.direction.y;
         if(t>0.01){
             return {t, normal};
@@ -328,142 +235,233 @@ public:
 
         return {-1.0, normal};
     }
-
-    Color objColor() const override {
-        return color;
-    }
-
-    double shade(const Ray& ray, Sunlight lightsource, Vec3 intersectionPoint, Vec3 normal, Vec3 VL)const override{
-            Vec3 VE = (ray.origin - intersectionPoint).unit_vector();
-            // Shader shader;
-            double postShadingColor = shader.calculateShading(lightsource.intensity, color, intersectionPoint, normal, VL, VE);
-            // std::cout << postShadingColor << std::endl;
-            return postShadingColor;
-        }
-
-    // double shade(const Ray& ray, Sunlight lightsource, Vec3 intersectionPoint, Vec3 normal, Vec3 VL)const override{
-    //     double shadingCoefficient = shader.ambientShading(lightsource.intensity, color/10);
-    //     return shadingCoefficient;
-    // }
-
-    Vec3 getCenter() const override {
-        return Vec3(0,height,0);
-    };
-
-    Vec3 getNormal(const Ray& ray, Vec3 intersectionPoint) const override {
-        return normal;
-    }
-
-    bool isGlazed() const override {
-        return glazed;
-    };
-   
 };
 
+// the records stay this small, they're what the scan walks through
+static_assert(sizeof(Plane) == 40 && sizeof(Triangle) == 80 && sizeof(Tetrahedron) == 104, "primitive records grew");
+
 
 
 class Objects {
 
 public:
-    std::vector<std::shared_ptr<Obj>> objects;
     Sunlight lightsource;
     std::vector < Sunlight> lights;
+    std::vector<Material> materials;
+    // the material of every primitive, by ID
+    std::vector<uint32_t> primitiveMaterials;
+
+    // the spheres as arrays, the sphere kernel (kernels.h) tests a ray against a chunk of them
+    // at once. The other kinds are arrays of their records, each tested one by one
+    SphereArrays spheres;
+    std::vector<Plane> planes;
+    std::vector<Triangle> triangles;
+    std::vector<Tetrahedron> tetrahedra;
 
     Objects() : lightsource(Sunlight(Vec3(0, 0, 0),0.0)) {}
 
-    void addObject(const std::shared_ptr<Obj>& obj) {
-        objects.push_back(obj);
+    void clear() {
+        lights.clear();
+        materials.clear();
+        primitiveMaterials.clear();
+        spheres = SphereArrays();
+        planes.clear();
+        triangles.clear();
+        tetrahedra.clear();
+    }
+
+    size_t primitiveCount() const {
+        return primitiveMaterials.size();
+    }
+
+    uint32_t addMaterial(const Material& material) {
+        materials.push_back(material);
+        return static_cast<uint32_t>(materials.size() - 1);
+    }
+
+    // each returns the primitive's ID
+    int addSphere(const Vec3& centre, double radius, uint32_t material) {
+        int id = newPrimitive(material);
+        spheres.add(centre, radius, id);
+        return id;
+    }
+    int addPlane(const Vec3& normal, double height, uint32_t material) {
+        int id = newPrimitive(material);
+        planes.push_back(Plane(normal, height, id));
+        return id;
+    }
+    int addTriangle(const Vec3& a, const Vec3& b, const Vec3& c, uint32_t material) {
+        int id = newPrimitive(material);
+        triangles.push_back(Triangle(a, b, c, id));
+        return id;
+    }
+    int addTetrahedron(const Vec3& a, const Vec3& b, const Vec3& c, const Vec3& d, uint32_t material) {
+        int id = newPrimitive(material);
+        tetrahedra.push_back(Tetrahedron(a, b, c, d, id));
+        return id;
     }
     void addLight(const Sunlight& light) {
         lights.push_back(light);
     }
 
+    const Material& material(int id) const {
+        return materials[primitiveMaterials[id]];
+    }
+
     bool hit_anything_for_shadows(const Ray& ray) const {
-        bool hit_anything = false;
-
-        for (const auto& object : objects) {
-            HitResult hitResult = object->hit(ray);
-            if (hitResult.t > 0.001){
-                // std::cout << t << std::endl;
-                hit_anything = true;
-                break;
+        double roots[SphereArrays::chunk];
+        for (size_t first = 0; first < spheres.size(); first += SphereArrays::chunk) {
+            int n = static_cast<int>(std::min<size_t>(SphereArrays::chunk, spheres.size() - first));
+            sphereRoots(ray.origin, ray.direction, spheres, first, n, roots);
+            RT_COUNT(NodesVisited, 1);
+            RT_COUNT(PrimitiveTests, n);
+            for (int k = 0; k < n; k++) {
+                if (roots[k] > 0.001) return true;
             }
         }
-        return hit_anything;
+
+        return anyHit(planes, ray) || anyHit(triangles, ray) || anyHit(tetrahedra, ray);
     }
 
-    Color applyShading(const Ray& ray, double t, std::shared_ptr<Obj> closest_object, Vec3 normal, bool is_reflected_ray) const {
-        Color objColor = closest_object->objColor();
-        Vec3 intersectionPoint = ray.pointAt(t);
+    Color applyShading(const Ray& ray, double t, int primitive, Vec3 normal, bool is_reflected_ray) const {
         Color sum = Color(0, 0, 0);
 
-        if(closest_object->isGlazed() && is_reflected_ray == false) {
-            sum = sum + applyGlaze(ray, t, closest_object, normal);
+        if(material(primitive).glazed && is_reflected_ray == false) {
+            sum = sum + applyGlaze(ray, t, primitive, normal);
         }
 
+        return addDirectLight(sum, ray, t, primitive, normal);
+    }
+
+    // the light loop with its shadow rays, added onto sum. This is the only part of the
+    // shading that depends on where the lights are
+    Color addDirectLight(Color sum, const Ray& ray, double t, int primitive, Vec3 normal) const {
+        Color objColor = material(primitive).color;
+        Vec3 intersectionPoint = ray.pointAt(t);
+        Vec3 VE = (ray.origin - intersectionPoint).unit_vector();
+
         for (const auto& light : lights){
             Vec3 VL = (light.position - intersectionPoint).unit_vector();
 
-            Color shadedColor = (objColor * closest_object->shade(ray, light, intersectionPoint, normal, VL)).clamp(0,255);
+            // everything stays linear and unclamped here, the tone-mapping resolve clamps once per pixel
+            Color shadedColor = objColor * Shader::calculateShading(light.intensity, objColor, intersectionPoint, normal, VL, VE);
+            RT_COUNT(ShadingCalls, 1);
 
             // shadows
             Ray reverse_lightray(intersectionPoint, VL);
+            RT_COUNT(ShadowRays, 1);
             if(hit_anything_for_shadows(reverse_lightray)){
                 shadedColor = shadedColor * 0.4;
             }
-            sum = (sum + shadedColor).clamp(0,255);
+            sum = sum + shadedColor;
         }
         if(objColor.x == 132){
             sum.print();
         }        
 
-        return sum.clamp(0,255);
+        return sum;
     }
 
     HitAnythingResult hit_anything(const Ray& ray, double t_max) const {
-        bool hit_anything = false;
         Vec3 surface_normal(0, 0, 0);
 
         double closest_t = t_max;
-        std::shared_ptr<Obj> closest_object;
-
-        for (const auto& object : objects) {
-            HitResult hitResult = object->hit(ray);
-            if (hitResult.t > 0.01 && hitResult.t < closest_t){
-                closest_t = hitResult.t;
-                closest_object = object;
-                hit_anything = true;
-                surface_normal = hitResult.normal;
+        int closest_index = -1;
+        int closest_sphere = -1;
+
+        // on equal t the primitive with the lower ID wins, whatever order the kinds are
+        // tested in
+        auto closer = [&](double t, int i) {
+            return t > 0.01 && (t < closest_t || (t == closest_t && i < closest_index));
+        };
+
+        double roots[SphereArrays::chunk];
+        for (size_t first = 0; first < spheres.size(); first += SphereArrays::chunk) {
+            int n = static_cast<int>(std::min<size_t>(SphereArrays::chunk, spheres.size() - first));
+            sphereRoots(ray.origin, ray.direction, spheres, first, n, roots);
+            RT_COUNT(NodesVisited, 1);
+            RT_COUNT(PrimitiveTests, n);
+            for (int k = 0; k < n; k++) {
+                int i = spheres.object[first + k];
+                if (closer(roots[k], i)){
+                    closest_t = roots[k];
+                    closest_index = i;
+                    closest_sphere = static_cast<int>(first) + k;
+                }
+            }
+        }
+
+        auto scan = [&](const auto& records) {
+            RT_COUNT(PrimitiveTests, records.size());
+            for (const auto& record : records) {
+                HitResult hitResult = record.hit(ray);
+                if (closer(hitResult.t, record.id)){
+                    closest_t = hitResult.t;
+                    closest_index = record.id;
+                    closest_sphere = -1;
+                    surface_normal = hitResult.normal;
+                }
             }
+        };
+        scan(planes);
+        scan(triangles);
+        scan(tetrahedra);
+
+        if (closest_index < 0) {
+            return {false, closest_t, surface_normal, -1};
         }
-        return {hit_anything, closest_t, closest_object, surface_normal};
+        if (closest_sphere >= 0) {
+            // what Sphere::hit would have given
+            Vec3 centre(spheres.cx[closest_sphere], spheres.cy[closest_sphere], spheres.cz[closest_sphere]);
+            surface_normal = (ray.origin + (ray.direction*closest_t) - centre).unit_vector();
+        }
+        return {true, closest_t, surface_normal, closest_index};
     }
 
-    Color applyGlaze( const Ray& ray, double t, std::shared_ptr<Obj> closest_object, Vec3 normal) const {
+    Ray reflectedRay(const Ray& ray, double t, const Vec3& normal) const {
         Vec3 intersectionPoint = ray.pointAt(t);
         Vec3 reflected_dir = ray.direction - normal * (ray.direction.dot(normal)) * 2;
+        return Ray(intersectionPoint, reflected_dir);
+    }
 
-        Ray reflected_ray(intersectionPoint, reflected_dir);
+    Color applyGlaze( const Ray& ray, double t, int primitive, Vec3 normal) const {
+        Ray reflected_ray = reflectedRay(ray, t, normal);
+        RT_COUNT(GlazeRays, 1);
 
-        Color returnColor = closest_object->objColor();
+        Color returnColor = material(primitive).color;
         // returnColor = Color(0, 0, 0);
 
         if(hit_anything_for_shadows(reflected_ray)){
-            Color glazeColor = (castRay(reflected_ray, *this, lightsource.position, true) * 0.4).clamp(0, 255);
+            Color glazeColor = castRay(reflected_ray, *this, lightsource.position, true) * 0.4;
             return glazeColor;
         }
         return Color(0, 0, 0);
     }
 
-    Color castRay(const Ray& ray, Objects world, Vec3 lightsource_pos, bool is_reflected_ray) const {
+    Color castRay(const Ray& ray, const Objects& world, Vec3 lightsource_pos, bool is_reflected_ray) const {
         // Color t = world.hit_anything(ray, 1000);
         auto hitResult = world.hit_anything(ray, 1000);
         
         if(hitResult.hit_anything){
-            return world.applyShading(ray, hitResult.closest_t, hitResult.closest_object, hitResult.normal, is_reflected_ray);
+            return world.applyShading(ray, hitResult.closest_t, hitResult.closest_index, hitResult.normal, is_reflected_ray);
         }
         return Color(0, 0, 0);  
     }
+
+private:
+    int newPrimitive(uint32_t material) {
+        primitiveMaterials.push_back(material);
+        return static_cast<int>(primitiveMaterials.size() - 1);
+    }
+
+    template <typename Records>
+    static bool anyHit(const Records& records, const Ray& ray) {
+        for (const auto& record : records) {
+            RT_COUNT(PrimitiveTests, 1);
+            if (record.hit(ray).t > 0.001) return true;
+        }
+        return false;
+    }
 };
 
 #endif
\ No newline at end of file
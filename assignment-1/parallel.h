@@ -0,0 +1,54 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Cap on the workers parallelFor may use when called from this thread, 0 means all cores.
+// The batch renderer sets it on each frame thread when it renders several frames at once.
+inline int& workerLimit() {
+    thread_local int limit = 0;
+    return limit;
+}
+
+// Number of worker threads we use for the per-frame passes
+inline int workerCount() {
+    unsigned int n = std::thread::hardware_concurrency();
+    int count = n == 0 ? 1 : static_cast<int>(n);
+    if (workerLimit() > 0) count = std::min(count, workerLimit());
+    return count;
+}
+
+// Runs func(i) for every i in [begin, end) across all cores (or at most maxThreads of them).
+// Work is handed out in small chunks from a shared counter so slow rows don't hold up the rest.
+template <typename Func>
+void parallelFor(int begin, int end, Func func, int chunk = 4, int maxThreads = 0) {
+    int count = end - begin;
+    if (count <= 0) return;
+
+    int threads = std::min(workerCount(), (count + chunk - 1) / chunk);
+    if (maxThreads > 0) threads = std::min(threads, maxThreads);
+    if (threads <= 1) {
+        for (int i = begin; i < end; i++) func(i);
+        return;
+    }
+
+    std::atomic<int> next(begin);
+    auto worker = [&]() {
+        while (true) {
+            int start = next.fetch_add(chunk);
+            if (start >= end) break;
+            int stop = std::min(start + chunk, end);
+            for (int i = start; i < stop; i++) func(i);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; t++) pool.emplace_back(worker);
+    worker();
+    for (auto& thread : pool) thread.join();
+}
+
+#endif
@@ -0,0 +1,253 @@
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// The CPU's own counters (cycles, instructions, cache and branch misses) read through Linux's
+// perf_event_open, for the calling thread and every thread it starts afterwards. Each counter is
+// opened on its own, so whatever the machine has is used: VMs often have no hardware counters
+// at all, and perf_event_paranoid above 2 forbids them. Missing ones read as not valid. Other
+// systems have none.
+
+enum class PerfEvent {
+    Cycles,
+    Instructions,
+    CacheMisses,    // last level cache
+    BranchMisses,
+    TaskClock,      // cpu ns, a software counter, there even when the hardware ones aren't
+    Count
+};
+
+inline const char* perfEventName(PerfEvent event) {
+    switch (event) {
+    case PerfEvent::Cycles: return "cycles";
+    case PerfEvent::Instructions: return "instructions";
+    case PerfEvent::CacheMisses: return "cache misses";
+    case PerfEvent::BranchMisses: return "branch misses";
+    case PerfEvent::TaskClock: return "cpu ns";
+    default: return "?";
+    }
+}
+
+const int perfEventCount = static_cast<int>(PerfEvent::Count);
+
+struct PerfReading {
+    uint64_t values[perfEventCount] = {};
+    bool valid[perfEventCount] = {};
+
+    uint64_t operator[](PerfEvent event) const {
+        return values[static_cast<int>(event)];
+    }
+    bool has(PerfEvent event) const {
+        return valid[static_cast<int>(event)];
+    }
+
+    PerfReading operator-(const PerfReading& before) const {
+        PerfReading d;
+        for (int i = 0; i < perfEventCount; i++) {
+            d.valid[i] = valid[i] && before.valid[i];
+            d.values[i] = d.valid[i] ? values[i] - before.values[i] : 0;
+        }
+        return d;
+    }
+
+    PerfReading& operator+=(const PerfReading& other) {
+        for (int i = 0; i < perfEventCount; i++) {
+            valid[i] = valid[i] || other.valid[i];
+            values[i] += other.values[i];
+        }
+        return *this;
+    }
+
+    // instructions per cycle, 0 without both counters
+    double ipc() const {
+        uint64_t cycles = (*this)[PerfEvent::Cycles];
+        return has(PerfEvent::Cycles) && has(PerfEvent::Instructions) && cycles > 0 ? static_cast<double>((*this)[PerfEvent::Instructions]) / cycles : 0.0;
+    }
+};
+
+class PerfCounters {
+public:
+    int fds[perfEventCount];
+
+    PerfCounters() {
+        for (int& fd : fds) fd = -1;
+    }
+    ~PerfCounters() {
+        close();
+    }
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    // Starts counting, user space only. Threads this one starts from now on count too, their
+    // counts show up here once they have finished. Returns whether anything could be opened
+    bool open() {
+        close();
+#if defined(__linux__)
+        static const uint32_t types[perfEventCount] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_SOFTWARE};
+        static const uint64_t configs[perfEventCount] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_SW_TASK_CLOCK};
+        for (int i = 0; i < perfEventCount; i++) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = types[i];
+            attr.config = configs[i];
+            attr.inherit = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            // more counters than the PMU has get multiplexed, the times let read() scale them back up
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds[i] = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+        }
+#endif
+        return any();
+    }
+
+    void close() {
+#if defined(__linux__)
+        for (int& fd : fds) {
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+        }
+#endif
+    }
+
+    bool any() const {
+        for (int fd : fds) {
+            if (fd >= 0) return true;
+        }
+        return false;
+    }
+
+    bool hardware() const {
+        return fds[static_cast<int>(PerfEvent::Cycles)] >= 0;
+    }
+
+    PerfReading read() const {
+        PerfReading r;
+#if defined(__linux__)
+        for (int i = 0; i < perfEventCount; i++) {
+            uint64_t data[3];   // value, time enabled, time running
+            if (fds[i] < 0 || ::read(fds[i], data, sizeof(data)) != static_cast<ssize_t>(sizeof(data))) continue;
+            r.valid[i] = true;
+            r.values[i] = data[2] > 0 && data[2] < data[1] ? static_cast<uint64_t>(static_cast<double>(data[0]) * data[1] / data[2]) : data[0];
+        }
+#endif
+        return r;
+    }
+};
+
+// Where the batch renderer's counts went. Phases don't overlap: entering one pauses the one
+// it's nested in, so the totals add up to the whole run. The renderer shades every hit as it
+// traces it (castRay), so shading is part of Trace; Resolve is the work on the finished image,
+// denoising and tone mapping.
+enum class Phase {
+    Other,
+    Load,
+    Build,
+    Trace,
+    Resolve,
+    Write,
+    Count
+};
+
+inline const char* phaseName(Phase phase) {
+    switch (phase) {
+    case Phase::Load: return "load";
+    case Phase::Build: return "build";
+    case Phase::Trace: return "trace";
+    case Phase::Resolve: return "resolve";
+    case Phase::Write: return "write";
+    default: return "other";
+    }
+}
+
+// One thread moves between phases at a time, the threads it starts count to its phase
+class PerfPhases {
+public:
+    PerfCounters counters;
+    PerfReading totals[static_cast<int>(Phase::Count)];
+
+    bool open() {
+        bool ok = counters.open();
+        last = counters.read();
+        current = Phase::Other;
+        return ok;
+    }
+
+    // adds what was counted since the last switch to the current phase and moves to phase,
+    // returns the phase it was in
+    Phase enter(Phase phase) {
+        std::lock_guard<std::mutex> lock(mutex);
+        PerfReading now = counters.read();
+        totals[static_cast<int>(current)] += now - last;
+        last = now;
+        Phase previous = current;
+        current = phase;
+        return previous;
+    }
+
+private:
+    std::mutex mutex;
+    PerfReading last;
+    Phase current = Phase::Other;
+};
+
+// Counts the rest of the scope to a phase, nothing without phases
+class PhaseScope {
+public:
+    PerfPhases* phases;
+    Phase previous = Phase::Other;
+
+    PhaseScope(PerfPhases* phases, Phase phase) : phases(phases) {
+        if (phases != nullptr) previous = phases->enter(phase);
+    }
+    ~PhaseScope() {
+        if (phases != nullptr) phases->enter(previous);
+    }
+    PhaseScope(const PhaseScope&) = delete;
+    PhaseScope& operator=(const PhaseScope&) = delete;
+};
+
+// A table of the phases, and the whole run per ray
+inline void printPerfSummary(const PerfPhases& phases, uint64_t rays) {
+    auto column = [](const PerfReading& r, PerfEvent event) {
+        if (r.has(event)) printf(" %14llu", static_cast<unsigned long long>(r[event]));
+        else printf(" %14s", "n/a");
+    };
+    printf("%-8s %14s %14s %14s %14s %14s   IPC\n", "phase", "cycles", "instructions", "cache misses", "branch misses", "cpu ns");
+    PerfReading total;
+    for (int p = 0; p < static_cast<int>(Phase::Count); p++) {
+        const PerfReading& r = phases.totals[p];
+        total += r;
+        printf("%-8s", phaseName(static_cast<Phase>(p)));
+        for (int e = 0; e < perfEventCount; e++) column(r, static_cast<PerfEvent>(e));
+        if (r.has(PerfEvent::Cycles) && r.has(PerfEvent::Instructions)) printf("   %.2f\n", r.ipc());
+        else printf("   n/a\n");
+    }
+    if (rays > 0) {
+        printf("per primary ray:");
+        const char* separator = " ";
+        for (int e = 0; e < perfEventCount; e++) {
+            if (!total.valid[e]) continue;
+            printf("%s%.1f %s", separator, static_cast<double>(total.values[e]) / rays, perfEventName(static_cast<PerfEvent>(e)));
+            separator = ", ";
+        }
+        if (total.has(PerfEvent::Cycles) && total.has(PerfEvent::Instructions)) printf(", IPC %.2f", total.ipc());
+        printf("\n");
+    }
+    if (!phases.counters.hardware()) {
+        printf("no hardware counters here (a VM without them, or kernel.perf_event_paranoid too high)\n");
+    }
+}
+
+#endif
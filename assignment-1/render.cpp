@@ -0,0 +1,414 @@
+// Headless batch renderer: renders frames of the orbit animation straight to disk,
+// no window and no GL context needed, so it runs on render nodes without a display.
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include "vec3.h"
+#include "camera.h"
+#include "largeimage.h"
+#include "framequeue.h"
+#include "animation.h"
+#include "scenefile.h"
+#include "framecache.h"
+#include "scenechanges.h"
+#include "parallel.h"
+#include "cpudispatch.h"
+#include "instrument.h"
+#include "perfcounters.h"
+#include "imagewriter.h"
+#include "arena.h"
+
+struct BatchOptions {
+    std::string scene = "default";
+    std::string path = "orbit";
+    std::string out = "frames/orbit_%04d.tga";
+    std::string compiledScene;
+    std::string cache;
+    std::string trace;
+    int width = 1280;
+    int height = 0;
+    int firstFrame = 0;
+    int lastFrame = 0;
+    int jobs = 0;
+    bool orthogonal = false;
+    bool large = false;
+    bool stats = false;
+    bool counters = false;
+    bool perf = false;
+    bool checkAllocations = false;
+    RenderSettings settings;
+    TemporalSettings temporal;
+    LargeImageSettings largeSettings;
+};
+
+void printUsage() {
+    std::cout <<
+        "usage: render [options]\n"
+        "  --scene FILE          scene to render, a .scene text file or a compiled scene\n"
+        "                        (default: the built-in scene)\n"
+        "  --compile-scene OUT   write the scene out in the compiled binary form and exit\n"
+        "  --path orbit|static   camera path, orbit is the 'N' key animation, static is the\n"
+        "                        scene's own camera (default orbit)\n"
+        "  --width N             image width (default 1280)\n"
+        "  --height N            image height (default width * 9 / 16)\n"
+        "  --frames A:B          inclusive frame range (default 0:0)\n"
+        "  --out PATTERN         output file, printf style frame number (one %d, %04d and the\n"
+        "                        like, %% for a %), the extension\n"
+        "                        picks the format: .tga .ppm .qoi (default frames/orbit_%04d.tga)\n"
+        "  --ortho               orthographic instead of perspective\n"
+        "  --lens pinhole|fisheye|panorama|thinlens\n"
+        "                        lens of the perspective camera (default pinhole)\n"
+        "  --fov F               fisheye angle across the image diagonal, degrees (default 180)\n"
+        "  --aperture F          thin lens radius (default 0.1), the blur needs --samples > 1\n"
+        "  --focus F             thin lens distance in focus (default: the look at point)\n"
+        "  --samples N           max adaptive samples per pixel, 1 = one ray per pixel\n"
+        "  --denoise N           a-trous denoiser passes (default 0 = off)\n"
+        "  --tonemap clamp|reinhard|aces\n"
+        "  --exposure F\n"
+        "  --gamma F\n"
+        "  --jobs N              frames rendered at the same time (default: picked from the frame size)\n"
+        "  --cache DIR           keep finished frames in DIR and reuse them when the same frame\n"
+        "                        (scene, camera, size and settings) is asked for again\n"
+        "  --reproject           reuse the colours of the last frame where the camera still sees\n"
+        "                        the same surface, frames are rendered one after the other\n"
+        "  --refresh F           share of the reused pixels shaded anyway, every frame (default 0.1)\n"
+        "  --ray-batch N         primary rays made at a time (default 64, at most 64)\n"
+        "  --no-ray-tables       work every primary ray direction out instead of looking it up\n"
+        "  --stats               print how long making the primary rays took\n"
+        "  --counters            print rays, primitive tests, shading calls and row times after\n"
+        "                        every frame (after the run with several frames at once),\n"
+        "                        needs a build with -DRT_INSTRUMENT\n"
+        "  --perf                read the CPU's counters (cycles, instructions, cache and branch\n"
+        "                        misses) for loading, building, tracing, resolving and writing,\n"
+        "                        Linux only. Frames are rendered and written one at a time\n"
+        "  --check-allocations   print the heap allocations of every frame and fail if a frame\n"
+        "                        after the first allocates while tracing rows, frames are\n"
+        "                        rendered one at a time. Needs a build with -DRT_COUNT_ALLOCATIONS\n"
+        "  --heatmap nodes|tests|shadows|ns\n"
+        "                        write what each pixel cost as false colour instead of the\n"
+        "                        image (black to white), counts need a build with -DRT_INSTRUMENT\n"
+        "  --heatmap-max F       the cost shown as white (default: the frame's 99th percentile)\n"
+        "  --trace FILE          write a Chrome trace (chrome://tracing) of the passes and rows\n"
+        "                        to FILE, needs a build with -DRT_INSTRUMENT\n"
+        "  --isa scalar|sse4.2|avx2|avx512\n"
+        "                        run the kernels at this instruction set level, at most what the\n"
+        "                        CPU has (default: the best it has, or RT_ISA from the environment)\n"
+        "  --large               render in strips straight into a memory mapped .ppm, for huge images\n"
+        "  --strip N             rows per strip in --large mode (default 64)\n";
+}
+
+// --out goes to snprintf as the format, so it may hold one int conversion (%d or %i, with
+// flags and a width) and %%, anything else would read arguments that aren't there
+bool validFramePattern(const std::string& pattern) {
+    int conversions = 0;
+    for (size_t i = 0; i < pattern.size(); i++) {
+        if (pattern[i] != '%') continue;
+        if (++i < pattern.size() && pattern[i] == '%') continue;
+        while (i < pattern.size() && strchr("-+ 0#", pattern[i]) != nullptr) i++;
+        while (i < pattern.size() && isdigit(static_cast<unsigned char>(pattern[i]))) i++;
+        if (i == pattern.size() || (pattern[i] != 'd' && pattern[i] != 'i')) return false;
+        conversions++;
+    }
+    return conversions <= 1;
+}
+
+bool parseArguments(int argc, char** argv, BatchOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                std::cerr << "Error: " << arg << " needs a value" << std::endl;
+                exit(1);
+            }
+            return argv[++i];
+        };
+
+        if (arg == "--help" || arg == "-h") { printUsage(); exit(0); }
+        else if (arg == "--scene") options.scene = value();
+        else if (arg == "--compile-scene") options.compiledScene = value();
+        else if (arg == "--path") options.path = value();
+        else if (arg == "--width") options.width = atoi(value().c_str());
+        else if (arg == "--height") options.height = atoi(value().c_str());
+        else if (arg == "--frames") {
+            std::string range = value();
+            size_t colon = range.find(':');
+            options.firstFrame = atoi(range.substr(0, colon).c_str());
+            options.lastFrame = colon == std::string::npos ? options.firstFrame : atoi(range.substr(colon + 1).c_str());
+        }
+        else if (arg == "--out") options.out = value();
+        else if (arg == "--ortho") options.orthogonal = true;
+        else if (arg == "--lens") {
+            std::string lens = value();
+            if (lens == "pinhole") options.settings.lens.lens = Lens::Pinhole;
+            else if (lens == "fisheye") options.settings.lens.lens = Lens::Fisheye;
+            else if (lens == "panorama") options.settings.lens.lens = Lens::Panorama;
+            else if (lens == "thinlens") options.settings.lens.lens = Lens::ThinLens;
+            else { std::cerr << "Error: unknown lens " << lens << std::endl; return false; }
+        }
+        else if (arg == "--fov") options.settings.lens.fov = atof(value().c_str());
+        else if (arg == "--aperture") options.settings.lens.aperture = atof(value().c_str());
+        else if (arg == "--focus") options.settings.lens.focusDistance = atof(value().c_str());
+        else if (arg == "--ray-batch") options.settings.rays.batch = atoi(value().c_str());
+        else if (arg == "--no-ray-tables") options.settings.rays.tables = false;
+        else if (arg == "--stats") options.stats = true;
+        else if (arg == "--counters") options.counters = true;
+        else if (arg == "--perf") options.perf = true;
+        else if (arg == "--check-allocations") options.checkAllocations = true;
+        else if (arg == "--trace") options.trace = value();
+        else if (arg == "--heatmap") {
+            std::string metric = value();
+            if (metric == "nodes") options.settings.heatmap.metric = HeatmapMetric::Nodes;
+            else if (metric == "tests") options.settings.heatmap.metric = HeatmapMetric::Tests;
+            else if (metric == "shadows") options.settings.heatmap.metric = HeatmapMetric::ShadowRays;
+            else if (metric == "ns") options.settings.heatmap.metric = HeatmapMetric::Nanoseconds;
+            else { std::cerr << "Error: unknown heatmap " << metric << std::endl; return false; }
+        }
+        else if (arg == "--heatmap-max") options.settings.heatmap.maxCost = atof(value().c_str());
+        else if (arg == "--isa") {
+            std::string name = value();
+            IsaLevel level;
+            if (!parseIsa(name, level)) { std::cerr << "Error: unknown instruction set level " << name << std::endl; return false; }
+            if (setIsa(level) != level) std::cerr << "Warning: this CPU doesn't do " << name << ", using " << isaName(activeIsa()) << std::endl;
+        }
+        else if (arg == "--samples") options.settings.sampling.maxSamples = atoi(value().c_str());
+        else if (arg == "--denoise") options.settings.denoise.iterations = atoi(value().c_str());
+        else if (arg == "--tonemap") {
+            std::string op = value();
+            if (op == "clamp") options.settings.toneMap.op = ToneMapOperator::Clamp;
+            else if (op == "reinhard") options.settings.toneMap.op = ToneMapOperator::Reinhard;
+            else if (op == "aces") options.settings.toneMap.op = ToneMapOperator::ACES;
+            else { std::cerr << "Error: unknown tone map operator " << op << std::endl; return false; }
+        }
+        else if (arg == "--exposure") options.settings.toneMap.exposure = atof(value().c_str());
+        else if (arg == "--gamma") options.settings.toneMap.gamma = atof(value().c_str());
+        else if (arg == "--jobs") options.jobs = atoi(value().c_str());
+        else if (arg == "--cache") options.cache = value();
+        else if (arg == "--reproject") options.temporal.enabled = true;
+        else if (arg == "--refresh") options.temporal.refreshFraction = atof(value().c_str());
+        else if (arg == "--large") options.large = true;
+        else if (arg == "--strip") options.largeSettings.stripRows = atoi(value().c_str());
+        else { std::cerr << "Error: unknown option " << arg << std::endl; return false; }
+    }
+
+    if (options.height <= 0) options.height = std::max(1, static_cast<int>(options.width / (16.0 / 9.0)));
+    if (options.width <= 0 || options.lastFrame < options.firstFrame || options.largeSettings.stripRows <= 0) {
+        std::cerr << "Error: bad resolution, frame range or strip size" << std::endl;
+        return false;
+    }
+    // a reprojected frame depends on the one before it, it's neither cacheable nor done in strips
+    if (options.temporal.enabled && (options.large || !options.cache.empty())) {
+        std::cerr << "Error: --reproject doesn't go with --large or --cache" << std::endl;
+        return false;
+    }
+    if ((options.counters || !options.trace.empty()) && !instrumentationBuilt) {
+        std::cerr << "Error: --counters and --trace need a build with -DRT_INSTRUMENT" << std::endl;
+        return false;
+    }
+    if (options.checkAllocations && !allocationsCounted) {
+        std::cerr << "Error: --check-allocations needs a build with -DRT_COUNT_ALLOCATIONS" << std::endl;
+        return false;
+    }
+    if (!heatmapAvailable(options.settings.heatmap.metric)) {
+        std::cerr << "Error: --heatmap " << heatmapUnit(options.settings.heatmap.metric) << " needs a build with -DRT_INSTRUMENT, ns works in any build" << std::endl;
+        return false;
+    }
+    bool heatmap = options.settings.heatmap.metric != HeatmapMetric::Off;
+    if (heatmap && options.large) {
+        std::cerr << "Error: --heatmap doesn't go with --large" << std::endl;
+        return false;
+    }
+    if (options.path != "orbit" && options.path != "static") {
+        std::cerr << "Error: unknown camera path " << options.path << std::endl;
+        return false;
+    }
+    if (!validFramePattern(options.out)) {
+        std::cerr << "Error: --out takes one %d (or %04d and the like) for the frame number and %% for a %: " << options.out << std::endl;
+        return false;
+    }
+    return true;
+}
+
+std::string frameFilename(const std::string& pattern, int frame) {
+    char buffer[1024];
+    snprintf(buffer, sizeof(buffer), pattern.c_str(), frame);
+    return buffer;
+}
+
+// Frames run side by side only when a single frame is too small to keep every core busy,
+// parallelFor hands out rows in chunks of 4 so a frame can use about height / 16 threads well.
+int pickJobs(const BatchOptions& options) {
+    int frames = options.lastFrame - options.firstFrame + 1;
+    int cores = workerCount();
+    if (options.temporal.enabled || options.perf || options.checkAllocations) return 1;
+    if (options.jobs > 0) return std::min(options.jobs, frames);
+    int threadsPerFrame = std::max(1, std::min(cores, options.height / 16));
+    return std::max(1, std::min(frames, cores / threadsPerFrame));
+}
+
+int main(int argc, char** argv) {
+    BatchOptions options;
+    if (!parseArguments(argc, argv, options)) {
+        printUsage();
+        return 1;
+    }
+
+    int jobs = pickJobs(options);
+    int threadsPerFrame = std::max(1, workerCount() / jobs);
+    if (options.out.find('%') == std::string::npos && options.lastFrame > options.firstFrame) {
+        std::cerr << "Warning: --out has no frame number, every frame overwrites " << options.out << std::endl;
+    }
+
+    // counting starts before the scene is loaded, phases are switched as the run goes
+    PerfPhases phases;
+    PerfPhases* perf = nullptr;
+    if (options.perf) {
+        if (!phases.open()) std::cerr << "Warning: perf_event_open isn't available, no counters" << std::endl;
+        perf = &phases;
+    }
+
+    // the built-in scene is the viewer's one, with the spheres where the viewer starts them
+    SceneFile sceneFile;
+    SceneData builtIn;
+    SceneView scene;
+    auto loadStart = std::chrono::steady_clock::now();
+    {
+        PhaseScope loadPhase(perf, Phase::Load);
+        if (options.scene == "default") {
+            builtIn = defaultScene(Vec3(1, 0, -2), Vec3(0.8, -0.3, -1), Vec3(4, 0.2, 1.5));
+            scene = builtIn.view();
+        } else {
+            if (!sceneFile.load(options.scene)) return 1;
+            scene = sceneFile.view();
+        }
+    }
+    double loadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - loadStart).count();
+    printf("scene loaded in %.2f ms: %zu primitives, %zu lights\n", loadMs, scene.primitiveCount(), scene.lights.count);
+    printf("kernels: %s\n", isaName(activeIsa()));
+
+    if (!options.compiledScene.empty()) {
+        return writeSceneFile(options.compiledScene, scene) ? 0 : 1;
+    }
+
+    Objects world;
+    {
+        PhaseScope buildPhase(perf, Phase::Build);
+        if (!buildWorld(scene, world)) return 1;
+    }
+
+    Vec3 camera_up = toVec3(scene.camera.up);
+    Vec3 look_at = toVec3(scene.camera.lookAt);
+    bool orthogonal = options.orthogonal || scene.camera.orthogonal != 0;
+    OrbitPath orbit;
+
+    // frames only come out of the cache, nothing is kept in memory between frames here
+    FrameCacheSettings cacheSettings;
+    cacheSettings.memoryBytes = 0;
+    cacheSettings.directory = options.cache;
+    FrameCache cache(cacheSettings);
+    uint64_t sceneHash = options.cache.empty() ? 0 : hashScene(scene);
+    std::atomic<int> cached(0);
+
+    // with --reproject frames go one at a time in order, each one through the same G-buffer
+    GBuffer gbuffer;
+    gbuffer.temporal = options.temporal;
+
+    RenderStats stats;
+    bool heatmap = options.settings.heatmap.metric != HeatmapMetric::Off;
+    stats.phases = perf;
+    if (options.stats || heatmap || options.perf) options.settings.stats = &stats;
+
+    FrameWriterQueue writer(2, jobs + 2);
+    std::atomic<bool> failed(false);
+    if (!options.trace.empty()) setTracing(true);
+    CounterTotals countersBefore = counterTotals();
+    // the first frame fills the pools and arenas, the ones after it shouldn't need the heap
+    uint64_t steadyViolations = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    parallelFor(options.firstFrame, options.lastFrame + 1, [&](int frame) {
+        workerLimit() = threadsPerFrame;
+        CounterTotals frameCounters = counterTotals();
+        uint64_t allocationsBefore = allocationTotal.load();
+        uint64_t bytesBefore = allocationBytes.load();
+        uint64_t violationsBefore = allocationViolations.load();
+        auto frameStart = std::chrono::steady_clock::now();
+
+        Vec3 cameraPosition = options.path == "orbit" ? orbit.cameraAt(orbit.angleAt(frame)) : toVec3(scene.camera.position);
+        std::string filename = frameFilename(options.out, frame);
+
+        if (options.large) {
+            if (!renderLargeImage(filename, world, orthogonal, options.width, options.height, cameraPosition, camera_up, look_at, options.settings, options.largeSettings)) {
+                failed = true;
+            }
+        } else {
+            FrameJob job;
+            job.filename = filename;
+            job.width = options.width;
+            job.height = options.height;
+            if (options.temporal.enabled) {
+                trackSceneChanges(gbuffer, scene, orthogonal, options.width, options.height, cameraPosition, camera_up, look_at, options.settings.lens);
+                job.rgb.reset(CameraAndScene(world, orthogonal, options.width, options.height, cameraPosition, camera_up, look_at, options.settings, &gbuffer));
+            } else if (options.cache.empty()) {
+                job.rgb.reset(CameraAndScene(world, orthogonal, options.width, options.height, cameraPosition, camera_up, look_at, options.settings));
+            } else {
+                bool traced = false;
+                uint64_t key = frameKey(sceneHash, orthogonal, options.width, options.height, cameraPosition, camera_up, look_at, options.settings);
+                CachedFrame frame = cache.get(key, options.width, options.height, [&]() {
+                    traced = true;
+                    std::unique_ptr<unsigned char[]> image(CameraAndScene(world, orthogonal, options.width, options.height, cameraPosition, camera_up, look_at, options.settings));
+                    return std::make_shared<const std::vector<unsigned char>>(image.get(), image.get() + static_cast<size_t>(options.width) * options.height * 3);
+                });
+                if (!traced) cached++;
+                job.rgb.reset(new unsigned char[frame.rgb->size()]);
+                memcpy(job.rgb.get(), frame.rgb->data(), frame.rgb->size());
+            }
+            if (options.perf) {
+                // written right here, so the writing counts on its own
+                PhaseScope writePhase(perf, Phase::Write);
+                if (!writeImageFile(job.filename, job.rgb.get(), job.width, job.height)) failed = true;
+            } else {
+                writer.push(std::move(job));
+            }
+        }
+
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count();
+        printf("frame %d rendered in %.1f ms -> %s\n", frame, ms, filename.c_str());
+        // frames rendered side by side count into each other's numbers, those only get a total
+        if (options.counters && jobs == 1) printCounterSummary(counterTotals() - frameCounters, ms);
+        if (options.checkAllocations) {
+            uint64_t violations = allocationViolations.load() - violationsBefore;
+            printf("  allocations: %llu (%.1f KB), %llu of them while tracing rows\n", static_cast<unsigned long long>(allocationTotal.load() - allocationsBefore),
+                (allocationBytes.load() - bytesBefore) / 1024.0, static_cast<unsigned long long>(violations));
+            if (frame != options.firstFrame) steadyViolations += violations;
+        }
+        if (heatmap && jobs == 1) printf("  heatmap: white is %.0f %s\n", stats.heatmapMaxCost.load(), heatmapUnit(options.settings.heatmap.metric));
+    }, 1, jobs);
+
+    writer.flush();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%d frames in %.2f s (%d at a time, %d threads each, %d from the cache)\n", options.lastFrame - options.firstFrame + 1, seconds, jobs, threadsPerFrame, cached.load());
+    if (options.stats) {
+        uint64_t rays = stats.primaryRays.load();
+        double rayGenMs = stats.rayGenNanoseconds.load() / 1e6;
+        printf("ray generation: %.1f ms cpu for %llu primary rays (%.1f ns a ray)\n", rayGenMs, static_cast<unsigned long long>(rays), rays > 0 ? rayGenMs * 1e6 / rays : 0.0);
+    }
+    if (options.counters) {
+        printf("all frames:\n");
+        printCounterSummary(counterTotals() - countersBefore, seconds * 1000);
+    }
+    if (options.checkAllocations && steadyViolations > 0) {
+        std::cerr << "Error: " << steadyViolations << " allocations while tracing rows after the first frame" << std::endl;
+        failed = true;
+    }
+    if (!options.trace.empty() && !writeChromeTrace(options.trace)) failed = true;
+    if (options.perf) {
+        phases.enter(Phase::Other);
+        printPerfSummary(phases, stats.primaryRays.load());
+    }
+    return (failed || writer.failures() > 0) ? 1 : 0;
+}
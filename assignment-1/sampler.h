@@ -0,0 +1,103 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+#include "vec3.h"
+#include "framebuffer.h"
+
+// Adaptive sampling: every pixel first gets a single ray through its centre (same as before).
+// Pixels whose colour differs from their neighbours (edges, reflections, shadow boundaries)
+// are then refined with jittered rays until the estimate of the mean stops moving.
+// Flat regions like the backdrop never get more than the first ray.
+struct SamplerSettings {
+    int minSamples = 4;              // samples a refined pixel always gets before we test convergence
+    int maxSamples = 16;             // hard cap per pixel, 1 turns refinement off completely
+    double contrastThreshold = 6.0;  // neighbour difference (0-255 scale) that marks a pixel for refinement
+    double errorThreshold = 1.5;     // stop once the standard error of the mean is below this (0-255 scale)
+};
+
+// Small hash based generator, seeded per pixel so the jitter pattern is the same every frame
+class SampleRng {
+public:
+    uint32_t state;
+
+    SampleRng(uint32_t x, uint32_t y, uint32_t frame = 0) : state(hash(x * 0x9E3779B1u ^ hash(y + frame * 0x85EBCA77u))) {}
+
+    static uint32_t hash(uint32_t v) {
+        v ^= v >> 16; v *= 0x7FEB352Du;
+        v ^= v >> 15; v *= 0x846CA68Bu;
+        v ^= v >> 16;
+        return v;
+    }
+
+    // uniform double in [0, 1)
+    double next() {
+        state = state * 747796405u + 2891336453u;
+        uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+        return ((word >> 22u) ^ word) * (1.0 / 4294967296.0);
+    }
+};
+
+// Running mean and variance (Welford) of the samples taken for one pixel.
+// The variance is tracked on luminance, that is what the eye notices.
+class PixelEstimator {
+public:
+    Color mean;
+    double lumMean;
+    double lumM2;
+    int count;
+
+    PixelEstimator() : mean(0, 0, 0), lumMean(0), lumM2(0), count(0) {}
+
+    // measured on the displayable range, otherwise an HDR highlight never looks converged
+    static double luminance(const Color& c) {
+        Color d = Color(c).clamp(0.0, 255.0);
+        return 0.2126 * d.x + 0.7152 * d.y + 0.0722 * d.z;
+    }
+
+    void add(const Color& sample) {
+        count++;
+        mean = mean + (sample - mean) / count;
+
+        double lum = luminance(sample);
+        double delta = lum - lumMean;
+        lumMean += delta / count;
+        lumM2 += delta * (lum - lumMean);
+    }
+
+    // standard error of the mean luminance
+    double error() const {
+        if (count < 2) return 0.0;
+        double variance = lumM2 / (count - 1);
+        return std::sqrt(variance / count);
+    }
+
+    bool converged(const SamplerSettings& settings) const {
+        if (count >= settings.maxSamples) return true;
+        if (count < settings.minSamples) return false;
+        return error() < settings.errorThreshold;
+    }
+};
+
+// largest per channel difference between a pixel and its 4 neighbours, in the displayable range
+inline double neighbourContrast(const FrameBuffer& pixels, int x, int y) {
+    int width = pixels.width;
+    int height = pixels.height;
+    Color c = pixels.get(y * width + x).clamp(0.0, 255.0);
+    double contrast = 0.0;
+    auto compare = [&](int nx, int ny) {
+        if (nx < 0 || ny < 0 || nx >= width || ny >= height) return;
+        Color n = pixels.get(ny * width + nx).clamp(0.0, 255.0);
+        contrast = std::max({contrast, std::abs(c.x - n.x), std::abs(c.y - n.y), std::abs(c.z - n.z)});
+    };
+    compare(x - 1, y);
+    compare(x + 1, y);
+    compare(x, y - 1);
+    compare(x, y + 1);
+    return contrast;
+}
+
+#endif
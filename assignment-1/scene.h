@@ -0,0 +1,253 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <type_traits>
+#include <vector>
+#include "vec3.h"
+#include "objects.h"
+
+// Scene content as flat records. Every record is plain data with a fixed layout, so the same
+// arrays can come from the text parser (sceneparser.h) or point straight into a memory mapped
+// compiled scene file (scenefile.h) without any conversion.
+// Primitives refer to their material by index into the material table.
+
+struct MaterialRecord {
+    double color[3];
+    uint32_t glazed;
+    uint32_t padding;
+};
+
+struct SphereRecord {
+    double centre[3];
+    double radius;
+    uint32_t material;
+    uint32_t padding;
+};
+
+// the plane is y = height, the normal is what shading sees
+struct PlaneRecord {
+    double normal[3];
+    double height;
+    uint32_t material;
+    uint32_t padding;
+};
+
+struct TriangleRecord {
+    double a[3], b[3], c[3];
+    uint32_t material;
+    uint32_t padding;
+};
+
+struct TetrahedronRecord {
+    double a[3], b[3], c[3], d[3];
+    uint32_t material;
+    uint32_t padding;
+};
+
+struct LightRecord {
+    double position[3];
+    double intensity;
+};
+
+// defaults are the viewer's static camera
+struct CameraRecord {
+    double position[3] = {4, -1, 5};
+    double up[3] = {0, -1, 0};
+    double lookAt[3] = {0, 0, -1};
+    uint32_t orthogonal = 0;
+    uint32_t padding = 0;
+};
+
+static_assert(std::is_trivially_copyable<MaterialRecord>::value && sizeof(MaterialRecord) == 32, "scene records are written to disk as they are");
+static_assert(std::is_trivially_copyable<SphereRecord>::value && sizeof(SphereRecord) == 40, "scene records are written to disk as they are");
+static_assert(std::is_trivially_copyable<PlaneRecord>::value && sizeof(PlaneRecord) == 40, "scene records are written to disk as they are");
+static_assert(std::is_trivially_copyable<TriangleRecord>::value && sizeof(TriangleRecord) == 80, "scene records are written to disk as they are");
+static_assert(std::is_trivially_copyable<TetrahedronRecord>::value && sizeof(TetrahedronRecord) == 104, "scene records are written to disk as they are");
+static_assert(std::is_trivially_copyable<LightRecord>::value && sizeof(LightRecord) == 32, "scene records are written to disk as they are");
+static_assert(std::is_trivially_copyable<CameraRecord>::value && sizeof(CameraRecord) == 80, "scene records are written to disk as they are");
+
+inline Vec3 toVec3(const double* v) {
+    return Vec3(v[0], v[1], v[2]);
+}
+
+inline void storeVec3(double* out, const Vec3& v) {
+    out[0] = v.x;
+    out[1] = v.y;
+    out[2] = v.z;
+}
+
+// A read-only array that lives somewhere else
+template<typename T>
+struct SceneSpan {
+    const T* data = nullptr;
+    size_t count = 0;
+
+    const T* begin() const { return data; }
+    const T* end() const { return data + count; }
+    const T& operator[](size_t i) const { return data[i]; }
+};
+
+template<typename T>
+SceneSpan<T> spanOf(const std::vector<T>& v) {
+    SceneSpan<T> span;
+    span.data = v.data();
+    span.count = v.size();
+    return span;
+}
+
+// Everything the renderer needs from a scene, without owning any of it
+struct SceneView {
+    CameraRecord camera;
+    SceneSpan<MaterialRecord> materials;
+    SceneSpan<SphereRecord> spheres;
+    SceneSpan<PlaneRecord> planes;
+    SceneSpan<TriangleRecord> triangles;
+    SceneSpan<TetrahedronRecord> tetrahedra;
+    SceneSpan<LightRecord> lights;
+
+    size_t primitiveCount() const {
+        return spheres.count + planes.count + triangles.count + tetrahedra.count;
+    }
+};
+
+// A scene that owns its records, this is what the parser fills in
+struct SceneData {
+    CameraRecord camera;
+    std::vector<MaterialRecord> materials;
+    std::vector<SphereRecord> spheres;
+    std::vector<PlaneRecord> planes;
+    std::vector<TriangleRecord> triangles;
+    std::vector<TetrahedronRecord> tetrahedra;
+    std::vector<LightRecord> lights;
+
+    SceneView view() const {
+        SceneView v;
+        v.camera = camera;
+        v.materials = spanOf(materials);
+        v.spheres = spanOf(spheres);
+        v.planes = spanOf(planes);
+        v.triangles = spanOf(triangles);
+        v.tetrahedra = spanOf(tetrahedra);
+        v.lights = spanOf(lights);
+        return v;
+    }
+
+    uint32_t addMaterial(const Color& color, bool glazed) {
+        MaterialRecord m = {};
+        storeVec3(m.color, color);
+        m.glazed = glazed ? 1 : 0;
+        materials.push_back(m);
+        return static_cast<uint32_t>(materials.size() - 1);
+    }
+
+    void addSphere(const Vec3& centre, double radius, uint32_t material) {
+        SphereRecord s = {};
+        storeVec3(s.centre, centre);
+        s.radius = radius;
+        s.material = material;
+        spheres.push_back(s);
+    }
+
+    void addPlane(const Vec3& normal, double height, uint32_t material) {
+        PlaneRecord p = {};
+        storeVec3(p.normal, normal);
+        p.height = height;
+        p.material = material;
+        planes.push_back(p);
+    }
+
+    void addTriangle(const Vec3& a, const Vec3& b, const Vec3& c, uint32_t material) {
+        TriangleRecord t = {};
+        storeVec3(t.a, a);
+        storeVec3(t.b, b);
+        storeVec3(t.c, c);
+        t.material = material;
+        triangles.push_back(t);
+    }
+
+    void addTetrahedron(const Vec3& a, const Vec3& b, const Vec3& c, const Vec3& d, uint32_t material) {
+        TetrahedronRecord t = {};
+        storeVec3(t.a, a);
+        storeVec3(t.b, b);
+        storeVec3(t.c, c);
+        storeVec3(t.d, d);
+        t.material = material;
+        tetrahedra.push_back(t);
+    }
+
+    void addLight(const Vec3& position, double intensity) {
+        LightRecord l = {};
+        storeVec3(l.position, position);
+        l.intensity = intensity;
+        lights.push_back(l);
+    }
+};
+
+// The scene the viewer has always shown, the three spheres and the key light (light_pos) are
+// the ones it moves around
+inline SceneData defaultScene(Vec3 sphere1_centre, Vec3 sphere2_centre, Vec3 s3_centre, Vec3 light_pos = Vec3(-2, -2, 1)) {
+    SceneData scene;
+    scene.addSphere(sphere1_centre, 0.8, scene.addMaterial(Color(0, 0, 0), true));
+    scene.addSphere(sphere2_centre, 0.2, scene.addMaterial(Color(0.70, 1.50, 1.84), true));
+    scene.addSphere(s3_centre, 0.4, scene.addMaterial(Color(0.3, 0.4, 0.7), true));
+    scene.addPlane(Vec3(0, -1, 0), 0.8, scene.addMaterial(Color(0.8, 0.1, 0.4), true));
+    scene.addTetrahedron(Vec3(-1, 0.6, -0.2), Vec3(0, 0.6, -0.8), Vec3(-2, 0.6, -0.8), Vec3(-1, -0.35, -0.5), scene.addMaterial(Color(0.70, 1.84, 1.61), true));
+    scene.addLight(Vec3(0, -2, 3), 4);
+    scene.addLight(Vec3(0, -2, -3), 4);
+    scene.addLight(light_pos, 8);
+    return scene;
+}
+
+// Turns the records into the objects the tracer works with. Objects are added in the order
+// spheres, planes, triangles, tetrahedra, which is also the order the default scene used.
+inline bool buildWorld(const SceneView& scene, Objects& world) {
+    world.clear();
+    world.primitiveMaterials.reserve(scene.primitiveCount());
+    world.spheres.reserve(scene.spheres.count);
+    world.planes.reserve(scene.planes.count);
+    world.triangles.reserve(scene.triangles.count);
+    world.tetrahedra.reserve(scene.tetrahedra.count);
+
+    // the materials keep their indices, so the records' indices are the world's
+    for (const MaterialRecord& m : scene.materials) {
+        world.addMaterial(Material(toVec3(m.color), m.glazed != 0));
+    }
+    auto valid = [&](uint32_t index, const char* kind, size_t i) {
+        if (index >= scene.materials.count) {
+            std::cerr << "Error: " << kind << " " << i << " uses material " << index << " but the scene only has " << scene.materials.count << std::endl;
+            return false;
+        }
+        return true;
+    };
+
+    for (size_t i = 0; i < scene.spheres.count; i++) {
+        const SphereRecord& s = scene.spheres[i];
+        if (!valid(s.material, "sphere", i)) return false;
+        world.addSphere(toVec3(s.centre), s.radius, s.material);
+    }
+    for (size_t i = 0; i < scene.planes.count; i++) {
+        const PlaneRecord& p = scene.planes[i];
+        if (!valid(p.material, "plane", i)) return false;
+        world.addPlane(toVec3(p.normal), p.height, p.material);
+    }
+    for (size_t i = 0; i < scene.triangles.count; i++) {
+        const TriangleRecord& t = scene.triangles[i];
+        if (!valid(t.material, "triangle", i)) return false;
+        world.addTriangle(toVec3(t.a), toVec3(t.b), toVec3(t.c), t.material);
+    }
+    for (size_t i = 0; i < scene.tetrahedra.count; i++) {
+        const TetrahedronRecord& t = scene.tetrahedra[i];
+        if (!valid(t.material, "tetrahedron", i)) return false;
+        world.addTetrahedron(toVec3(t.a), toVec3(t.b), toVec3(t.c), toVec3(t.d), t.material);
+    }
+    for (const LightRecord& l : scene.lights) {
+        world.addLight(Sunlight(toVec3(l.position), l.intensity));
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef SCENECHANGES_H
+#define SCENECHANGES_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "scene.h"
+#include "gbuffer.h"
+#include "framecache.h"
+
+// Tells a G-buffer (gbuffer.h) what changed since the scene it was last used with.
+// Every primitive gets a key from its record and its material, so a primitive that moved
+// or changed colour shows up as a changed key, and its bounds before and after go into the
+// G-buffer. A camera move keeps the colours for reprojection as long as nothing else changed.
+// Any change of the resolution, the lens (its aperture and focus too) or the number of
+// primitives throws everything away.
+// Hashing the records is linear in the scene, it's cheap next to tracing it.
+
+// around every corner, from their centroid
+template<size_t N>
+inline Bounds boundsOf(const Vec3 (&corners)[N]) {
+    Vec3 centre(0, 0, 0);
+    for (const Vec3& c : corners) centre = centre + c;
+    centre = centre / static_cast<double>(N);
+    double radius = 0;
+    for (const Vec3& c : corners) radius = std::max(radius, (c - centre).length());
+    return {centre, radius};
+}
+
+// keys and bounds of every primitive, in the order buildWorld() adds them
+inline void primitiveKeys(const SceneView& scene, std::vector<uint64_t>& keys, std::vector<Bounds>& bounds) {
+    keys.clear();
+    bounds.clear();
+    keys.reserve(scene.primitiveCount());
+    bounds.reserve(scene.primitiveCount());
+
+    auto add = [&](const auto& record, const Bounds& b) {
+        FrameHasher h;
+        h.add(record);
+        if (record.material < scene.materials.count) h.add(scene.materials[record.material]);
+        keys.push_back(h.value());
+        bounds.push_back(b);
+    };
+    for (const SphereRecord& s : scene.spheres) {
+        add(s, Bounds{toVec3(s.centre), s.radius});
+    }
+    for (const PlaneRecord& p : scene.planes) {
+        add(p, Bounds{Vec3(0, 0, 0), std::numeric_limits<double>::infinity()});
+    }
+    for (const TriangleRecord& t : scene.triangles) {
+        Vec3 corners[3] = {toVec3(t.a), toVec3(t.b), toVec3(t.c)};
+        add(t, boundsOf(corners));
+    }
+    for (const TetrahedronRecord& t : scene.tetrahedra) {
+        Vec3 corners[4] = {toVec3(t.a), toVec3(t.b), toVec3(t.c), toVec3(t.d)};
+        add(t, boundsOf(corners));
+    }
+}
+
+inline void trackSceneChanges(GBuffer& gbuffer, const SceneView& scene, bool orthogonal, int width, int height, Vec3 cameraPosition, Vec3 camera_up, Vec3 look_at, const LensSettings& lens = LensSettings()) {
+    FrameHasher size;
+    size.add(orthogonal);
+    size.add(lens.lens);
+    size.add(lens.fov);
+    // the depth of field only shows in the refinement rays, kept refined colours would keep the old one
+    if (lens.lens == Lens::ThinLens) {
+        size.add(lens.aperture);
+        size.add(lens.focusDistance);
+    }
+    size.add(width);
+    size.add(height);
+    FrameHasher pose;
+    pose.add(cameraPosition);
+    pose.add(camera_up);
+    pose.add(look_at);
+    FrameHasher lights;
+    lights.add(scene.lights);
+
+    std::vector<uint64_t> keys;
+    std::vector<Bounds> bounds;
+    primitiveKeys(scene, keys, bounds);
+
+    CameraBasis camera(orthogonal, width, height, cameraPosition, camera_up, look_at, lens);
+    if (size.value() != gbuffer.sizeKey || keys.size() != gbuffer.objectKeys.size()) {
+        gbuffer.invalidate();
+        gbuffer.camera = camera;
+    } else if (pose.value() != gbuffer.poseKey) {
+        // reprojection only works when nothing but the camera moved
+        if (keys != gbuffer.objectKeys || lights.value() != gbuffer.lightsKey) gbuffer.invalidate();
+        gbuffer.moveCamera(camera);
+    } else {
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (keys[i] != gbuffer.objectKeys[i]) gbuffer.addMoved(gbuffer.objectBounds[i], bounds[i]);
+        }
+        if (lights.value() != gbuffer.lightsKey) gbuffer.relight();
+    }
+
+    gbuffer.sizeKey = size.value();
+    gbuffer.poseKey = pose.value();
+    gbuffer.lightsKey = lights.value();
+    gbuffer.objectKeys = std::move(keys);
+    gbuffer.objectBounds = std::move(bounds);
+}
+
+#endif
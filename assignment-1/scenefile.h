@@ -0,0 +1,174 @@
+#ifndef SCENEFILE_H
+#define SCENEFILE_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include "scene.h"
+#include "sceneparser.h"
+#include "mappedfile.h"
+#include "tga.h"
+
+// Compiled scene files. The file is a header followed by the record arrays exactly as they
+// sit in memory, so loading is one mmap plus a bounds check on the header, the records are
+// used in place and nothing gets parsed. The layout is little endian, which is every
+// platform this builds on.
+//
+//   SceneFileHeader | materials | spheres | planes | triangles | tetrahedra | lights
+//
+// Every section starts on an 8 byte boundary so the doubles inside are aligned.
+
+enum SceneSection {
+    MaterialSection,
+    SphereSection,
+    PlaneSection,
+    TriangleSection,
+    TetrahedronSection,
+    LightSection,
+    SectionCount
+};
+
+struct SceneFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    CameraRecord camera;
+    uint64_t offset[SectionCount];
+    uint64_t count[SectionCount];
+};
+
+static const char sceneFileMagic[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', 0};
+static const uint32_t sceneFileVersion = 1;
+
+static const size_t sceneRecordSize[SectionCount] = {
+    sizeof(MaterialRecord), sizeof(SphereRecord), sizeof(PlaneRecord),
+    sizeof(TriangleRecord), sizeof(TetrahedronRecord), sizeof(LightRecord)
+};
+
+inline bool writeSceneFile(const std::string& filename, const SceneView& scene) {
+    const void* data[SectionCount] = {
+        scene.materials.data, scene.spheres.data, scene.planes.data,
+        scene.triangles.data, scene.tetrahedra.data, scene.lights.data
+    };
+
+    SceneFileHeader header = {};
+    memcpy(header.magic, sceneFileMagic, sizeof(header.magic));
+    header.version = sceneFileVersion;
+    header.headerSize = sizeof(SceneFileHeader);
+    header.camera = scene.camera;
+    header.count[MaterialSection] = scene.materials.count;
+    header.count[SphereSection] = scene.spheres.count;
+    header.count[PlaneSection] = scene.planes.count;
+    header.count[TriangleSection] = scene.triangles.count;
+    header.count[TetrahedronSection] = scene.tetrahedra.count;
+    header.count[LightSection] = scene.lights.count;
+
+    // records are all multiples of 8 bytes, so packing the sections back to back keeps them aligned
+    uint64_t offset = sizeof(SceneFileHeader);
+    for (int i = 0; i < SectionCount; i++) {
+        header.offset[i] = offset;
+        offset += header.count[i] * sceneRecordSize[i];
+    }
+
+    FILE* fp = openForWriting(filename.c_str());
+    if (fp == NULL) {
+        std::cerr << "Error: Unable to open file for writing: " << filename << std::endl;
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    for (int i = 0; i < SectionCount && ok; i++) {
+        size_t bytes = static_cast<size_t>(header.count[i] * sceneRecordSize[i]);
+        ok = bytes == 0 || fwrite(data[i], 1, bytes, fp) == bytes;
+    }
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok) std::cerr << "Error: Failed writing " << filename << std::endl;
+    return ok;
+}
+
+// A compiled scene file mapped into memory, view points straight into the mapping and
+// stays valid for as long as this object lives
+class MappedScene {
+public:
+    SceneView view;
+
+    bool open(const std::string& filename) {
+        if (!file.openForReading(filename)) return false;
+        if (file.size < sizeof(SceneFileHeader)) return invalid(filename, "too small");
+
+        const uint8_t* base = file.map(0, static_cast<size_t>(file.size));
+        if (base == NULL) return invalid(filename, "unable to map");
+
+        SceneFileHeader header;
+        memcpy(&header, base, sizeof(header));
+        if (memcmp(header.magic, sceneFileMagic, sizeof(header.magic)) != 0) return invalid(filename, "not a compiled scene");
+        if (header.version != sceneFileVersion || header.headerSize != sizeof(SceneFileHeader)) return invalid(filename, "written by a different version");
+
+        for (int i = 0; i < SectionCount; i++) {
+            uint64_t offset = header.offset[i];
+            uint64_t count = header.count[i];
+            if (offset % 8 != 0 || offset > file.size || count > (file.size - offset) / sceneRecordSize[i]) {
+                return invalid(filename, "section out of bounds");
+            }
+        }
+
+        view.camera = header.camera;
+        section(base, header, MaterialSection, view.materials);
+        section(base, header, SphereSection, view.spheres);
+        section(base, header, PlaneSection, view.planes);
+        section(base, header, TriangleSection, view.triangles);
+        section(base, header, TetrahedronSection, view.tetrahedra);
+        section(base, header, LightSection, view.lights);
+        return true;
+    }
+
+private:
+    MappedFile file;
+
+    template<typename T>
+    static void section(const uint8_t* base, const SceneFileHeader& header, SceneSection which, SceneSpan<T>& span) {
+        span.data = reinterpret_cast<const T*>(base + header.offset[which]);
+        span.count = static_cast<size_t>(header.count[which]);
+    }
+
+    bool invalid(const std::string& filename, const char* why) {
+        std::cerr << "Error: " << filename << ": " << why << std::endl;
+        file.close();
+        view = SceneView();
+        return false;
+    }
+};
+
+// A scene loaded from either format, compiled files are told apart by their magic bytes
+class SceneFile {
+public:
+    bool load(const std::string& filename) {
+        char magic[8] = {};
+        FILE* fp = fopen(filename.c_str(), "rb");
+        if (fp == NULL) {
+            std::cerr << "Error: Unable to open " << filename << std::endl;
+            return false;
+        }
+        size_t n = fread(magic, 1, sizeof(magic), fp);
+        fclose(fp);
+
+        if (n == sizeof(magic) && memcmp(magic, sceneFileMagic, sizeof(magic)) == 0) {
+            compiled = true;
+            return mapped.open(filename);
+        }
+        compiled = false;
+        return parseSceneFile(filename, parsed);
+    }
+
+    SceneView view() const {
+        return compiled ? mapped.view : parsed.view();
+    }
+
+private:
+    bool compiled = false;
+    SceneData parsed;
+    MappedScene mapped;
+};
+
+#endif
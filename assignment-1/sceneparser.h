@@ -0,0 +1,247 @@
+#ifndef SCENEPARSER_H
+#define SCENEPARSER_H
+
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "scene.h"
+
+// Text scene format, one statement per line, '#' starts a comment:
+//
+//   camera   px py pz   lx ly lz   ux uy uz   [ortho]      position, look at, up
+//   material NAME r g b [glazed]
+//   sphere   cx cy cz radius MATERIAL
+//   plane    nx ny nz height MATERIAL                      the plane y = height
+//   triangle ax ay az  bx by bz  cx cy cz  MATERIAL
+//   tetra    ax ay az  bx by bz  cx cy cz  dx dy dz  MATERIAL
+//   light    x y z intensity
+//   obj      PATH MATERIAL [tx ty tz [scale]]              triangles of a Wavefront OBJ file
+//
+// Materials have to be defined before they are used. OBJ paths are relative to the scene file.
+// The whole file is read in one go and scanned in place, no streams and no per line strings.
+
+// Cursor over one line of text
+struct LineScanner {
+    const char* p;
+    const char* end;
+
+    static bool isSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    void skipSpaces() {
+        while (p < end && isSpace(*p)) p++;
+    }
+
+    bool atEnd() {
+        skipSpaces();
+        return p >= end || *p == '#';
+    }
+
+    // the next whitespace separated word, empty at the end of the line
+    std::string word() {
+        skipSpaces();
+        const char* start = p;
+        while (p < end && !isSpace(*p)) p++;
+        return std::string(start, p);
+    }
+
+    bool keyword(const char* k) {
+        skipSpaces();
+        size_t n = strlen(k);
+        if (static_cast<size_t>(end - p) < n || memcmp(p, k, n) != 0) return false;
+        if (p + n < end && !isSpace(p[n])) return false;
+        p += n;
+        return true;
+    }
+
+    // from_chars doesn't care about the locale and is a lot quicker than strtod
+    bool number(double& out) {
+        skipSpaces();
+        if (p < end && *p == '+') p++;
+        auto result = std::from_chars(p, end, out);
+        if (result.ec != std::errc() || (result.ptr < end && !isSpace(*result.ptr))) return false;
+        p = result.ptr;
+        return true;
+    }
+
+    bool vec3(Vec3& out) {
+        return number(out.x) && number(out.y) && number(out.z);
+    }
+
+    // an OBJ vertex reference "v", "v/vt", "v//vn" or "v/vt/vn", only v is kept
+    bool index(long& out) {
+        skipSpaces();
+        if (p >= end) return false;
+        char* stop = nullptr;
+        out = strtol(p, &stop, 10);
+        if (stop == p || out == 0) return false;
+        p = stop;
+        while (p < end && !isSpace(*p)) p++;
+        return true;
+    }
+};
+
+inline bool readWholeFile(const std::string& filename, std::string& text) {
+    FILE* fp = fopen(filename.c_str(), "rb");
+    if (fp == NULL) {
+        std::cerr << "Error: Unable to open " << filename << std::endl;
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    text.resize(size > 0 ? static_cast<size_t>(size) : 0);
+    bool ok = size >= 0 && fread(&text[0], 1, text.size(), fp) == text.size();
+    fclose(fp);
+    if (!ok) std::cerr << "Error: Unable to read " << filename << std::endl;
+    return ok;
+}
+
+inline std::string directoryOf(const std::string& path) {
+    size_t slash = path.find_last_of("/\\");
+    return slash == std::string::npos ? std::string() : path.substr(0, slash + 1);
+}
+
+// calls line(scanner, lineNumber) for every line of text, stops at the first line that fails
+template<typename Func>
+bool forEachLine(const std::string& text, Func line) {
+    const char* p = text.data();
+    const char* end = p + text.size();
+    int lineNumber = 0;
+    while (p < end) {
+        const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (eol == NULL) eol = end;
+        lineNumber++;
+        LineScanner scanner = {p, eol};
+        if (!scanner.atEnd() && !line(scanner, lineNumber)) return false;
+        p = eol + 1;
+    }
+    return true;
+}
+
+// Appends the triangles of an OBJ file, scaled and then moved by offset. Only 'v' and 'f'
+// lines matter, polygons are split into a fan of triangles.
+inline bool loadObjTriangles(const std::string& filename, uint32_t material, const Vec3& offset, double scale, SceneData& scene) {
+    std::string text;
+    if (!readWholeFile(filename, text)) return false;
+
+    std::vector<Vec3> vertices;
+    std::vector<long> face;
+    return forEachLine(text, [&](LineScanner& s, int lineNumber) {
+        if (s.keyword("v")) {
+            Vec3 v(0, 0, 0);
+            if (!s.vec3(v)) {
+                std::cerr << "Error: " << filename << ":" << lineNumber << ": bad vertex" << std::endl;
+                return false;
+            }
+            vertices.push_back(v * scale + offset);
+            return true;
+        }
+        if (!s.keyword("f")) return true;   // normals, texture coordinates, groups, ...
+
+        face.clear();
+        long index;
+        while (!s.atEnd()) {
+            if (!s.index(index)) {
+                std::cerr << "Error: " << filename << ":" << lineNumber << ": bad face" << std::endl;
+                return false;
+            }
+            // negative indices count back from the latest vertex
+            index = index < 0 ? static_cast<long>(vertices.size()) + index : index - 1;
+            if (index < 0 || index >= static_cast<long>(vertices.size())) {
+                std::cerr << "Error: " << filename << ":" << lineNumber << ": face uses a vertex that doesn't exist" << std::endl;
+                return false;
+            }
+            face.push_back(index);
+        }
+        for (size_t i = 2; i < face.size(); i++) {
+            scene.addTriangle(vertices[face[0]], vertices[face[i - 1]], vertices[face[i]], material);
+        }
+        return true;
+    });
+}
+
+inline bool parseSceneText(const std::string& text, const std::string& filename, SceneData& scene) {
+    std::unordered_map<std::string, uint32_t> materials;
+    std::string baseDirectory = directoryOf(filename);
+
+    return forEachLine(text, [&](LineScanner& s, int lineNumber) {
+        auto error = [&](const std::string& message) {
+            std::cerr << "Error: " << filename << ":" << lineNumber << ": " << message << std::endl;
+            return false;
+        };
+        auto material = [&](uint32_t& out) {
+            std::string name = s.word();
+            auto it = materials.find(name);
+            if (it == materials.end()) return error("unknown material '" + name + "'");
+            out = it->second;
+            return true;
+        };
+
+        Vec3 a(0, 0, 0), b(0, 0, 0), c(0, 0, 0), d(0, 0, 0);
+        double value = 0;
+        uint32_t m = 0;
+
+        if (s.keyword("sphere")) {
+            if (!s.vec3(a) || !s.number(value)) return error("expected: sphere cx cy cz radius MATERIAL");
+            if (!material(m)) return false;
+            scene.addSphere(a, value, m);
+        } else if (s.keyword("triangle")) {
+            if (!s.vec3(a) || !s.vec3(b) || !s.vec3(c)) return error("expected: triangle ax ay az bx by bz cx cy cz MATERIAL");
+            if (!material(m)) return false;
+            scene.addTriangle(a, b, c, m);
+        } else if (s.keyword("tetra")) {
+            if (!s.vec3(a) || !s.vec3(b) || !s.vec3(c) || !s.vec3(d)) return error("expected: tetra and four corners then MATERIAL");
+            if (!material(m)) return false;
+            scene.addTetrahedron(a, b, c, d, m);
+        } else if (s.keyword("plane")) {
+            if (!s.vec3(a) || !s.number(value)) return error("expected: plane nx ny nz height MATERIAL");
+            if (!material(m)) return false;
+            scene.addPlane(a, value, m);
+        } else if (s.keyword("material")) {
+            std::string name = s.word();
+            if (name.empty() || !s.vec3(a)) return error("expected: material NAME r g b [glazed]");
+            bool glazed = s.keyword("glazed");
+            materials[name] = scene.addMaterial(a, glazed);
+        } else if (s.keyword("light")) {
+            if (!s.vec3(a) || !s.number(value)) return error("expected: light x y z intensity");
+            scene.addLight(a, value);
+        } else if (s.keyword("camera")) {
+            if (!s.vec3(a) || !s.vec3(b) || !s.vec3(c)) return error("expected: camera px py pz lx ly lz ux uy uz [ortho]");
+            storeVec3(scene.camera.position, a);
+            storeVec3(scene.camera.lookAt, b);
+            storeVec3(scene.camera.up, c);
+            scene.camera.orthogonal = s.keyword("ortho") ? 1 : 0;
+        } else if (s.keyword("obj")) {
+            std::string path = s.word();
+            if (path.empty()) return error("expected: obj PATH MATERIAL [tx ty tz [scale]]");
+            if (!material(m)) return false;
+            double scale = 1;
+            if (!s.atEnd() && !s.vec3(a)) return error("bad obj offset");
+            if (!s.atEnd() && !s.number(scale)) return error("bad obj scale");
+            if (path[0] != '/' && path[0] != '\\' && path.find(':') == std::string::npos) {
+                path = baseDirectory + path;
+            }
+            if (!loadObjTriangles(path, m, a, scale, scene)) return error("failed to load " + path);
+        } else {
+            return error("unknown statement '" + s.word() + "'");
+        }
+
+        if (!s.atEnd()) return error("unexpected '" + s.word() + "' at the end of the line");
+        return true;
+    });
+}
+
+inline bool parseSceneFile(const std::string& filename, SceneData& scene) {
+    std::string text;
+    if (!readWholeFile(filename, text)) return false;
+    return parseSceneText(text, filename, scene);
+}
+
+#endif
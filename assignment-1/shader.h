@@ -1,6 +1,8 @@
 #ifndef SHADER_H
 #define SHADER_H
 
+#include <algorithm>
+#include <cmath>
 #include "vec3.h"
 
 
@@ -0,0 +1,195 @@
+#ifndef TGA_H
+#define TGA_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "cpudispatch.h"
+
+#if defined(RT_MULTI_ISA)
+#include <tmmintrin.h>
+#endif
+
+// fopen_s only exists on MSVC, everywhere else plain fopen is fine
+inline FILE* openForWriting(const char* filename) {
+	FILE* fp = NULL;
+#ifdef _MSC_VER
+	if (fopen_s(&fp, filename, "wb") != 0) return NULL;
+#else
+	fp = fopen(filename, "wb");
+#endif
+	return fp;
+}
+
+// Swaps R and B of every pixel of one row (RGB -> BGR, or RGBA -> BGRA) into dst.
+// dataChannels is the layout of src, fileChannels the layout we want in dst (3 or 4).
+// The same-layout cases get loops of their own. RGBA is vectorised into byte shuffles at
+// every instruction set level of cpudispatch.h, RGB goes through swizzleRgbSsse3 below
+inline void swizzleRowBody(const uint8_t* __restrict src, uint8_t* __restrict dst, uint32_t width, uint8_t dataChannels, uint8_t fileChannels)
+{
+	if (dataChannels == 3 && fileChannels == 3) {
+		for (uint32_t x = 0; x < width; ++x) {
+			dst[x * 3] = src[x * 3 + 2];
+			dst[x * 3 + 1] = src[x * 3 + 1];
+			dst[x * 3 + 2] = src[x * 3];
+		}
+		return;
+	}
+	if (dataChannels == 4 && fileChannels == 4) {
+		for (uint32_t x = 0; x < width; ++x) {
+			dst[x * 4] = src[x * 4 + 2];
+			dst[x * 4 + 1] = src[x * 4 + 1];
+			dst[x * 4 + 2] = src[x * 4];
+			dst[x * 4 + 3] = src[x * 4 + 3];
+		}
+		return;
+	}
+	for (uint32_t x = 0; x < width; ++x) {
+		const uint8_t* p = src + x * dataChannels;
+		uint8_t* q = dst + x * fileChannels;
+		q[0] = p[2];
+		q[1] = p[1];
+		q[2] = p[0];
+		if (fileChannels == 4) q[3] = dataChannels == 4 ? p[3] : 255;
+	}
+}
+
+RT_DISPATCH_KERNEL(swizzleRowKernel,
+	(const uint8_t* src, uint8_t* dst, uint32_t width, uint8_t dataChannels, uint8_t fileChannels),
+	(src, dst, width, dataChannels, fileChannels),
+	swizzleRowBody)
+
+#if defined(RT_MULTI_ISA)
+// RGB -> BGR with pshufb, the vectoriser won't do the 3 byte stride. 5 pixels per 16 byte
+// load, the 16th byte is rewritten by the next store or the scalar tail, and loads and
+// stores stay inside the row
+RT_KERNEL_CLONE("ssse3") inline void swizzleRgbSsse3(const uint8_t* __restrict src, uint8_t* __restrict dst, uint32_t width)
+{
+	const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+	uint32_t x = 0;
+	for (; x + 6 <= width; x += 5) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x * 3));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * 3), _mm_shuffle_epi8(v, shuffle));
+	}
+	swizzleRowBody(src + x * 3, dst + x * 3, width - x, 3, 3);
+}
+#endif
+
+// src and dst must not overlap
+inline void swizzleRow(const uint8_t* src, uint8_t* dst, uint32_t width, uint8_t dataChannels, uint8_t fileChannels)
+{
+#if defined(RT_MULTI_ISA)
+	// every level above scalar has SSSE3
+	if (dataChannels == 3 && fileChannels == 3 && activeIsa() >= IsaLevel::SSE42) {
+		swizzleRgbSsse3(src, dst, width);
+		return;
+	}
+#endif
+	swizzleRowKernel(src, dst, width, dataChannels, fileChannels);
+}
+
+// 18 byte TGA header, type 2 (raw) or 10 (RLE). topLeft sets the image origin bit,
+// otherwise the first row in the file is the bottom one.
+inline void tgaHeader(uint8_t* header, uint32_t width, uint32_t height, uint8_t fileChannels, bool rle, bool topLeft)
+{
+	uint8_t fields[18] = { 0,0,(uint8_t)(rle ? 10 : 2),0,0,0,0,0,0,0,0,0, (uint8_t)(width%256), (uint8_t)(width/256), (uint8_t)(height%256), (uint8_t)(height/256), (uint8_t)(fileChannels*8), (uint8_t)(topLeft ? 0x20 : 0) };
+	memcpy(header, fields, 18);
+}
+
+inline bool samePixel(const uint8_t* a, const uint8_t* b, uint8_t channels)
+{
+	return a[0] == b[0] && a[1] == b[1] && a[2] == b[2] && (channels == 3 || a[3] == b[3]);
+}
+
+// Encodes one row of already swizzled pixels as TGA RLE packets into out, returns the bytes written.
+// Packets never cross rows, runs of 2 or more identical pixels become run packets, the rest raw packets.
+// Worst case output is width * channels + width / 128 + 1 bytes.
+inline size_t rleEncodeRow(const uint8_t* row, uint32_t width, uint8_t channels, uint8_t* out)
+{
+	uint8_t* start = out;
+	uint32_t x = 0;
+	while (x < width) {
+		// length of the run of identical pixels starting at x
+		uint32_t run = 1;
+		while (x + run < width && run < 128 && samePixel(row + x * channels, row + (x + run) * channels, channels)) run++;
+
+		if (run >= 2) {
+			*out++ = static_cast<uint8_t>(0x80 | (run - 1));
+			memcpy(out, row + x * channels, channels);
+			out += channels;
+			x += run;
+			continue;
+		}
+
+		// raw packet up to the next run of at least 2 pixels
+		uint32_t first = x;
+		uint32_t count = 0;
+		while (x < width && count < 128) {
+			if (x + 1 < width && samePixel(row + x * channels, row + (x + 1) * channels, channels)) break;
+			x++;
+			count++;
+		}
+		*out++ = static_cast<uint8_t>(count - 1);
+		memcpy(out, row + first * channels, count * channels);
+		out += count * channels;
+	}
+	return out - start;
+}
+
+// Writes an uncompressed (type 2) or RLE compressed (type 10) TGA.
+// Rows are swizzled straight into an output buffer and the file is written in large chunks instead of per byte.
+inline bool tga_write(const std::string& filename, uint32_t width, uint32_t height, const uint8_t* dataRGB, uint8_t dataChannels = 4, uint8_t fileChannels = 3, bool rle = false)
+{
+	if (width > 0xFFFF || height > 0xFFFF) {
+		std::cerr << "Error: TGA stores dimensions in 16 bits, " << width << "x" << height << " is too large: " << filename << std::endl;
+		return false;
+	}
+
+	FILE* fp = openForWriting(filename.c_str());
+	if (fp == NULL) {
+		std::cerr << "Error: Unable to open file for writing: " << filename << std::endl;
+		return false;
+	}
+
+	uint8_t header[18];
+	tgaHeader(header, width, height, fileChannels, rle, true);
+
+	// room for a full chunk plus one worst case row
+	const size_t flushSize = 1 << 20;
+	size_t rowBytes = (size_t)width * fileChannels;
+	std::vector<uint8_t> buffer(flushSize + 2 * rowBytes + 32);
+	std::vector<uint8_t> row(rle ? rowBytes : 0);
+
+	memcpy(buffer.data(), header, 18);
+	size_t used = 18;
+	bool ok = true;
+
+	// Write image data row by row, but start from the bottom row and move upward
+	for (int32_t y = height - 1; y >= 0; --y)
+	{
+		const uint8_t* src = dataRGB + (size_t)y * width * dataChannels;
+		if (rle) {
+			swizzleRow(src, row.data(), width, dataChannels, fileChannels);
+			used += rleEncodeRow(row.data(), width, fileChannels, buffer.data() + used);
+		} else {
+			swizzleRow(src, buffer.data() + used, width, dataChannels, fileChannels);
+			used += rowBytes;
+		}
+
+		if (used >= flushSize) {
+			ok = ok && fwrite(buffer.data(), 1, used, fp) == used;
+			used = 0;
+		}
+	}
+	ok = ok && fwrite(buffer.data(), 1, used, fp) == used;
+
+	ok = (fclose(fp) == 0) && ok;
+	if (!ok) std::cerr << "Error: Failed writing " << filename << std::endl;
+	return ok;
+}
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef TONEMAP_H
+#define TONEMAP_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include "framebuffer.h"
+#include "cpudispatch.h"
+#include "arena.h"
+
+// How the linear HDR frame is squeezed into 8-bit colour.
+// The defaults (clamp, exposure 1, gamma 1) give the same look the renderer always had,
+// the difference is that the clamp now happens once at the end instead of after every light.
+enum class ToneMapOperator {
+    Clamp,
+    Reinhard,
+    ACES
+};
+
+struct ToneMapSettings {
+    ToneMapOperator op = ToneMapOperator::Clamp;
+    float exposure = 1.0f;
+    float gamma = 1.0f;       // 2.2 for a display gamma curve
+    float whitePoint = 255.0f; // radiance that maps to 1.0 before the operator, the shading works on a 0-255 scale
+};
+
+// Narkowicz's fit of the ACES filmic curve
+inline float acesFilm(float x) {
+    float v = (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f);
+    return std::min(std::max(v, 0.0f), 1.0f);
+}
+
+// Applies exposure and the operator to one plane of a row, writes values in [0, 1].
+// Each operator gets its own branch-free loop so they all vectorize.
+inline void toneMapRowBody(const float* __restrict in, float* __restrict out, int n, const ToneMapSettings& settings) {
+    float scale = settings.exposure / settings.whitePoint;
+    switch (settings.op) {
+    case ToneMapOperator::Clamp:
+        for (int i = 0; i < n; i++) out[i] = std::min(std::max(in[i] * scale, 0.0f), 1.0f);
+        break;
+    case ToneMapOperator::Reinhard:
+        for (int i = 0; i < n; i++) {
+            float v = std::max(in[i] * scale, 0.0f);
+            out[i] = v / (1.0f + v);
+        }
+        break;
+    case ToneMapOperator::ACES:
+        for (int i = 0; i < n; i++) out[i] = acesFilm(std::max(in[i] * scale, 0.0f));
+        break;
+    }
+}
+
+RT_DISPATCH_KERNEL(toneMapRow,
+    (const float* __restrict in, float* __restrict out, int n, const ToneMapSettings& settings),
+    (in, out, n, settings),
+    toneMapRowBody)
+
+// Table from a 12 bit tone-mapped value to the final gamma corrected 8-bit value,
+// so the resolve doesn't call pow per channel
+const int gammaTableSize = 4096;
+
+inline void buildGammaTable(float gamma, uint8_t* table) {
+    for (int i = 0; i < gammaTableSize; i++) {
+        double v = std::pow(i / double(gammaTableSize - 1), 1.0 / gamma);
+        table[i] = static_cast<uint8_t>(v * 255.0 + 0.5);
+    }
+}
+
+// Interleaves the three tone-mapped planes of a row into 8-bit RGB, straight or through the gamma table
+inline void quantizeRowBody(const float* __restrict mr, const float* __restrict mg, const float* __restrict mb, unsigned char* __restrict out, int width) {
+    for (int x = 0; x < width; x++) {
+        out[x * 3] = static_cast<unsigned char>(mr[x] * 255.0f + 0.5f);
+        out[x * 3 + 1] = static_cast<unsigned char>(mg[x] * 255.0f + 0.5f);
+        out[x * 3 + 2] = static_cast<unsigned char>(mb[x] * 255.0f + 0.5f);
+    }
+}
+
+inline void quantizeRowGammaBody(const float* __restrict mr, const float* __restrict mg, const float* __restrict mb, unsigned char* __restrict out, int width, const uint8_t* table) {
+    const float last = gammaTableSize - 1;
+    for (int x = 0; x < width; x++) {
+        out[x * 3] = table[static_cast<int>(mr[x] * last + 0.5f)];
+        out[x * 3 + 1] = table[static_cast<int>(mg[x] * last + 0.5f)];
+        out[x * 3 + 2] = table[static_cast<int>(mb[x] * last + 0.5f)];
+    }
+}
+
+RT_DISPATCH_KERNEL(quantizeRow,
+    (const float* __restrict mr, const float* __restrict mg, const float* __restrict mb, unsigned char* __restrict out, int width),
+    (mr, mg, mb, out, width),
+    quantizeRowBody)
+
+RT_DISPATCH_KERNEL(quantizeRowGamma,
+    (const float* __restrict mr, const float* __restrict mg, const float* __restrict mb, unsigned char* __restrict out, int width, const uint8_t* table),
+    (mr, mg, mb, out, width, table),
+    quantizeRowGammaBody)
+
+// The one pass from the HDR frame to interleaved 8-bit RGB: exposure, tone curve,
+// gamma and quantization, row by row. Only rows [rowBegin, rowEnd) of the frame are
+// resolved, rgb receives them tightly packed starting with rowBegin.
+inline void resolveRows(const FrameBuffer& frame, int rowBegin, int rowEnd, unsigned char* rgb, const ToneMapSettings& settings) {
+    int width = frame.width;
+    bool linear = settings.gamma == 1.0f;
+    ScratchArena& scratch = threadScratch();
+    ScratchScope scope(scratch);
+    uint8_t* gammaTable = nullptr;
+    if (!linear) {
+        gammaTable = scratch.allocate<uint8_t>(gammaTableSize);
+        buildGammaTable(settings.gamma, gammaTable);
+    }
+
+    float* mr = scratch.allocate<float>(static_cast<size_t>(width) * 3);
+    float* mg = mr + width;
+    float* mb = mg + width;
+
+    for (int y = rowBegin; y < rowEnd; y++) {
+        size_t row = static_cast<size_t>(y) * width;
+        toneMapRow(frame.r.data() + row, mr, width, settings);
+        toneMapRow(frame.g.data() + row, mg, width, settings);
+        toneMapRow(frame.b.data() + row, mb, width, settings);
+
+        unsigned char* out = rgb + static_cast<size_t>(y - rowBegin) * width * 3;
+        if (linear) {
+            quantizeRow(mr, mg, mb, out, width);
+        } else {
+            quantizeRowGamma(mr, mg, mb, out, width, gammaTable);
+        }
+    }
+}
+
+inline void resolve(const FrameBuffer& frame, unsigned char* rgb, const ToneMapSettings& settings) {
+    resolveRows(frame, 0, frame.height, rgb, settings);
+}
+
+#endif
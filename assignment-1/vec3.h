@@ -1,68 +1,74 @@
 #ifndef VEC3_H
 #define VEC3_H
 
+#include <algorithm>
 #include <cmath>
 #include <iostream>
-#include <bits/stdc++.h>
-#include <array>
 
-
-class Vec3 {
+// A 3d vector of T, double everywhere in the renderer. The float version and the SIMD packets
+// of vec3simd.h have the same operators, so kernels written as templates work on any of them.
+template<typename T>
+class Vec3T {
 public:
-    double x, y, z;
+    T x, y, z;
+
+    Vec3T(T x, T y, T z) : x(x), y(y), z(z) {}
 
-    Vec3(double x, double y, double z) : x(x), y(y), z(z) {}
+    // between precisions, always spelled out
+    template<typename U>
+    explicit Vec3T(const Vec3T<U>& v) : x(static_cast<T>(v.x)), y(static_cast<T>(v.y)), z(static_cast<T>(v.z)) {}
 
-    void print() {
+    void print() const {
         std::cout << '[' << x << ", " << y << ", " << z << ']' << std::endl;
     }
 
-    Vec3& operator=(const Vec3& v2) {
-        x = v2.x; 
-        y = v2.y;
-        z = v2.z;
-        return *this;
+    Vec3T operator+(const Vec3T& v2) const {
+        return Vec3T(x + v2.x, y + v2.y, z + v2.z);
     }
 
-    Vec3 operator+(const Vec3& v2) const {
-        return Vec3(x + v2.x, y + v2.y, z + v2.z);
+    Vec3T operator-(const Vec3T& v2) const {
+        return Vec3T(x - v2.x, y - v2.y, z - v2.z);
     }
 
-    Vec3 operator-(const Vec3& v2) const {
-        return Vec3(x - v2.x, y - v2.y, z - v2.z);
+    Vec3T operator-() const {
+        return Vec3T(-x, -y, -z);
     }
 
-    Vec3 operator*(double t) const {
-        return Vec3(x * t, y * t, z * t);
+    Vec3T operator*(T t) const {
+        return Vec3T(x * t, y * t, z * t);
     }
 
-    Vec3 operator/(double t) const{
-        return Vec3(x / t, y / t, z / t);
+    Vec3T operator/(T t) const{
+        return Vec3T(x / t, y / t, z / t);
     }
 
-    double length() const {
+    T length() const {
+        using std::sqrt;
         return sqrt(x * x + y * y + z * z);
     }
-    Vec3 unit_vector() const {
-        double l = length();
-        return Vec3(x / l, y / l, z / l);
+    Vec3T unit_vector() const {
+        T l = length();
+        return Vec3T(x / l, y / l, z / l);
     }
-    Vec3 clamp(double low, double high) {
-        return Vec3(std::clamp(x,low,high), std::clamp(y,low,high), std::clamp(z,low,high));
+    Vec3T clamp(T low, T high) const {
+        return Vec3T(std::clamp(x,low,high), std::clamp(y,low,high), std::clamp(z,low,high));
     }
-    double dot(const Vec3& v2) const {
+    T dot(const Vec3T& v2) const {
         return x * v2.x + y * v2.y + z * v2.z;
     }
 
-    double magnitude() const {
-        return sqrt(x * x + y * y + z * z);
+    T magnitude() const {
+        return length();
     }
 
-    Vec3 cross(const Vec3& v2) {
-        return Vec3(y * v2.z - v2.y * z, v2.x * z - x * v2.z, x * v2.y - v2.x * y);
+    Vec3T cross(const Vec3T& v2) const {
+        return Vec3T(y * v2.z - v2.y * z, v2.x * z - x * v2.z, x * v2.y - v2.x * y);
     }
 };
 
+using Vec3 = Vec3T<double>;
+using Vec3f = Vec3T<float>;
+
 using Color = Vec3;
 
 using Point3 = Vec3;
@@ -0,0 +1,241 @@
+#ifndef VEC3SIMD_H
+#define VEC3SIMD_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include "vec3.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#define VEC3SIMD_SSE 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define VEC3SIMD_NEON 1
+#endif
+
+#if defined(__AVX__)
+#define VEC3SIMD_AVX 1
+#endif
+
+// SIMD packets of floats and of 3d vectors, one lane per ray (or per primitive). A Vec3x8f is
+// eight Vec3f side by side, stored as one packet of x, one of y and one of z (SoA). Its
+// operators are the ones of Vec3T, so a kernel written as a template over the vector type
+// runs on one double, one float or eight floats at a time:
+//
+//     template<typename V, typename S>
+//     S sphereDiscriminant(const V& origin, const V& direction, const V& centre, S radius) {...}
+//
+// Floatx4 is SSE on x86 and NEON on ARM, Floatx8 is AVX (compile with -mavx2 -mfma). Without
+// them both fall back to plain arrays, which the compiler vectorises as well as it can.
+// Comparisons give masks with every bit of a lane set where they hold, select() and any()
+// take those.
+
+class Floatx4 {
+public:
+    static constexpr int lanes = 4;
+#if defined(VEC3SIMD_SSE)
+    __m128 v;
+    Floatx4(__m128 v) : v(v) {}
+    Floatx4(float f) : v(_mm_set1_ps(f)) {}
+    static Floatx4 load(const float* p) { return _mm_loadu_ps(p); }
+    void store(float* p) const { _mm_storeu_ps(p, v); }
+    friend Floatx4 operator+(Floatx4 a, Floatx4 b) { return _mm_add_ps(a.v, b.v); }
+    friend Floatx4 operator-(Floatx4 a, Floatx4 b) { return _mm_sub_ps(a.v, b.v); }
+    friend Floatx4 operator*(Floatx4 a, Floatx4 b) { return _mm_mul_ps(a.v, b.v); }
+    friend Floatx4 operator/(Floatx4 a, Floatx4 b) { return _mm_div_ps(a.v, b.v); }
+    friend Floatx4 operator<(Floatx4 a, Floatx4 b) { return _mm_cmplt_ps(a.v, b.v); }
+    friend Floatx4 operator<=(Floatx4 a, Floatx4 b) { return _mm_cmple_ps(a.v, b.v); }
+    friend Floatx4 operator>(Floatx4 a, Floatx4 b) { return _mm_cmpgt_ps(a.v, b.v); }
+    friend Floatx4 operator>=(Floatx4 a, Floatx4 b) { return _mm_cmpge_ps(a.v, b.v); }
+    friend Floatx4 operator&(Floatx4 a, Floatx4 b) { return _mm_and_ps(a.v, b.v); }
+    friend Floatx4 operator|(Floatx4 a, Floatx4 b) { return _mm_or_ps(a.v, b.v); }
+    friend Floatx4 sqrt(Floatx4 a) { return _mm_sqrt_ps(a.v); }
+    friend Floatx4 min(Floatx4 a, Floatx4 b) { return _mm_min_ps(a.v, b.v); }
+    friend Floatx4 max(Floatx4 a, Floatx4 b) { return _mm_max_ps(a.v, b.v); }
+    // mask ? a : b, lane by lane
+    friend Floatx4 select(Floatx4 mask, Floatx4 a, Floatx4 b) { return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)); }
+    // bit i set where lane i of the mask is
+    friend int bits(Floatx4 mask) { return _mm_movemask_ps(mask.v); }
+#elif defined(VEC3SIMD_NEON)
+    float32x4_t v;
+    Floatx4(float32x4_t v) : v(v) {}
+    Floatx4(float f) : v(vdupq_n_f32(f)) {}
+    static Floatx4 load(const float* p) { return vld1q_f32(p); }
+    void store(float* p) const { vst1q_f32(p, v); }
+    friend Floatx4 operator+(Floatx4 a, Floatx4 b) { return vaddq_f32(a.v, b.v); }
+    friend Floatx4 operator-(Floatx4 a, Floatx4 b) { return vsubq_f32(a.v, b.v); }
+    friend Floatx4 operator*(Floatx4 a, Floatx4 b) { return vmulq_f32(a.v, b.v); }
+    friend Floatx4 operator/(Floatx4 a, Floatx4 b) { return vdivq_f32(a.v, b.v); }
+    friend Floatx4 operator<(Floatx4 a, Floatx4 b) { return vreinterpretq_f32_u32(vcltq_f32(a.v, b.v)); }
+    friend Floatx4 operator<=(Floatx4 a, Floatx4 b) { return vreinterpretq_f32_u32(vcleq_f32(a.v, b.v)); }
+    friend Floatx4 operator>(Floatx4 a, Floatx4 b) { return vreinterpretq_f32_u32(vcgtq_f32(a.v, b.v)); }
+    friend Floatx4 operator>=(Floatx4 a, Floatx4 b) { return vreinterpretq_f32_u32(vcgeq_f32(a.v, b.v)); }
+    friend Floatx4 operator&(Floatx4 a, Floatx4 b) { return vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(a.v), vreinterpretq_u32_f32(b.v))); }
+    friend Floatx4 operator|(Floatx4 a, Floatx4 b) { return vreinterpretq_f32_u32(vorrq_u32(vreinterpretq_u32_f32(a.v), vreinterpretq_u32_f32(b.v))); }
+    friend Floatx4 sqrt(Floatx4 a) { return vsqrtq_f32(a.v); }
+    friend Floatx4 min(Floatx4 a, Floatx4 b) { return vminq_f32(a.v, b.v); }
+    friend Floatx4 max(Floatx4 a, Floatx4 b) { return vmaxq_f32(a.v, b.v); }
+    friend Floatx4 select(Floatx4 mask, Floatx4 a, Floatx4 b) { return vbslq_f32(vreinterpretq_u32_f32(mask.v), a.v, b.v); }
+    friend int bits(Floatx4 mask) {
+        uint32_t m[4];
+        vst1q_u32(m, vreinterpretq_u32_f32(mask.v));
+        return (m[0] >> 31) | ((m[1] >> 31) << 1) | ((m[2] >> 31) << 2) | ((m[3] >> 31) << 3);
+    }
+#else
+    float v[4];
+    Floatx4(float f) { for (int i = 0; i < 4; i++) v[i] = f; }
+    static Floatx4 load(const float* p) { Floatx4 r(0.0f); std::memcpy(r.v, p, sizeof(r.v)); return r; }
+    void store(float* p) const { std::memcpy(p, v, sizeof(v)); }
+    template<typename F>
+    static Floatx4 map(Floatx4 a, Floatx4 b, F f) { Floatx4 r(0.0f); for (int i = 0; i < 4; i++) r.v[i] = f(a.v[i], b.v[i]); return r; }
+    static float mask(bool b) { uint32_t m = b ? 0xffffffffu : 0u; float f; std::memcpy(&f, &m, 4); return f; }
+    static uint32_t raw(float f) { uint32_t m; std::memcpy(&m, &f, 4); return m; }
+    friend Floatx4 operator+(Floatx4 a, Floatx4 b) { return map(a, b, [](float x, float y) { return x + y; }); }
+    friend Floatx4 operator-(Floatx4 a, Floatx4 b) { return map(a, b, [](float x, float y) { return x - y; }); }
+    friend Floatx4 operator*(Floatx4 a, Floatx4 b) { return map(a, b, [](float x, float y) { return x * y; }); }
+    friend Floatx4 operator/(Floatx4 a, Floatx4 b) { return map(a, b, [](float x, float y) { return x / y; }); }
+    friend Floatx4 operator<(Floatx4 a, Floatx4 b) { return map(a, b, [](float x, float y) { return mask(x < y); }); }
+    friend Floatx4 operator<=(Floatx4 a, Floatx4 b) { return map(a, b, [](float x, float y) { return mask(x <= y); }); }
+    friend Floatx4 operator>(Floatx4 a, Floatx4 b) { return map(a, b, [](float x, float y) { return mask(x > y); }); }
+    friend Floatx4 operator>=(Floatx4 a, Floatx4 b) { return map(a, b, [](float x, float y) { return mask(x >= y); }); }
+    friend Floatx4 operator&(Floatx4 a, Floatx4 b) { return map(a, b, [](float x, float y) { uint32_t m = raw(x) & raw(y); float f; std::memcpy(&f, &m, 4); return f; }); }
+    friend Floatx4 operator|(Floatx4 a, Floatx4 b) { return map(a, b, [](float x, float y) { uint32_t m = raw(x) | raw(y); float f; std::memcpy(&f, &m, 4); return f; }); }
+    friend Floatx4 sqrt(Floatx4 a) { return map(a, a, [](float x, float) { return std::sqrt(x); }); }
+    friend Floatx4 min(Floatx4 a, Floatx4 b) { return map(a, b, [](float x, float y) { return y < x ? y : x; }); }
+    friend Floatx4 max(Floatx4 a, Floatx4 b) { return map(a, b, [](float x, float y) { return x < y ? y : x; }); }
+    friend Floatx4 select(Floatx4 mask, Floatx4 a, Floatx4 b) { Floatx4 r(0.0f); for (int i = 0; i < 4; i++) r.v[i] = raw(mask.v[i]) ? a.v[i] : b.v[i]; return r; }
+    friend int bits(Floatx4 mask) { int r = 0; for (int i = 0; i < 4; i++) r |= (raw(mask.v[i]) >> 31) << i; return r; }
+#endif
+    Floatx4() : Floatx4(0.0f) {}
+    friend Floatx4 operator-(Floatx4 a) { return Floatx4(0.0f) - a; }
+    friend bool any(Floatx4 mask) { return bits(mask) != 0; }
+    float operator[](int i) const { float f[4]; store(f); return f[i]; }
+};
+
+class Floatx8 {
+public:
+    static constexpr int lanes = 8;
+#if defined(VEC3SIMD_AVX)
+    __m256 v;
+    Floatx8(__m256 v) : v(v) {}
+    Floatx8(float f) : v(_mm256_set1_ps(f)) {}
+    static Floatx8 load(const float* p) { return _mm256_loadu_ps(p); }
+    void store(float* p) const { _mm256_storeu_ps(p, v); }
+    friend Floatx8 operator+(Floatx8 a, Floatx8 b) { return _mm256_add_ps(a.v, b.v); }
+    friend Floatx8 operator-(Floatx8 a, Floatx8 b) { return _mm256_sub_ps(a.v, b.v); }
+    friend Floatx8 operator*(Floatx8 a, Floatx8 b) { return _mm256_mul_ps(a.v, b.v); }
+    friend Floatx8 operator/(Floatx8 a, Floatx8 b) { return _mm256_div_ps(a.v, b.v); }
+    friend Floatx8 operator<(Floatx8 a, Floatx8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+    friend Floatx8 operator<=(Floatx8 a, Floatx8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+    friend Floatx8 operator>(Floatx8 a, Floatx8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+    friend Floatx8 operator>=(Floatx8 a, Floatx8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+    friend Floatx8 operator&(Floatx8 a, Floatx8 b) { return _mm256_and_ps(a.v, b.v); }
+    friend Floatx8 operator|(Floatx8 a, Floatx8 b) { return _mm256_or_ps(a.v, b.v); }
+    friend Floatx8 sqrt(Floatx8 a) { return _mm256_sqrt_ps(a.v); }
+    friend Floatx8 min(Floatx8 a, Floatx8 b) { return _mm256_min_ps(a.v, b.v); }
+    friend Floatx8 max(Floatx8 a, Floatx8 b) { return _mm256_max_ps(a.v, b.v); }
+    friend Floatx8 select(Floatx8 mask, Floatx8 a, Floatx8 b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+    friend int bits(Floatx8 mask) { return _mm256_movemask_ps(mask.v); }
+#else
+    // two halves, each as wide as the machine goes
+    Floatx4 lo, hi;
+    Floatx8(Floatx4 lo, Floatx4 hi) : lo(lo), hi(hi) {}
+    Floatx8(float f) : lo(f), hi(f) {}
+    static Floatx8 load(const float* p) { return Floatx8(Floatx4::load(p), Floatx4::load(p + 4)); }
+    void store(float* p) const { lo.store(p); hi.store(p + 4); }
+    friend Floatx8 operator+(Floatx8 a, Floatx8 b) { return Floatx8(a.lo + b.lo, a.hi + b.hi); }
+    friend Floatx8 operator-(Floatx8 a, Floatx8 b) { return Floatx8(a.lo - b.lo, a.hi - b.hi); }
+    friend Floatx8 operator*(Floatx8 a, Floatx8 b) { return Floatx8(a.lo * b.lo, a.hi * b.hi); }
+    friend Floatx8 operator/(Floatx8 a, Floatx8 b) { return Floatx8(a.lo / b.lo, a.hi / b.hi); }
+    friend Floatx8 operator<(Floatx8 a, Floatx8 b) { return Floatx8(a.lo < b.lo, a.hi < b.hi); }
+    friend Floatx8 operator<=(Floatx8 a, Floatx8 b) { return Floatx8(a.lo <= b.lo, a.hi <= b.hi); }
+    friend Floatx8 operator>(Floatx8 a, Floatx8 b) { return Floatx8(a.lo > b.lo, a.hi > b.hi); }
+    friend Floatx8 operator>=(Floatx8 a, Floatx8 b) { return Floatx8(a.lo >= b.lo, a.hi >= b.hi); }
+    friend Floatx8 operator&(Floatx8 a, Floatx8 b) { return Floatx8(a.lo & b.lo, a.hi & b.hi); }
+    friend Floatx8 operator|(Floatx8 a, Floatx8 b) { return Floatx8(a.lo | b.lo, a.hi | b.hi); }
+    friend Floatx8 sqrt(Floatx8 a) { return Floatx8(sqrt(a.lo), sqrt(a.hi)); }
+    friend Floatx8 min(Floatx8 a, Floatx8 b) { return Floatx8(min(a.lo, b.lo), min(a.hi, b.hi)); }
+    friend Floatx8 max(Floatx8 a, Floatx8 b) { return Floatx8(max(a.lo, b.lo), max(a.hi, b.hi)); }
+    friend Floatx8 select(Floatx8 mask, Floatx8 a, Floatx8 b) { return Floatx8(select(mask.lo, a.lo, b.lo), select(mask.hi, a.hi, b.hi)); }
+    friend int bits(Floatx8 mask) { return bits(mask.lo) | (bits(mask.hi) << 4); }
+#endif
+    Floatx8() : Floatx8(0.0f) {}
+    friend Floatx8 operator-(Floatx8 a) { return Floatx8(0.0f) - a; }
+    friend bool any(Floatx8 mask) { return bits(mask) != 0; }
+    float operator[](int i) const { float f[8]; store(f); return f[i]; }
+};
+
+// Vec3T over a packet of floats, every lane is its own vector
+template<typename F>
+class Vec3P {
+public:
+    static constexpr int lanes = F::lanes;
+    F x, y, z;
+
+    Vec3P() {}
+    Vec3P(F x, F y, F z) : x(x), y(y), z(z) {}
+    // the same vector in every lane
+    explicit Vec3P(const Vec3f& v) : x(v.x), y(v.y), z(v.z) {}
+    explicit Vec3P(const Vec3& v) : x(static_cast<float>(v.x)), y(static_cast<float>(v.y)), z(static_cast<float>(v.z)) {}
+
+    // lanes vectors from SoA arrays of floats
+    static Vec3P load(const float* px, const float* py, const float* pz) {
+        return Vec3P(F::load(px), F::load(py), F::load(pz));
+    }
+    void store(float* px, float* py, float* pz) const {
+        x.store(px);
+        y.store(py);
+        z.store(pz);
+    }
+    Vec3f lane(int i) const {
+        return Vec3f(x[i], y[i], z[i]);
+    }
+
+    Vec3P operator+(const Vec3P& v2) const {
+        return Vec3P(x + v2.x, y + v2.y, z + v2.z);
+    }
+
+    Vec3P operator-(const Vec3P& v2) const {
+        return Vec3P(x - v2.x, y - v2.y, z - v2.z);
+    }
+
+    Vec3P operator-() const {
+        return Vec3P(-x, -y, -z);
+    }
+
+    Vec3P operator*(F t) const {
+        return Vec3P(x * t, y * t, z * t);
+    }
+
+    Vec3P operator/(F t) const {
+        return Vec3P(x / t, y / t, z / t);
+    }
+
+    F length() const {
+        return sqrt(x * x + y * y + z * z);
+    }
+    Vec3P unit_vector() const {
+        F l = length();
+        return Vec3P(x / l, y / l, z / l);
+    }
+    Vec3P clamp(F low, F high) const {
+        return Vec3P(min(max(x, low), high), min(max(y, low), high), min(max(z, low), high));
+    }
+    F dot(const Vec3P& v2) const {
+        return x * v2.x + y * v2.y + z * v2.z;
+    }
+
+    F magnitude() const {
+        return length();
+    }
+
+    Vec3P cross(const Vec3P& v2) const {
+        return Vec3P(y * v2.z - v2.y * z, v2.x * z - x * v2.z, x * v2.y - v2.x * y);
+    }
+};
+
+using Vec3x4f = Vec3P<Floatx4>;
+using Vec3x8f = Vec3P<Floatx8>;
+
+#endif